@@ -26,16 +26,18 @@ void copy_object(const T *src, T *dst)
 	*dst = *src;
 }
 
-template <typename KEY, typename VAL>
+// ALLOC is rebound to the list nodes, e.g. sax::slab_allocator<KEY> in slabutil.h
+template <typename KEY, typename VAL, typename ALLOC = std::allocator<KEY> >
 class crumb
 {
 public:
-	typedef crumb<KEY, VAL> self_type;
+	typedef crumb<KEY, VAL, ALLOC> self_type;
 	typedef KEY key_type;
 	typedef VAL value_type;
 	
 	typedef struct {time_t tick; KEY key; VAL val;} DataTriple;
-	typedef std::list<DataTriple> DataList;
+	typedef typename ALLOC::template rebind<DataTriple>::other DataAlloc;
+	typedef std::list<DataTriple, DataAlloc> DataList;
 	typedef typename DataList::iterator DataIter;
 	typedef sax::hashmap<KEY, DataIter> IndexDict;
 	
@@ -136,8 +138,8 @@ public:
 	inline size_t size() const { return _idx.size(); }
 
 protected:
-	crumb(const crumb<KEY, VAL> &other);
-	crumb<KEY, VAL> &operator=(const crumb<KEY, VAL> &other);
+	crumb(const self_type &other);
+	self_type &operator=(const self_type &other);
 
 protected:
 	virtual void onErase(const KEY &key, const VAL &val) {}
@@ -15,15 +15,17 @@
 
 namespace sax {
 
-template<typename KEY>
+// ALLOC is rebound to the list nodes, e.g. sax::slab_allocator<KEY> in slabutil.h
+template<typename KEY, typename ALLOC = std::allocator<KEY> >
 class expire
 {
 public:
-	typedef expire<KEY> self_type;
+	typedef expire<KEY, ALLOC> self_type;
 	typedef KEY key_type;
 	
 	typedef struct {time_t tick; KEY key;} DataPair;
-	typedef std::list<DataPair> DataList;
+	typedef typename ALLOC::template rebind<DataPair>::other DataAlloc;
+	typedef std::list<DataPair, DataAlloc> DataList;
 	typedef typename DataList::iterator DataIter;
 	typedef sax::hashmap<KEY, DataIter> IndexDict;
 	
@@ -110,8 +112,8 @@ public:
 	inline size_t size() const { return _idx.size(); }
 
 protected:
-	expire(const expire<KEY> &other);
-	expire<KEY> &operator=(const expire<KEY> &other);
+	expire(const self_type &other);
+	self_type &operator=(const self_type &other);
 
 protected:
 	virtual void onErase(const KEY &key) {}
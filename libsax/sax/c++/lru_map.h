@@ -18,16 +18,18 @@ namespace sax {
 // A linked list (std::list) is used for element container:
 // First entry is element which has been used most recently.
 // Last entry is element which has been used least recently.
+// alloc_t is for the list nodes, e.g. sax::slab_allocator in slabutil.h
 
-template<class key_t, class val_t>
+template<class key_t, class val_t,
+		class alloc_t = std::allocator<std::pair<key_t, val_t> > >
 class LRU_map
 {
 public:
-	typedef LRU_map<key_t, val_t> self_type;
+	typedef LRU_map<key_t, val_t, alloc_t> self_type;
 	typedef key_t key_type;
 	typedef val_t value_type;
 	
-	typedef std::list<std::pair<key_t, val_t> > list_t;
+	typedef std::list<std::pair<key_t, val_t>, alloc_t> list_t;
 	typedef typename list_t::iterator iter_t;
 	typedef sax::hashmap<key_t, iter_t> map_t;
 
@@ -13,12 +13,19 @@
  * @date 2011-8-30
  */
 
+#include <sax/compiler.h>
 #include <sax/sysutil.h>
 #include <sax/mempool.h>
 
 #include "nocopy.h"
 #include <new>
 
+#if defined(__GNUC__) || defined(_MSC_VER)
+#define ARENA_TRIVIAL_DTOR(T) __has_trivial_destructor(T)
+#else
+#define ARENA_TRIVIAL_DTOR(T) false
+#endif
+
 namespace sax {
 
 /// template of single-size pool
@@ -206,6 +213,243 @@ protected:
 	struct slab_pool_t *_pool;
 };
 
+/// bump allocator with a bulk reset, e.g. for the objects of one request.
+/// memory comes from a chain of blocks of g_shm_alloc_pages(), objects are
+/// never freed one by one: reset() runs the registered destructors in the
+/// reverse order and rewinds to the first block, keeping all blocks for
+/// reuse. it is not thread-safe.
+class arena : public nocopy
+{
+public:
+	enum { ALIGN = 16 };
+
+	/// "block_size" is rounded up to pages, larger allocations get a block
+	/// of their own size.
+	explicit arena(size_t block_size = 4096) :
+		_head(NULL), _current(NULL), _ptr(NULL), _end(NULL), _dtors(NULL),
+		_pending(NULL), _used(0), _capacity(0)
+	{
+		size_t unit = g_shm_unit();
+		_block_pages = (uint32_t) ((block_size + unit - 1) / unit);
+		if (_block_pages == 0) _block_pages = 1;
+	}
+
+	inline ~arena()
+	{
+		this->reset();
+		while (_head) {
+			block* next = _head->next;
+			g_shm_free_pages(_head);
+			_head = next;
+		}
+	}
+
+	/// @return NULL for failed.
+	inline void* alloc(size_t size, size_t align = ALIGN)
+	{
+		char* p = (char*) (((uintptr_t) _ptr + align - 1) & ~(uintptr_t) (align - 1));
+		if (LIKELY(p != NULL && p <= _end && size <= (size_t) (_end - p))) {
+			_used += p + size - _ptr;
+			_ptr = p + size;
+			return p;
+		}
+		return this->alloc_slow(size, align);
+	}
+
+	template <typename T>
+	inline T* alloc_obj()
+	{
+		void *obj = this->alloc_for<T>();
+		if (obj) return this->registered(new (obj) T());
+		return NULL;
+	}
+
+	template <typename T, class P1>
+	inline T* alloc_obj(const P1 &p1)
+	{
+		void *obj = this->alloc_for<T>();
+		if (obj) return this->registered(new (obj) T(p1));
+		return NULL;
+	}
+
+	template <typename T, class P1, class P2>
+	inline T* alloc_obj(const P1 &p1, const P2 &p2)
+	{
+		void *obj = this->alloc_for<T>();
+		if (obj) return this->registered(new (obj) T(p1, p2));
+		return NULL;
+	}
+
+	template <typename T, class P1, class P2, class P3>
+	inline T* alloc_obj(const P1 &p1, const P2 &p2, const P3 &p3)
+	{
+		void *obj = this->alloc_for<T>();
+		if (obj) return this->registered(new (obj) T(p1, p2, p3));
+		return NULL;
+	}
+
+	/// destroy all objects and make all blocks available again.
+	void reset()
+	{
+		while (_dtors) {
+			dtor_node* node = _dtors;
+			_dtors = node->next;
+			node->func(node->obj);
+		}
+		_current = _head;
+		_ptr = _head ? _head->data() : NULL;
+		_end = _head ? (char*) _head + _head->size : NULL;
+		_used = 0;
+	}
+
+	/// bytes handed out since the last reset(), including the padding.
+	inline size_t used() const { return _used; }
+
+	/// bytes of all blocks.
+	inline size_t capacity() const { return _capacity; }
+
+private:
+	struct block {
+		block* next;
+		size_t size;	// in bytes with this header
+		inline char* data() { return (char*) (this + 1); }
+	};
+
+	struct dtor_node {
+		void (*func)(void*);
+		void* obj;
+		dtor_node* next;
+	};
+
+	template <typename T>
+	static void destroy(void* obj) { static_cast<T*>(obj)->~T(); }
+
+	// the node is taken before the object, so it is always there to link
+	template <typename T>
+	inline void* alloc_for()
+	{
+		if (!ARENA_TRIVIAL_DTOR(T)) {
+			_pending = (dtor_node*) this->alloc(sizeof(dtor_node), sizeof(void*));
+			if (UNLIKELY(_pending == NULL)) return NULL;
+		}
+		return this->alloc(sizeof(T), __alignof__(T) > ALIGN ? __alignof__(T) : ALIGN);
+	}
+
+	template <typename T>
+	inline T* registered(T* obj)
+	{
+		if (!ARENA_TRIVIAL_DTOR(T)) {
+			_pending->func = &arena::destroy<T>;
+			_pending->obj = obj;
+			_pending->next = _dtors;
+			_dtors = _pending;
+		}
+		return obj;
+	}
+
+	// move to the next block that fits, or chain a new one after the current
+	void* alloc_slow(size_t size, size_t align)
+	{
+		block* next = _current ? _current->next : _head;
+		size_t need = sizeof(block) + size + align - 1;
+		if (next == NULL || next->size < need) {
+			size_t unit = g_shm_unit();
+			uint32_t pages = (uint32_t) ((need + unit - 1) / unit);
+			if (pages < _block_pages) pages = _block_pages;
+
+			block* b = (block*) g_shm_alloc_pages(pages);
+			if (UNLIKELY(b == NULL)) return NULL;
+			b->size = (size_t) pages * unit;
+			_capacity += b->size;
+			if (_current) {
+				b->next = _current->next;
+				_current->next = b;
+			}
+			else {
+				b->next = _head;
+				_head = b;
+			}
+			next = b;
+		}
+
+		_current = next;
+		_used += _end - _ptr;	// the tail of the last block is wasted
+		_ptr = next->data();
+		_end = (char*) next + next->size;
+		return this->alloc(size, align);
+	}
+
+	block* _head;
+	block* _current;
+	char* _ptr;
+	char* _end;
+	dtor_node* _dtors;
+	dtor_node* _pending;
+	size_t _used;
+	size_t _capacity;
+	uint32_t _block_pages;
+};
+
+/// STL allocator on an arena, deallocate() does nothing: the memory is
+/// given back by arena::reset(). the containers must not outlive it.
+template <typename _Tp>
+class arena_allocator
+{
+public:
+	typedef size_t     size_type;
+	typedef ptrdiff_t  difference_type;
+	typedef _Tp*       pointer;
+	typedef const _Tp* const_pointer;
+	typedef _Tp&       reference;
+	typedef const _Tp& const_reference;
+	typedef _Tp        value_type;
+
+	template <typename _Tp1>
+	struct rebind
+	{typedef arena_allocator<_Tp1> other;};
+
+	arena_allocator(arena* __a) throw() : _arena(__a) { }
+
+	arena_allocator(const arena_allocator& __a) throw() : _arena(__a._arena) { }
+
+	template<typename _Tp1>
+	arena_allocator(const arena_allocator<_Tp1>& __a) throw() : _arena(__a._arena) { }
+
+	~arena_allocator() throw() { }
+
+	pointer address(reference __x) const { return &__x; }
+
+	const_pointer address(const_reference __x) const { return &__x; }
+
+	pointer allocate(size_type __n, const void* = 0)
+	{
+		void* ptr = _arena->alloc(__n * sizeof(_Tp),
+				__alignof__(_Tp) > arena::ALIGN ? __alignof__(_Tp) : arena::ALIGN);
+		if (UNLIKELY(ptr == NULL)) throw std::bad_alloc();
+		return static_cast<pointer>(ptr);
+	}
+
+	void deallocate(pointer __p, size_type __n) throw() { }
+
+	size_type max_size() const throw()
+	{ return size_t(-1) / sizeof(_Tp); }
+
+	void construct(pointer __p, const _Tp& __val)
+	{ ::new((void *)__p) _Tp(__val); }
+
+	void destroy(pointer __p) { __p->~_Tp(); }
+
+	arena* _arena;
+};
+
+template <typename _Tp1, typename _Tp2>
+inline bool operator==(const arena_allocator<_Tp1>& __a, const arena_allocator<_Tp2>& __b)
+{ return __a._arena == __b._arena; }
+
+template <typename _Tp1, typename _Tp2>
+inline bool operator!=(const arena_allocator<_Tp1>& __a, const arena_allocator<_Tp2>& __b)
+{ return __a._arena != __b._arena; }
+
 } // namespace
 
 #endif //__POOLS_H_2011__
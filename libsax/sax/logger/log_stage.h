@@ -8,8 +8,10 @@
 #ifndef _SAX_LOG_STAGE_H_
 #define _SAX_LOG_STAGE_H_
 
+#include <cstring>
 #include "sax/stage/stage.h"
 #include "sax/stage/sax_events.h"
+#include "log_file_writer.h"
 
 namespace sax {
 namespace logger {
@@ -27,22 +29,10 @@ public:
 	{
 		switch(ev->get_type())
 		{
-		case sax::log_event128::ID:
+		case sax::log_event::ID:
 		{
-			sax::log_event128* event = (sax::log_event128*) ev;
-			logger->log(event->body, strlen(event->body));
-			break;
-		}
-		case sax::log_event256::ID:
-		{
-			sax::log_event256* event = (sax::log_event256*) ev;
-			logger->log(event->body, strlen(event->body));
-			break;
-		}
-		case sax::log_event512::ID:
-		{
-			sax::log_event512* event = (sax::log_event512*) ev;
-			logger->log(event->body, strlen(event->body));
+			const sax::log_event* event = (const sax::log_event*) ev;
+			logger->log(event->body(), event->length);
 			break;
 		}
 		}
@@ -57,6 +47,20 @@ public:
 
 };
 
+// copy a log line into the log stage, the event takes exactly "size" bytes
+// of payload in the queue
+inline bool push_log(sax::stage* st, const char* buf, size_t size, bool wait = true)
+{
+	sax::log_event* ev = st->allocate_event_with_payload<sax::log_event>(
+			(int32_t) size, 0, wait);
+	if (ev == NULL) return false;
+
+	ev->length = (int32_t) size;
+	memcpy(ev->body(), buf, size);
+	st->push_event(ev);
+	return true;
+}
+
 } // namespace logger
 } // namespace sax
 
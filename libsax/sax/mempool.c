@@ -821,71 +821,461 @@ void* g_fsb_getblock(struct fsb_pool_t *pool, uint64_t key)
 }
 
 //-----------------------------------------------------------------
+// a Treiber stack of free blocks: the links are (index + 1) of the blocks,
+// 0 for the end, and the head is tagged by a counter bumped on every
+// change against ABA, swapped as a whole by a 64-bit CAS. a process dying
+// in the middle of a call leaks one block at most, the list is consistent.
+#define LFSB_MAGIC		0x6C667362	// "lfsb"
+#define LFSB_CACHE_LINE	64
+
+typedef struct lfsb_pool_t
+{
+	uint32_t magic;
+	uint32_t block_count;
+	uint32_t block_size;	// with the header, a multiple of 8
+	uint32_t data_size;
+	// in different cache lines if the region is aligned to them
+	uint8_t _pad1[LFSB_CACHE_LINE - 16];
+	volatile uint64_t head;	// tag << 32 | (index + 1)
+	uint8_t _pad2[LFSB_CACHE_LINE - 8];
+	volatile int32_t used;
+	uint8_t _pad3[LFSB_CACHE_LINE - 4];
+} lfsb_pool_t;
+
+typedef struct lfsb_block
+{
+	volatile uint32_t next;		// (index + 1) of the next free block
+	volatile uint32_t in_use;
+	uint8_t data[0];
+} lfsb_block;
+
+#define LFSB_BLOCK(p, i) \
+  ((lfsb_block*)(((uint8_t*)(p)) + sizeof(lfsb_pool_t) + (uint64_t)(i) * (p)->block_size))
+
+long g_lfsb_needed(long block_size, int block_count)
+{
+	if (block_size <= 0 || block_count <= 0) return 0;
+	block_size = (block_size + sizeof(lfsb_block) + 7) & ~7L;
+	return sizeof(lfsb_pool_t) + block_size * block_count;
+}
+
+struct lfsb_pool_t *g_lfsb_init(
+	void *addr, long total, long block_size, int block_count)
+{
+	lfsb_pool_t *pool = (lfsb_pool_t *) addr;
+	long needed = g_lfsb_needed(block_size, block_count);
+	int i;
+
+	if (!addr || needed <= 0 || total < needed
+			|| ((uintptr_t) addr & 7) != 0) return NULL;
+
+	pool->magic = 0;
+	pool->block_count = (uint32_t) block_count;
+	pool->block_size = (uint32_t) ((block_size + sizeof(lfsb_block) + 7) & ~7L);
+	pool->data_size = (uint32_t) block_size;
+	pool->used = 0;
+	for (i = 0; i < block_count; i++) {
+		lfsb_block *b = LFSB_BLOCK(pool, i);
+		b->next = (i + 1 < block_count) ? (uint32_t) (i + 2) : 0;
+		b->in_use = 0;
+	}
+	pool->head = 1;
+
+	// the other processes attach after the magic is there
+	__sync_synchronize();
+	pool->magic = LFSB_MAGIC;
+	return pool;
+}
+
+struct lfsb_pool_t *g_lfsb_attach(void *addr)
+{
+	lfsb_pool_t *pool = (lfsb_pool_t *) addr;
+	if (!addr || pool->magic != LFSB_MAGIC) return NULL;
+	__sync_synchronize();
+	return pool;
+}
+
+long g_lfsb_size(struct lfsb_pool_t *pool)
+{
+	return pool->data_size;
+}
+
+int g_lfsb_count(struct lfsb_pool_t *pool)
+{
+	return (int) pool->block_count;
+}
+
+int g_lfsb_used(struct lfsb_pool_t *pool)
+{
+	return pool->used;
+}
+
+void* g_lfsb_alloc(struct lfsb_pool_t *pool)
+{
+	uint64_t old_head, new_head;
+	lfsb_block *b;
+
+	do {
+		old_head = pool->head;
+		if ((uint32_t) old_head == 0) return NULL;
+		b = LFSB_BLOCK(pool, (uint32_t) old_head - 1);
+		// "next" may be changed by its new owner since, then the tag differs
+		new_head = (((old_head >> 32) + 1) << 32) | b->next;
+	} while (!__sync_bool_compare_and_swap(&pool->head, old_head, new_head));
+
+	b->in_use = 1;
+	__sync_fetch_and_add(&pool->used, 1);
+	return b->data;
+}
+
+// the index of "block", or -1 if it is not a block of the pool
+static int64_t lfsb_index(struct lfsb_pool_t *pool, const void *block)
+{
+	int64_t off = (const uint8_t*) block - sizeof(lfsb_block)
+			- ((const uint8_t*) pool + sizeof(lfsb_pool_t));
+	if (off < 0 || off % pool->block_size != 0) return -1;
+	off /= pool->block_size;
+	return (off < pool->block_count) ? off : -1;
+}
+
+int g_lfsb_free(struct lfsb_pool_t *pool, void *block)
+{
+	uint64_t old_head, new_head;
+	int64_t id = lfsb_index(pool, block);
+	lfsb_block *b;
+
+	if (id < 0) return -1;
+	b = LFSB_BLOCK(pool, id);
+	if (!__sync_bool_compare_and_swap(&b->in_use, 1, 0)) return -1;	// freed twice
+
+	do {
+		old_head = pool->head;
+		b->next = (uint32_t) old_head;
+		new_head = (((old_head >> 32) + 1) << 32) | (uint32_t) (id + 1);
+	} while (!__sync_bool_compare_and_swap(&pool->head, old_head, new_head));
+
+	__sync_fetch_and_sub(&pool->used, 1);
+	return 0;
+}
+
+uint64_t g_lfsb_getkey(struct lfsb_pool_t *pool, const void *block)
+{
+	int64_t id = lfsb_index(pool, block);
+	if (id < 0 || !LFSB_BLOCK(pool, id)->in_use) return 0;
+	return (uint64_t) ((const uint8_t*) block - (const uint8_t*) pool);
+}
+
+void* g_lfsb_getblock(struct lfsb_pool_t *pool, uint64_t key)
+{
+	void *block = (uint8_t*) pool + key;
+	int64_t id;
+	if (key == 0 || key >= sizeof(lfsb_pool_t) + (uint64_t) pool->block_count * pool->block_size)
+		return NULL;
+	id = lfsb_index(pool, block);
+	return (id >= 0 && LFSB_BLOCK(pool, id)->in_use) ? block : NULL;
+}
+
+//-----------------------------------------------------------------
+// the blocks are carved out of chunks aligned to their size, so the chunk
+// of a block is found by masking its address. a chunk goes back to the
+// system by shrinking once all of its blocks are free.
+
+#define XSLAB_CHUNK_MIN		4096	/* bytes of a chunk at least */
+#define XSLAB_CHUNK_BLOCKS	8		/* blocks in a chunk at least */
+#define XSLAB_CACHE_LINE	64
+
+typedef struct xslab_chunk_t xslab_chunk_t;
+
+struct xslab_chunk_t
+{
+	xslab_chunk_t* prev;
+	xslab_chunk_t* next;
+	void** head;			/* free blocks of the chunk */
+	uint8_t* start;			/* the first block, after the color */
+	int32_t free_count;
+	int32_t carved;			/* blocks ever handed out */
+};
+
 struct g_xslab_t
 {
-	void** head;
+	xslab_chunk_t partial;	/* chunks with free blocks */
+	xslab_chunk_t full;		/* chunks without free blocks */
+	xslab_chunk_t* current;	/* the chunk being carved */
 	int32_t usable_amount;
-	int32_t shrink_amount;
 	int32_t alloc_size;
+	int32_t chunk_size;
+	int32_t chunk_blocks;	/* blocks in a chunk */
+	int32_t chunk_count;
+	int32_t header_size;	/* the chunk header, aligned */
+	int32_t color_step;		/* 0 for no coloring */
+	int32_t color_span;		/* the unused tail of a chunk */
+	int32_t color_next;
+	g_xslab_stats_t stats;
 };
 
-g_xslab_t* g_xslab_init(int32_t size)
+#define XSLAB_CHUNK_OF(slab, ptr) \
+	((xslab_chunk_t*) ((uintptr_t) (ptr) & ~((uintptr_t) (slab)->chunk_size - 1)))
+#define XSLAB_LIVE(c) ((c)->carved - (c)->free_count)
+
+static void* chunk_alloc(int32_t size)
+{
+#ifdef _MSC_VER
+	return _aligned_malloc(size, size);
+#else
+	void* ptr = NULL;
+	if (posix_memalign(&ptr, size, size) != 0) return NULL;
+	return ptr;
+#endif
+}
+
+static void chunk_free(void* ptr)
+{
+#ifdef _MSC_VER
+	_aligned_free(ptr);
+#else
+	free(ptr);
+#endif
+}
+
+static inline void chunk_unlink(xslab_chunk_t* c)
 {
-	g_xslab_t* slab = (g_xslab_t*)malloc(sizeof(g_xslab_t));
+	c->prev->next = c->next;
+	c->next->prev = c->prev;
+}
+
+static inline void chunk_link_head(xslab_chunk_t* list, xslab_chunk_t* c)
+{
+	c->prev = list;
+	c->next = list->next;
+	list->next->prev = c;
+	list->next = c;
+}
+
+static xslab_chunk_t* chunk_new(g_xslab_t* slab)
+{
+	xslab_chunk_t* c = (xslab_chunk_t*) chunk_alloc(slab->chunk_size);
+	if (c == NULL) return NULL;
+
+	c->head = NULL;
+	c->start = (uint8_t*) c + slab->header_size + slab->color_next;
+	c->free_count = 0;
+	c->carved = 0;
+	chunk_link_head(&slab->full, c);
+	++(slab->chunk_count);
+	++(slab->stats.chunk_allocs);
+	if (slab->chunk_count > slab->stats.chunk_high_water) {
+		slab->stats.chunk_high_water = slab->chunk_count;
+	}
+
+	if (slab->color_step > 0) {
+		slab->color_next += slab->color_step;
+		if (slab->color_next > slab->color_span) slab->color_next = 0;
+	}
+	return c;
+}
+
+// all blocks of the chunk are free, release it. never the current chunk
+static void chunk_drop(g_xslab_t* slab, xslab_chunk_t* c)
+{
+	slab->usable_amount -= c->free_count;
+	slab->stats.retired += c->free_count;
+
+	chunk_unlink(c);
+	chunk_free(c);
+	--(slab->chunk_count);
+	++(slab->stats.chunk_frees);
+}
+
+g_xslab_t* g_xslab_init_ex(int32_t size, int32_t align, int32_t color)
+{
+	int32_t chunk_size = XSLAB_CHUNK_MIN;
+	g_xslab_t* slab;
+
+	if (align <= 0) align = sizeof(void*);
+	if ((align & (align - 1)) != 0 || align > XSLAB_CHUNK_MIN) return NULL;
+
+	slab = (g_xslab_t*)malloc(sizeof(g_xslab_t));
 	if (slab == NULL) return NULL;
 
 	if (size < sizeof(void*)) size = sizeof(void*);
+	size = (size + align - 1) & ~(align - 1);
 
-	slab->head = NULL;
+	slab->header_size = (sizeof(xslab_chunk_t) + align - 1) & ~(align - 1);
+	while ((chunk_size - slab->header_size) / size < XSLAB_CHUNK_BLOCKS) chunk_size <<= 1;
+
+	slab->partial.prev = slab->partial.next = &slab->partial;
+	slab->full.prev = slab->full.next = &slab->full;
+	slab->current = NULL;
 	slab->usable_amount = 0;
-	slab->shrink_amount = 0;
 	slab->alloc_size = size;
+	slab->chunk_size = chunk_size;
+	slab->chunk_blocks = (chunk_size - slab->header_size) / size;
+	slab->chunk_count = 0;
+	slab->color_step = color ? (align > XSLAB_CACHE_LINE ? align : XSLAB_CACHE_LINE) : 0;
+	slab->color_span = chunk_size - slab->header_size - slab->chunk_blocks * size;
+	slab->color_next = 0;
+	memset(&slab->stats, 0, sizeof(slab->stats));
 
 	return slab;
 }
 
+g_xslab_t* g_xslab_init(int32_t size)
+{
+	return g_xslab_init_ex(size, 0, 0);
+}
+
 void g_xslab_destroy(g_xslab_t* slab)
 {
-	while (slab->usable_amount > 0) {
-		void* ptr = slab->head;
-		slab->head = (void**)((slab->head)[0]);
-		--(slab->usable_amount);
-		free(ptr);
+	xslab_chunk_t* lists[2];
+	int i;
+
+	lists[0] = &slab->partial;
+	lists[1] = &slab->full;
+	for (i = 0; i < 2; i++) {
+		while (lists[i]->next != lists[i]) {
+			xslab_chunk_t* c = lists[i]->next;
+			chunk_unlink(c);
+			chunk_free(c);
+		}
 	}
 	free(slab);
 }
 
 void* g_xslab_alloc(g_xslab_t* slab)
 {
-	if (slab->usable_amount > 0) {
-		void* ptr = slab->head;
-		slab->head = (void**)((slab->head)[0]);
+	xslab_chunk_t* c = slab->partial.next;
+	void* ptr;
+
+	if (c != &slab->partial) {
+		ptr = c->head;
+		c->head = (void**)((c->head)[0]);
 		--(slab->usable_amount);
+		if (--(c->free_count) == 0) {
+			chunk_unlink(c);
+			chunk_link_head(&slab->full, c);
+		}
 		return ptr;
 	}
 
-	return malloc(slab->alloc_size);
+	c = slab->current;
+	if (c == NULL || c->carved == slab->chunk_blocks) {
+		c = chunk_new(slab);
+		if (c == NULL) return NULL;
+		slab->current = c;
+	}
+	return c->start + (size_t) slab->alloc_size * (c->carved++);
 }
 
 void g_xslab_free(g_xslab_t* slab, void* ptr)
 {
-	if (LIKELY(slab->shrink_amount == 0)) {
-		((void**)ptr)[0] = slab->head;
-		slab->head = (void**)ptr;
-		++(slab->usable_amount);
+	xslab_chunk_t* c = XSLAB_CHUNK_OF(slab, ptr);
+
+	((void**)ptr)[0] = c->head;
+	c->head = (void**)ptr;
+	++(slab->usable_amount);
+
+	if (++(c->free_count) == 1) {
+		chunk_unlink(c);
+		chunk_link_head(&slab->partial, c);
 	}
-	else {
-		free(ptr);
-		--(slab->shrink_amount);
+}
+
+int32_t g_xslab_alloc_batch(g_xslab_t* slab, int32_t n, void** head)
+{
+	int32_t i = 0;
+	void** tail = NULL;
+	xslab_chunk_t* c;
+
+	*head = NULL;
+
+	// the free blocks first, a chunk at a time
+	while (i < n && (c = slab->partial.next) != &slab->partial) {
+		int32_t k = 0;
+		void** last = c->head;
+		while (++k < c->free_count && i + k < n) last = (void**) last[0];
+
+		if (tail == NULL) *head = c->head;
+		else tail[0] = c->head;
+		tail = last;
+		c->head = (void**) last[0];
+		c->free_count -= k;
+		slab->usable_amount -= k;
+		i += k;
+		if (c->free_count == 0) {
+			chunk_unlink(c);
+			chunk_link_head(&slab->full, c);
+		}
+	}
+
+	// then carve the rest, with new chunks if needed
+	while (i < n) {
+		uint8_t* ptr;
+		c = slab->current;
+		if (c == NULL || c->carved == slab->chunk_blocks) {
+			c = chunk_new(slab);
+			if (c == NULL) break;
+			slab->current = c;
+		}
+		for (; i < n && c->carved < slab->chunk_blocks; i++) {
+			ptr = c->start + (size_t) slab->alloc_size * (c->carved++);
+			if (tail == NULL) *head = ptr;
+			else tail[0] = ptr;
+			tail = (void**) ptr;
+		}
+	}
+
+	if (tail != NULL) tail[0] = NULL;
+	return i;
+}
+
+void g_xslab_free_batch(g_xslab_t* slab, void* head, void* tail, int32_t n)
+{
+	while (n-- > 0) {
+		void* ptr = head;
+		head = ((void**)head)[0];
+		g_xslab_free(slab, ptr);
 	}
 }
 
 void g_xslab_shrink(g_xslab_t* slab, double keep)
 {
+	xslab_chunk_t* c;
+	int32_t amount;
+
 	assert(keep >= 0.0 && keep <= 1.0);
 
-	int32_t tmp_usable_amount = slab->usable_amount;
-	slab->shrink_amount = tmp_usable_amount - (int32_t) (tmp_usable_amount * keep);
+	amount = slab->usable_amount - (int32_t) (slab->usable_amount * keep);
+	++(slab->stats.shrinks);
+
+	// only the chunks without any block in use can go, a whole chunk at a
+	// time. the free blocks of the other chunks stay in use, nothing is left
+	// pending for the later frees
+	c = slab->partial.next;
+	while (c != &slab->partial && amount > 0) {
+		xslab_chunk_t* next = c->next;
+		if (c != slab->current && XSLAB_LIVE(c) == 0) {
+			amount -= c->free_count;
+			chunk_drop(slab, c);
+		}
+		c = next;
+	}
+}
+
+int32_t g_xslab_release(g_xslab_t* slab, int32_t max_blocks)
+{
+	xslab_chunk_t* c = slab->partial.next;
+	int32_t released = 0;
+
+	while (c != &slab->partial) {
+		xslab_chunk_t* next = c->next;
+		if (c != slab->current && XSLAB_LIVE(c) == 0
+				&& released + c->free_count <= max_blocks) {
+			released += c->free_count;
+			chunk_drop(slab, c);
+		}
+		c = next;
+	}
+	return released;
 }
 
 int32_t g_xslab_alloc_size(g_xslab_t* slab)
@@ -900,5 +1290,21 @@ int32_t g_xslab_usable_amount(g_xslab_t* slab)
 
 int32_t g_xslab_shrink_amount(g_xslab_t* slab)
 {
-	return slab->shrink_amount;
+	(void) slab;
+	return 0;
+}
+
+void g_xslab_get_stats(g_xslab_t* slab, g_xslab_stats_t* stats)
+{
+	*stats = slab->stats;
+}
+
+int32_t g_xslab_chunk_size(g_xslab_t* slab)
+{
+	return slab->chunk_size;
+}
+
+int32_t g_xslab_chunk_count(g_xslab_t* slab)
+{
+	return slab->chunk_count;
 }
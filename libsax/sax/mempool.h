@@ -33,24 +33,72 @@ int g_fsb_used(struct fsb_pool_t *pool); /* get blocks used */
 uint64_t g_fsb_getkey(struct fsb_pool_t *pool, const void *block);
 void* g_fsb_getblock(struct fsb_pool_t *pool, uint64_t key);
 
+/** b2: lock-free fixed-size-block allocator, safe across processes sharing
+ *  the region (e.g. from g_shm_open()). the region holds no pointers, so it
+ *  may be mapped at different addresses: one process calls g_lfsb_init(),
+ *  the others g_lfsb_attach(). keys are offsets of the blocks in the region,
+ *  which can be passed between the processes. */
+long g_lfsb_needed(long block_size, int block_count);
+
+struct lfsb_pool_t *g_lfsb_init(
+	void *addr, long total, long block_size, int block_count);
+struct lfsb_pool_t *g_lfsb_attach(void *addr); /* NULL if not initialized */
+void* g_lfsb_alloc(struct lfsb_pool_t *pool);
+int g_lfsb_free(struct lfsb_pool_t *pool, void *block); /* -1 for bad block */
+
+long g_lfsb_size(struct lfsb_pool_t *pool); /* get block size */
+int g_lfsb_count(struct lfsb_pool_t *pool); /* get block count */
+int g_lfsb_used(struct lfsb_pool_t *pool); /* get blocks used */
+
+uint64_t g_lfsb_getkey(struct lfsb_pool_t *pool, const void *block); /* 0 for bad block */
+void* g_lfsb_getblock(struct lfsb_pool_t *pool, uint64_t key);
+
 
-/** c: fixed-size-block allocator with a linked list of freed block */
+/** c: fixed-size-block allocator with a free list, the blocks are carved out of
+ *  chunks of a page or more, which go back to the system when shrinking */
 typedef struct g_xslab_t g_xslab_t;
 
 g_xslab_t* g_xslab_init(int32_t size);
+// "align" is a power of 2 up to 4096 (0 for sizeof(void*)), the size is rounded up to it.
+// "color" != 0 shifts the blocks of the chunks by cache lines, in turn
+g_xslab_t* g_xslab_init_ex(int32_t size, int32_t align, int32_t color);
 void g_xslab_destroy(g_xslab_t* slab);
 
 void* g_xslab_alloc(g_xslab_t* slab);
 void g_xslab_free(g_xslab_t* slab, void* ptr);
 
-// just a hint for slab_t, it will not recycle memory immediately
-// 0 <= keep <= 1.0, (usable_amount * keep) freed memory blocks will be kept
+// move "n" blocks to a chain linked by their first word, ended by NULL. the free
+// blocks go first, the rest are carved. less than "n" for out of memory
+int32_t g_xslab_alloc_batch(g_xslab_t* slab, int32_t n, void** head);
+// give back a chain of "n" blocks from "head" to "tail"
+void g_xslab_free_batch(g_xslab_t* slab, void* head, void* tail, int32_t n);
+
+// 0 <= keep <= 1.0, about (usable_amount * keep) freed memory blocks will be kept.
+// only the chunks without blocks in use are released, a whole chunk at a time,
+// so a fragmented slab may keep more. nothing is left pending
 void g_xslab_shrink(g_xslab_t* slab, double keep);
+// release the chunks without blocks in use, up to "max_blocks" free blocks
+// with them, and return the number of those blocks
+int32_t g_xslab_release(g_xslab_t* slab, int32_t max_blocks);
+
+typedef struct g_xslab_stats_t
+{
+	uint64_t chunk_allocs;		/* chunks taken from the system */
+	uint64_t chunk_frees;		/* chunks given back to the system */
+	int32_t chunk_high_water;
+	uint64_t shrinks;			/* calls of g_xslab_shrink() */
+	uint64_t retired;			/* free blocks released with their chunks */
+} g_xslab_stats_t;
+
+void g_xslab_get_stats(g_xslab_t* slab, g_xslab_stats_t* stats);
 
 // for test
 int32_t g_xslab_alloc_size(g_xslab_t* slab);
 int32_t g_xslab_usable_amount(g_xslab_t* slab);
+// always 0, g_xslab_shrink() leaves nothing pending
 int32_t g_xslab_shrink_amount(g_xslab_t* slab);
+int32_t g_xslab_chunk_size(g_xslab_t* slab);
+int32_t g_xslab_chunk_count(g_xslab_t* slab);
 
 #if defined(__cplusplus) || defined(c_plusplus)
 }
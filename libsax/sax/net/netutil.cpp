@@ -25,6 +25,11 @@ transport::transport()
 	_eda = NULL;
 	_inited = false;
 	_cloned = false;
+	_timer = NULL;
+	_timer_fd = -1;
+	_tick_us = 0;
+	_timer_last_us = 0;
+	_timer_due_us = 0;
 }
 
 transport::~transport()
@@ -37,6 +42,13 @@ transport::~transport()
 		}
 	}
 
+	if (_timer) {
+		g_eda_del(_eda, _timer_fd);
+		g_timerfd_close(_timer_fd);
+		g_timer_destroy(_timer, NULL);
+		_timer = NULL;
+	}
+
 	g_eda_close(_eda);
 	_eda = NULL;
 
@@ -228,8 +240,59 @@ void transport::close(const id& tid)
 
 void transport::poll(uint32_t millseconds)
 {
+	if (_timer) {
+		poll_timer();
+		arm_timer();
+	}
+
 	g_eda_poll(_eda, (int) millseconds);
-	// TODO: add timer
+
+	if (_timer) poll_timer();
+}
+
+bool transport::enable_timer(uint32_t tick_us)
+{
+	if (!_inited || _timer || tick_us == 0) return false;
+
+	int fd = g_timerfd_open();
+	if (fd == -1) return false;
+
+	_timer = g_timer_create();
+	if (!_timer || g_eda_add(_eda, fd, EDA_READ) != 0) {
+		if (_timer) g_timer_destroy(_timer, NULL);
+		_timer = NULL;
+		g_timerfd_close(fd);
+		return false;
+	}
+
+	_timer_fd = fd;
+	_tick_us = tick_us;
+	_timer_last_us = g_timerfd_now();
+	_timer_due_us = 0;
+
+	return true;
+}
+
+void transport::poll_timer()
+{
+	int64_t lapsed = (g_timerfd_now() - _timer_last_us) / _tick_us;
+	if (lapsed <= 0) return;
+
+	if (lapsed >= G_TIMER_NEVER) lapsed = G_TIMER_NEVER - 1;
+	_timer_last_us += lapsed * _tick_us;
+	g_timer_poll(_timer, (uint32_t) lapsed);
+}
+
+// arm the timerfd for the next expiry, it's not touched if that's unchanged
+void transport::arm_timer()
+{
+	uint32_t next = g_timer_next_expire(_timer);
+	int64_t due = next == G_TIMER_NEVER ? 0 : _timer_last_us + (int64_t) next * _tick_us;
+	if (due == _timer_due_us) return;
+
+	if (g_timerfd_set(_timer_fd, due) == 0) {
+		_timer_due_us = due;
+	}
 }
 
 void transport::toggle_write(int fd, bool on/* = true*/)
@@ -241,6 +304,12 @@ void transport::toggle_write(int fd, bool on/* = true*/)
 void transport::eda_callback(g_eda_t* mgr, int fd, void* user_data, int mask)
 {
 	transport* trans = (transport*) user_data;
+	if (UNLIKELY(fd == trans->_timer_fd)) {
+		// the timers are polled after g_eda_poll()
+		g_timerfd_clear(fd);
+		return;
+	}
+
 	context& ctx = trans->_ctx[fd];
 	if (UNLIKELY(mask & EDA_ERROR)) {
 		LOG_TRACE("in eda_callback() EDA_ERROR, fd: " << fd);
@@ -4,6 +4,7 @@
 #include <new>
 #include "sax/os_types.h"
 #include "sax/os_net.h"
+#include "sax/timer.h"
 #include "buffer.h"
 #include "linked_buffer.h"
 
@@ -98,6 +99,13 @@ public:
 
 	void poll(uint32_t millseconds);
 
+	// high resolution timers: a wheel of "tick_us" ticks, waited with the
+	// sockets in the same poll() by a timerfd. arm them in the polling thread
+	// by g_timer_start()/g_timer_start_periodic() on timer(), the procs run
+	// in poll(). returns false if timerfd is unsupported (linux only).
+	bool enable_timer(uint32_t tick_us);
+	inline g_timer_t* timer() {return _timer;}
+
 	inline int32_t maxfds() {return _maxfds;}
 
 	bool has_outdata(const id& tid);
@@ -119,6 +127,9 @@ private:
 
 	static bool handle_udp_read(transport* trans, int fd, context& ctx);
 
+	void poll_timer();
+	void arm_timer();
+
 private:
 	transport_handler* _handler;
 	context*   _ctx;
@@ -128,6 +139,12 @@ private:
 
 	bool       _inited;
 	bool       _cloned;
+
+	g_timer_t* _timer;
+	int        _timer_fd;
+	uint32_t   _tick_us;
+	int64_t    _timer_last_us;	// the time of the wheel's current tick
+	int64_t    _timer_due_us;	// the timerfd is armed at it, 0 for not armed
 };
 
 struct transport_handler
@@ -347,6 +347,30 @@ int g_url_encode(const char *src, char *dst, int dst_len)
 	return (dst - begin);
 }
 
+int g_json_escape(const char *src, char *dst, int dst_len)
+{
+	int n = 0;
+	for (; *src != '\0' && n + 7 <= dst_len; src++)
+	{
+		unsigned char c = * (unsigned char *) src;
+		if (c == '"' || c == '\\')
+		{
+			dst[n++] = '\\';
+			dst[n++] = (char) c;
+		}
+		else if (c < 0x20)
+		{
+			n += g_snprintf(dst + n, dst_len - n, "\\u%04x", (unsigned) c);
+		}
+		else
+		{
+			dst[n++] = (char) c;
+		}
+	}
+	if (dst_len > 0) dst[n] = '\0';
+	return n;
+}
+
 static int b64_decode(const char *src, int src_len,
 	unsigned char dst[], int dst_len)
 {
@@ -571,6 +595,36 @@ int g_mkdir_recur(const char *dir)
 	}
 	return g_create_dir(tmp);
 }
+
+int g_parse_cpu_list(const char *list, int *cpus, int max)
+{
+	const char *p = list;
+	char *end;
+	int n = 0;
+	long first, last;
+
+	while (*p) {
+		while (*p == ' ' || *p == ',' || *p == '\n') p++;
+		if (*p == '\0') break;
+
+		first = strtol(p, &end, 10);
+		if (end == p || first < 0) return -1;
+		last = first;
+		p = end;
+		if (*p == '-') {
+			last = strtol(p + 1, &end, 10);
+			if (end == p + 1 || last < first) return -1;
+			p = end;
+		}
+		if (*p && *p != ',' && *p != ' ' && *p != '\n') return -1;
+
+		for (; first <= last && n < max; first++) {
+			cpus[n++] = (int)first;
+		}
+	}
+
+	return n;
+}
 //-------------------------------------------------------------------------
 //------------------- (2) some OS-dependent API/Object --------------------
 //-------------------------------------------------------------------------
@@ -983,8 +1037,31 @@ void g_thread_exit(long ret) {ExitThread(ret);}
 
 long g_thread_id() {return (long)GetCurrentThreadId();}
 
+int g_thread_atexit(void (*func)(void *), void *param) {return 0;}
+
 int g_thread_bind(int cpu, const char *name) {return 0;}
 
+int g_thread_bind_cpus(const int *cpus, int n) {return 0;}
+
+int g_cpu_count()
+{
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return (int)info.dwNumberOfProcessors;
+}
+
+int g_numa_node_count() {return 1;}
+
+int g_numa_node_of_cpu(int cpu) {return 0;}
+
+int g_numa_node_cpus(int node, int *cpus, int max)
+{
+	int i, n = g_cpu_count();
+	if (node != 0) return -1;
+	for (i=0; i<n && i<max; i++) cpus[i] = i;
+	return i;
+}
+
 long g_process_id() { return (long)GetCurrentProcessId();}
 
 // ################################################################
@@ -1698,6 +1775,34 @@ void* g_shm_alloc_pages(uint32_t pages)
 #warning "g_shm_alloc_pages() is not implemented in windows."
 }
 
+int g_shm_arena_init(size_t bytes, int prefault)
+{
+	return 0;
+}
+
+int g_shm_arena_stat(uint32_t *used, uint32_t *total)
+{
+	if (used) *used = 0;
+	if (total) *total = 0;
+	return 0;
+}
+
+int g_shm_arena_fini()
+{
+	return 0;
+}
+
+void* g_numa_alloc_pages(uint32_t pages, int node)
+{
+	return VirtualAlloc(NULL, (SIZE_T)g_shm_unit() * pages,
+			MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+}
+
+void g_numa_free_pages(void* ptr, uint32_t pages)
+{
+	if (ptr) VirtualFree(ptr, 0, MEM_RELEASE);
+}
+
 #else // OS=!WIN32
 
 #include <sys/types.h>
@@ -2231,6 +2336,46 @@ long g_thread_id() {return (long)pthread_mach_thread_np(pthread_self());} //gett
 long g_thread_id() {return (long)syscall(SYS_gettid);} //gettid()
 #endif
 
+struct thread_atexit_t
+{
+	void (*func)(void *);
+	void *param;
+	struct thread_atexit_t *next;
+};
+
+static pthread_key_t  g_atexit_key;
+static pthread_once_t g_atexit_once = PTHREAD_ONCE_INIT;
+
+static void thread_atexit_run(void *p)
+{
+	struct thread_atexit_t *node = (struct thread_atexit_t *) p;
+	while (node != NULL) {
+		struct thread_atexit_t *next = node->next;
+		node->func(node->param);
+		free(node);
+		node = next;
+	}
+}
+
+static void thread_atexit_key() {pthread_key_create(&g_atexit_key, thread_atexit_run);}
+
+int g_thread_atexit(void (*func)(void *), void *param)
+{
+	struct thread_atexit_t *node;
+	pthread_once(&g_atexit_once, thread_atexit_key);
+
+	node = (struct thread_atexit_t *) malloc(sizeof(struct thread_atexit_t));
+	if (node == NULL) return 0;
+	node->func = func;
+	node->param = param;
+	node->next = (struct thread_atexit_t *) pthread_getspecific(g_atexit_key);
+	if (pthread_setspecific(g_atexit_key, node) != 0) {
+		free(node);
+		return 0;
+	}
+	return 1;
+}
+
 #ifdef __APPLE_CC__
 // Thread Affinity API: http://developer.apple.com/library/mac/#releasenotes/Performance/RN-AffinityAPI/_index.html
 // code was ported from: https://bitbucket.org/bosilca/dague.public/src/115d9194bd7c/src/bindthread.c
@@ -2299,6 +2444,86 @@ int g_thread_bind(int cpu, const char *name)
 	return 1;
 }
 
+#ifdef __APPLE_CC__
+int g_thread_bind_cpus(const int *cpus, int n)
+{
+	// mac os x only supports affinity tags, just bind the first one
+	return n > 0 ? bindthread(cpus[0]) : 0;
+}
+#else
+int g_thread_bind_cpus(const int *cpus, int n)
+{
+	cpu_set_t _set;
+	int i, num = g_cpu_count();
+
+	CPU_ZERO(&_set);
+	for (i=0; i<n; i++) {
+		if (cpus[i] >= 0 && cpus[i] < num && cpus[i] < CPU_SETSIZE) {
+			CPU_SET(cpus[i], &_set);
+		}
+	}
+	if (CPU_COUNT(&_set) == 0) return 0;
+
+	return sched_setaffinity(0, sizeof(_set), &_set) == 0 ? 1 : 0;
+}
+#endif
+
+int g_cpu_count()
+{
+	return (int)sysconf(_SC_NPROCESSORS_CONF);
+}
+
+#define NODE_SYSFS "/sys/devices/system/node"
+
+int g_numa_node_count()
+{
+	char path[64];
+	int n = 0;
+	while (n < 1024) {
+		g_snprintf(path, sizeof(path), NODE_SYSFS "/node%d", n);
+		if (access(path, F_OK) != 0) break;
+		n++;
+	}
+	return n > 0 ? n : 1;
+}
+
+int g_numa_node_of_cpu(int cpu)
+{
+	char path[96];
+	int node, nodes = g_numa_node_count();
+	for (node=0; node<nodes; node++) {
+		g_snprintf(path, sizeof(path),
+				"/sys/devices/system/cpu/cpu%d/node%d", cpu, node);
+		if (access(path, F_OK) == 0) return node;
+	}
+	return 0;
+}
+
+int g_numa_node_cpus(int node, int *cpus, int max)
+{
+	char path[64], list[1024];
+	FILE *fp;
+	int i, n;
+
+	g_snprintf(path, sizeof(path), NODE_SYSFS "/node%d/cpulist", node);
+	fp = fopen(path, "r");
+	if (fp == NULL) {
+		// not a NUMA system, node 0 has all cpus
+		if (node != 0) return -1;
+		n = g_cpu_count();
+		for (i=0; i<n && i<max; i++) cpus[i] = i;
+		return i;
+	}
+
+	list[0] = '\0';
+	if (fgets(list, sizeof(list), fp) == NULL) list[0] = '\0';
+	fclose(fp);
+
+	return g_parse_cpu_list(list, cpus, max);
+}
+
+#undef NODE_SYSFS
+
 long g_process_id() { return (long)getpid();}
 
 // ################################################################
@@ -3146,14 +3371,193 @@ int g_shm_unit(void)
 	return sysconf(_SC_PAGESIZE);
 }
 
+#define SHM_ARENA_HUGE		(2UL << 20)
+#define SHM_ARENA_MAX_RUN	1024	// in pages, longer runs are not from the arena
+
+// the huge-page arena: runs of pages are bumped from the never used part,
+// and recycled by free lists of the same length. the length of each run
+// is kept by its first page in "runs" for g_shm_free_pages().
+static struct {
+	char *base;
+	size_t len;
+	uint32_t unit;
+	uint32_t pages;
+	uint32_t bump;		// the first never used page
+	uint32_t used;
+	int mode;
+	long lock;
+	uint16_t *runs;
+	uint32_t heads[SHM_ARENA_MAX_RUN + 1];	// (page index + 1) of free runs
+} g_arena;
+
+int g_shm_arena_init(size_t bytes, int prefault)
+{
+	size_t len, unit = (size_t) g_shm_unit(), i;
+	char *ptr = (char*) MAP_FAILED;
+	uint16_t *runs;
+	int mode = 0;
+
+	if (g_arena.base != NULL || bytes == 0) return 0;
+	len = (bytes + SHM_ARENA_HUGE - 1) & ~(SHM_ARENA_HUGE - 1);
+	if (len / unit > 0xffffffffUL) return 0;
+
+#ifdef MAP_HUGETLB
+	// fails without enough reserved huge pages (vm.nr_hugepages)
+	ptr = (char*) mmap(NULL, len, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (prefault ? MAP_POPULATE : 0),
+			-1, 0);
+	if (ptr != MAP_FAILED) mode = 2;
+#endif
+
+	if (ptr == MAP_FAILED) {
+		// over-map a huge page to align the arena on its boundary
+		size_t head;
+		char *raw = (char*) mmap(NULL, len + SHM_ARENA_HUGE, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (raw == MAP_FAILED) return 0;
+
+		ptr = (char*) (((uintptr_t) raw + SHM_ARENA_HUGE - 1) & ~(SHM_ARENA_HUGE - 1));
+		head = ptr - raw;
+		if (head > 0) munmap(raw, head);
+		munmap(ptr + len, SHM_ARENA_HUGE - head);
+#ifdef MADV_HUGEPAGE
+		madvise(ptr, len, MADV_HUGEPAGE);
+#endif
+		mode = 1;
+	}
+
+	runs = (uint16_t*) calloc(len / unit, sizeof(uint16_t));
+	if (runs == NULL) {
+		munmap(ptr, len);
+		return 0;
+	}
+
+	if (prefault) {
+		for (i = 0; i < len; i += unit) ((volatile char*) ptr)[i] = 0;
+	}
+
+	g_arena.len = len;
+	g_arena.unit = (uint32_t) unit;
+	g_arena.pages = (uint32_t) (len / unit);
+	g_arena.bump = 0;
+	g_arena.used = 0;
+	g_arena.mode = mode;
+	g_arena.runs = runs;
+	memset(g_arena.heads, 0, sizeof(g_arena.heads));
+	__sync_synchronize();
+	g_arena.base = ptr;
+	return mode;
+}
+
+int g_shm_arena_stat(uint32_t *used, uint32_t *total)
+{
+	if (used) *used = g_arena.used;
+	if (total) *total = g_arena.pages;
+	return g_arena.base ? g_arena.mode : 0;
+}
+
+int g_shm_arena_fini()
+{
+	char *base = g_arena.base;
+	if (base == NULL || g_arena.used > 0) return 0;
+
+	g_arena.base = NULL;
+	__sync_synchronize();
+	munmap(base, g_arena.len);
+	free(g_arena.runs);
+	g_arena.runs = NULL;
+	g_arena.len = 0;
+	g_arena.pages = 0;
+	return 1;
+}
+
+static void* shm_arena_alloc(uint32_t pages)
+{
+	char *ptr = NULL;
+	uint32_t idx = 0;
+
+	if (pages == 0 || pages > SHM_ARENA_MAX_RUN) return NULL;
+
+	while (g_ifeq_set(&g_arena.lock, 0, 1)) g_thread_yield();
+	if (g_arena.heads[pages] > 0) {
+		idx = g_arena.heads[pages] - 1;
+		ptr = g_arena.base + (size_t) idx * g_arena.unit;
+		g_arena.heads[pages] = *(uint32_t*) ptr;
+	}
+	else if (g_arena.pages - g_arena.bump >= pages) {
+		idx = g_arena.bump;
+		ptr = g_arena.base + (size_t) idx * g_arena.unit;
+		g_arena.bump += pages;
+	}
+	if (ptr != NULL) {
+		g_arena.runs[idx] = (uint16_t) pages;
+		g_arena.used += pages;
+	}
+	g_lock_set(&g_arena.lock, 0);
+	return ptr;
+}
+
+static void shm_arena_free(char* ptr)
+{
+	uint32_t idx = (uint32_t) ((ptr - g_arena.base) / g_arena.unit), pages;
+
+	while (g_ifeq_set(&g_arena.lock, 0, 1)) g_thread_yield();
+	pages = g_arena.runs[idx];
+	assert(pages > 0 && ptr == g_arena.base + (size_t) idx * g_arena.unit);
+	g_arena.runs[idx] = 0;
+	g_arena.used -= pages;
+	*(uint32_t*) ptr = g_arena.heads[pages];
+	g_arena.heads[pages] = idx + 1;
+	g_lock_set(&g_arena.lock, 0);
+}
+
 void* g_shm_alloc_pages(uint32_t pages)
 {
+	if (g_arena.base != NULL) {
+		void *ptr = shm_arena_alloc(pages);
+		if (ptr != NULL) return ptr;
+	}
 	return valloc(g_shm_unit() * pages);
 }
 
 void g_shm_free_pages(void* ptr)
 {
-	free(ptr);
+	char *base = g_arena.base;
+	if (base != NULL && (char*) ptr >= base && (char*) ptr < base + g_arena.len) {
+		shm_arena_free((char*) ptr);
+	}
+	else {
+		free(ptr);
+	}
+}
+
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+
+void* g_numa_alloc_pages(uint32_t pages, int node)
+{
+	size_t len = (size_t)g_shm_unit() * pages;
+	void *ptr = mmap(NULL, len, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ptr == MAP_FAILED) return NULL;
+
+#if defined(__linux__) && defined(SYS_mbind)
+	if (node >= 0 && node < (int)(sizeof(unsigned long) * 8)) {
+		// a preference only: fall back to other nodes if the node is full,
+		// and just ignore the error on kernels without NUMA support
+		unsigned long mask = 1UL << node;
+		syscall(SYS_mbind, ptr, len, MPOL_PREFERRED, &mask,
+				sizeof(mask) * 8, 0);
+	}
+#endif
+
+	return ptr;
+}
+
+void g_numa_free_pages(void* ptr, uint32_t pages)
+{
+	if (ptr) munmap(ptr, (size_t)g_shm_unit() * pages);
 }
 
 #endif // OS=!WIN32
@@ -88,6 +88,11 @@ int g_url_decode(const char *src, int src_len, char *dst,
 	int dst_len, int is_form_url_encoded);
 int g_url_encode(const char *src, char *dst, int dst_len);
 
+/// @brief escape the quotes, the backslashes and the control characters
+/// for a JSON string, the output stops before an escape that doesn't fit.
+/// dst_len of 6 times the length of src plus 1 always fits.
+int g_json_escape(const char *src, char *dst, int dst_len);
+
 
 /// @brief byte-decode/encode to 64 bits string (not base64)
 int g_b64_decode(const char *src, int src_len, 
@@ -296,9 +301,35 @@ void g_thread_exit(long val);
 /// @brief (inner) retrieve the thread ID.
 long g_thread_id();
 
+/// @brief (inner) call func(param) when the running thread exits, the last registered first.
+///        not called for the main thread returning from main().
+/// @return 1 for succeeded, 0 for failed or not supported.
+int g_thread_atexit(void (*func)(void *), void *param);
+
 /// @brief (inner) bind a cpu or a name.
 int g_thread_bind(int cpu, const char *name);
 
+/// @brief (inner) bind the running thread to a set of cpus.
+/// @return 1 for succeeded, 0 for failed or not supported.
+int g_thread_bind_cpus(const int *cpus, int n);
+
+/// @brief number of the configured cpus.
+int g_cpu_count();
+
+/// @brief parse a cpu list like "0-3,8,10-11" into "cpus", at most "max".
+/// @return number of cpus, -1 for a malformed list.
+int g_parse_cpu_list(const char *list, int *cpus, int max);
+
+/// @brief number of NUMA nodes, 1 for non-NUMA systems.
+int g_numa_node_count();
+
+/// @brief the NUMA node of a cpu, 0 if unknown.
+int g_numa_node_of_cpu(int cpu);
+
+/// @brief list the cpus of a NUMA node into "cpus", at most "max".
+/// @return number of cpus, -1 for failed.
+int g_numa_node_cpus(int node, int *cpus, int max);
+
 /// @brief (inner) retrieve the process ID.
 long g_process_id();
 
@@ -491,6 +522,34 @@ void* g_shm_alloc_pages(uint32_t pages);
 /// @param ptr memory address to free.
 void g_shm_free_pages(void* ptr);
 
+/// @brief Back g_shm_alloc_pages() by a huge-page arena of "bytes" (rounded
+///        up to 2MB), carved into g_shm_unit() pages. MAP_HUGETLB is tried
+///        first, then transparent huge pages by madvise(). runs of pages that
+///        do not fit in the arena fall back to the normal allocation.
+/// @param bytes size of the arena.
+/// @param prefault non-zero to fault in the whole arena now.
+/// @return 2 for MAP_HUGETLB, 1 for THP, 0 for failed or already set up.
+/// NOTICE: call it once at startup, the arena lives until g_shm_arena_fini().
+int g_shm_arena_init(size_t bytes, int prefault);
+
+/// @brief Release the arena set up by g_shm_arena_init(), the later
+///        g_shm_alloc_pages() use the normal allocation again.
+/// @return 1 for released, 0 if there is no arena or pages of it are in use.
+/// NOTICE: no other thread may allocate or free pages at the same time.
+int g_shm_arena_fini();
+
+/// @brief Pages of the arena in use and in total.
+/// @return the same as g_shm_arena_init(), 0 if there is no arena.
+int g_shm_arena_stat(uint32_t *used, uint32_t *total);
+
+/// @brief Allocate numbers of entire pages whose physical memory prefers
+///        the NUMA node "node" (node < 0 for no preference).
+/// @return NULL for failed, otherwise page aligned.
+void* g_numa_alloc_pages(uint32_t pages, int node);
+
+/// @brief Deallocate memory that allocated from g_numa_alloc_pages().
+void g_numa_free_pages(void* ptr, uint32_t pages);
+
 //-------------------------------------------------------------------------
 //------------- (g) API for mixed file (shm_t + f64_t) --------------------
 //-------------------------------------------------------------------------
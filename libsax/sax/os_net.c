@@ -681,3 +681,60 @@ int g_eda_poll(g_eda_t* mgr, int msec)
 #endif
 
 //-------------------------------------------------------------------------
+#if defined(__linux__)
+
+#include <sys/timerfd.h>
+#include <time.h>
+
+int g_timerfd_open()
+{
+	int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (fd == -1) {
+		fprintf(stderr, "error occurred when calling timerfd_create() in g_timerfd_open(). errno: %d %s\n",
+				errno, strerror(errno));
+	}
+	return fd;
+}
+
+void g_timerfd_close(int fd)
+{
+	close(fd);
+}
+
+int g_timerfd_set(int fd, int64_t at_us)
+{
+	struct itimerspec spec;
+	memset(&spec, 0, sizeof(spec));
+	spec.it_value.tv_sec = at_us / 1000000;
+	spec.it_value.tv_nsec = (at_us % 1000000) * 1000;
+
+	if (LIKELY( timerfd_settime(fd, TFD_TIMER_ABSTIME, &spec, NULL) == 0 )) return 0;
+	fprintf(stderr, "error occurred when calling timerfd_settime() in g_timerfd_set(). fd: %d errno: %d %s\n",
+			fd, errno, strerror(errno));
+	return -1;
+}
+
+void g_timerfd_clear(int fd)
+{
+	uint64_t expirations;
+	while (read(fd, &expirations, sizeof(expirations)) == sizeof(expirations)) {}
+}
+
+int64_t g_timerfd_now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+#else
+
+#include "os_api.h"
+
+int g_timerfd_open() { return -1; }
+void g_timerfd_close(int fd) {}
+int g_timerfd_set(int fd, int64_t at_us) { return -1; }
+void g_timerfd_clear(int fd) {}
+int64_t g_timerfd_now() { return g_now_us(); }
+
+#endif
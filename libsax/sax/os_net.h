@@ -71,6 +71,14 @@ int g_eda_del(g_eda_t* mgr, int fd);
 void g_eda_mod(g_eda_t* mgr, int fd, int mask);
 int g_eda_poll(g_eda_t* mgr, int msec);	// msec == -1 for wait forever
 
+// a timer polled with the sockets by g_eda, its fd is readable after it
+// expires (timerfd of linux). the times are usec of CLOCK_MONOTONIC.
+int g_timerfd_open();	// -1 if it's unsupported
+void g_timerfd_close(int fd);
+int g_timerfd_set(int fd, int64_t at_us);	// expires once at "at_us", 0 disarms it
+void g_timerfd_clear(int fd);	// clear the readable state
+int64_t g_timerfd_now();
+
 #if defined(__cplusplus) || defined(c_plusplus)
 }
 #endif
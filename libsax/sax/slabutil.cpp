@@ -0,0 +1,479 @@
+/*
+ * slabutil.cpp
+ *
+ *  Created on: 2012-9-26
+ *      Author: x
+ */
+
+#include <string.h>
+#ifdef __GNUC__
+#include <cxxabi.h>
+#endif
+#include "slabutil.h"
+
+namespace sax {
+
+void slab_t::shrink(double keep)
+{
+	slab_magazine* mags = slab_mgr::thread_slot();
+	if (mags != NULL && _index >= 0 && mags[_index].owner == this) {
+		give_back(&mags[_index], mags[_index].count);
+	}
+
+	__sync_add_and_fetch(&_epoch, 1);
+	if (mags != NULL && _index >= 0 && mags[_index].owner == this) {
+		mags[_index].epoch = _epoch;
+	}
+
+	g_spin_enter(_lock, 128);
+	g_xslab_shrink(_slab, keep);
+	g_spin_leave(_lock);
+}
+
+void slab_t::reclaim(const reclaim_policy& policy, int64_t now_ms)
+{
+	slab_snapshot snap;
+	snapshot(snap);
+
+	if (_peak_ms == 0) {
+		_ewma_in_use = snap.in_use;
+		_peak_in_use = snap.in_use;
+		_peak_ms = now_ms;
+		return;
+	}
+
+	_ewma_in_use = policy.alpha * snap.in_use + (1 - policy.alpha) * _ewma_in_use;
+	if (snap.in_use > _peak_in_use) {
+		_peak_in_use = snap.in_use;
+		_peak_ms = now_ms;
+		return;
+	}
+	if (now_ms - _peak_ms < policy.idle_sec * 1000) return;
+
+	double in_use = _ewma_in_use > snap.in_use ? _ewma_in_use : snap.in_use;
+	double keep_free = in_use * policy.headroom;
+	int32_t usable = g_xslab_usable_amount(_slab);
+	if (usable <= keep_free) return;
+
+	double release = usable - keep_free;
+	if (release > usable * policy.max_step) release = usable * policy.max_step;
+	if (release < 1) release = 1;
+	g_spin_enter(_lock, 128);
+	g_xslab_release(_slab, (int32_t) release);
+	g_spin_leave(_lock);
+
+	// the next step waits for another idle period
+	_peak_in_use = snap.in_use;
+	_peak_ms = now_ms;
+}
+
+int32_t slab_t::get_usable_amount()
+{
+	int32_t amount = g_xslab_usable_amount(_slab);
+	slab_magazine* mags = slab_mgr::thread_slot();
+	if (mags != NULL && _index >= 0 && mags[_index].owner == this) {
+		amount += mags[_index].count;
+	}
+	return amount;
+}
+
+slab_magazine* slab_t::acquire_magazine()
+{
+	if (_index < 0) return NULL;
+
+	slab_magazine* mags = slab_mgr::get_instance()->thread_magazines();
+	if (mags == NULL) return NULL;
+
+	slab_magazine* mag = mags + _index;
+	if (mag->owner != this) {
+		assert(mag->owner == NULL);
+		mag->owner = this;
+		mag->head = NULL;
+		mag->count = 0;
+		mag->epoch = _epoch;
+		mag->allocs = mag->frees = mag->refills = 0;
+	}
+	else if (mag->epoch != _epoch) {
+		mag->epoch = _epoch;
+		give_back(mag, mag->count);
+	}
+	return mag;
+}
+
+void* slab_t::alloc_slow()
+{
+	slab_magazine* mag = acquire_magazine();
+	if (mag != NULL && mag->count > 0) {
+		void* ptr = mag->head;
+		mag->head = ((void**) ptr)[0];
+		--(mag->count);
+		++(mag->allocs);
+		return ptr;
+	}
+
+	void* head;
+	g_spin_enter(_lock, 128);
+	int32_t n = g_xslab_alloc_batch(_slab, mag != NULL ? MAGAZINE_BATCH : 1, &head);
+	g_spin_leave(_lock);
+
+	if (n == 0) return NULL;
+
+	void* ptr = head;
+	if (mag != NULL) {
+		mag->head = ((void**) ptr)[0];
+		mag->count = n - 1;
+		++(mag->allocs);
+		++(mag->refills);
+	}
+	else {
+		__sync_fetch_and_add(&_allocs, 1);
+		__sync_fetch_and_add(&_refills, 1);
+	}
+	return ptr;
+}
+
+void slab_t::free_slow(void* ptr)
+{
+	slab_magazine* mag = acquire_magazine();
+	if (mag == NULL) {
+		__sync_fetch_and_add(&_frees, 1);
+		g_spin_enter(_lock, 128);
+		g_xslab_free(_slab, ptr);
+		g_spin_leave(_lock);
+		return;
+	}
+
+	if (mag->count >= MAGAZINE_SIZE) {
+		give_back(mag, MAGAZINE_BATCH);
+	}
+
+	((void**) ptr)[0] = mag->head;
+	mag->head = ptr;
+	++(mag->count);
+	++(mag->frees);
+}
+
+void slab_t::give_back(slab_magazine* mag, int32_t n)
+{
+	if (n <= 0) return;
+
+	void* head = mag->head;
+	void* tail = head;
+	for (int32_t i = 1; i < n; i++) tail = ((void**) tail)[0];
+	mag->head = ((void**) tail)[0];
+	mag->count -= n;
+
+	g_spin_enter(_lock, 128);
+	g_xslab_free_batch(_slab, head, tail, n);
+	g_spin_leave(_lock);
+}
+
+void slab_t::snapshot(slab_snapshot& out)
+{
+	memset(&out, 0, sizeof(out));
+	g_strlcpy(out.name, _name, sizeof(out.name));
+	out.alloc_size = get_alloc_size();
+	out.allocs = _allocs;
+	out.frees = _frees;
+	out.refills = _refills;
+	out.cached = _index >= 0;
+
+	if (_index >= 0) {
+		slab_mgr::thread_cache* cache = slab_mgr::get_instance()->_caches.head();
+		while (cache != NULL) {
+			const slab_magazine* mag = &cache->mags[_index];
+			if (mag->owner == this) {
+				out.allocs += mag->allocs;
+				out.frees += mag->frees;
+				out.refills += mag->refills;
+			}
+			cache = cache->_next;
+		}
+	}
+
+	out.in_use = out.allocs > out.frees ? out.allocs - out.frees : 0;
+	out.hit_rate = out.allocs > 0 ? 1.0 - (double) out.refills / out.allocs : 0.0;
+
+	g_xslab_stats_t stats;
+	g_spin_enter(_lock, 128);
+	g_xslab_get_stats(_slab, &stats);
+	out.bytes_held = (uint64_t) g_xslab_chunk_count(_slab) * g_xslab_chunk_size(_slab);
+	g_spin_leave(_lock);
+
+	out.chunk_allocs = stats.chunk_allocs;
+	out.chunk_frees = stats.chunk_frees;
+	out.bytes_high_water = (uint64_t) stats.chunk_high_water * g_xslab_chunk_size(_slab);
+	out.shrinks = stats.shrinks;
+	out.retired = stats.retired;
+}
+
+/*********************************************************************/
+
+slab_mgr::slab_mgr()
+{
+	_slabs_size = 0;
+	memset(_cached, 0, sizeof(_cached));
+	_sampler = NULL;
+	_sampler_stop = false;
+	_sample_interval = 0;
+	_sample_func = NULL;
+	_sample_param = NULL;
+	_reclaimer = NULL;
+	_reclaimer_stop = false;
+}
+
+slab_mgr::~slab_mgr()
+{
+	stop_sampling();
+	stop_reclaiming();
+}
+
+slab_magazine* slab_mgr::thread_magazines()
+{
+	slab_magazine*& mags = thread_slot();
+	if (mags != NULL) return mags;
+
+	thread_cache* cache = (thread_cache*) calloc(1, sizeof(thread_cache));
+	if (cache == NULL) return NULL;
+
+	// the magazines of the main thread live until the process exits
+	g_thread_atexit(on_thread_exit, cache);
+
+	auto_lock<spin_type> scoped_lock(_lock);
+	_caches.push_back(cache);
+	mags = cache->mags;
+	return mags;
+}
+
+void slab_mgr::on_thread_exit(void* param)
+{
+	slab_mgr* mgr = get_instance();
+	thread_cache* cache = (thread_cache*) param;
+
+	{
+		auto_lock<spin_type> scoped_lock(mgr->_lock);
+		for (int32_t i = 0; i < MAX_CACHED_SLABS; i++) {
+			slab_magazine* mag = &cache->mags[i];
+			if (mag->owner != NULL) {
+				slab_t* owner = mag->owner;
+				owner->give_back(mag, mag->count);
+				__sync_fetch_and_add(&owner->_allocs, mag->allocs);
+				__sync_fetch_and_add(&owner->_frees, mag->frees);
+				__sync_fetch_and_add(&owner->_refills, mag->refills);
+				mag->owner = NULL;
+			}
+		}
+		mgr->_caches.erase(cache);
+	}
+
+	thread_slot() = NULL;
+	::free(cache);
+}
+
+void slab_mgr::register_slab(slab_t* slab)
+{
+	auto_lock<spin_type> scoped_lock(_lock);
+	_slab_list.push_back(slab);
+	_slabs_size += 1;
+
+	// a slab without a free slot goes to _slab on every call, it's
+	// reported by slab_snapshot::cached
+	for (int32_t i = 0; i < MAX_CACHED_SLABS; i++) {
+		if (_cached[i] == NULL) {
+			_cached[i] = slab;
+			slab->_index = i;
+			break;
+		}
+	}
+}
+
+void slab_mgr::unregister_slab(slab_t* slab)
+{
+	auto_lock<spin_type> scoped_lock(_lock);
+	_slab_list.erase(slab);
+	_slabs_size -= 1;
+
+	if (slab->_index < 0) return;
+
+	// the blocks cached by the threads go away with the chunks of the slab
+	thread_cache* cache = _caches.head();
+	while (cache != NULL) {
+		slab_magazine* mag = &cache->mags[slab->_index];
+		if (mag->owner == slab) {
+			mag->owner = NULL;
+			mag->head = NULL;
+			mag->count = 0;
+		}
+		cache = cache->_next;
+	}
+
+	_cached[slab->_index] = NULL;
+	slab->_index = -1;
+}
+
+void slab_mgr::snapshot(std::vector<slab_snapshot>& out)
+{
+	auto_lock<spin_type> scoped_lock(_lock);
+	out.resize(_slabs_size);
+	size_t i = 0;
+	slab_t* node = _slab_list.head();
+	while (node != NULL) {
+		node->snapshot(out[i++]);
+		node = node->_next;
+	}
+}
+
+#ifndef NO_SLAB_NEW
+void slab_type_name(const char* mangled, char* buf, size_t size)
+{
+#ifdef __GNUC__
+	int status = -1;
+	char* name = abi::__cxa_demangle(mangled, NULL, NULL, &status);
+	if (name != NULL) {
+		g_strlcpy(buf, name, (int) size);
+		::free(name);
+		return;
+	}
+#endif
+	g_strlcpy(buf, mangled, (int) size);
+}
+#endif
+
+void slab_mgr::dump_stats(std::string& out, bool json)
+{
+	std::vector<slab_snapshot> snaps;
+	snapshot(snaps);
+
+	char line[512];
+	char name[sizeof(snaps[0].name) * 6];
+	if (json) out.append("[");
+	for (size_t i = 0; i < snaps.size(); i++) {
+		const slab_snapshot& s = snaps[i];
+		if (json) g_json_escape(s.name, name, sizeof(name));
+		else g_strlcpy(name, s.name, sizeof(name));
+		const char* fmt = json ?
+			"%s{\"name\":\"%s\",\"alloc_size\":%d,\"allocs\":%llu,\"frees\":%llu,"
+			"\"in_use\":%llu,\"hit_rate\":%.4f,\"refills\":%llu,\"chunk_allocs\":%llu,"
+			"\"chunk_frees\":%llu,\"bytes_held\":%llu,\"bytes_high_water\":%llu,"
+			"\"shrinks\":%llu,\"retired\":%llu,\"cached\":%s}" :
+			"%s%s: alloc_size=%d allocs=%llu frees=%llu in_use=%llu hit_rate=%.4f "
+			"refills=%llu chunk_allocs=%llu chunk_frees=%llu bytes_held=%llu "
+			"bytes_high_water=%llu shrinks=%llu retired=%llu cached=%s\n";
+		g_snprintf(line, sizeof(line), fmt,
+			json && i > 0 ? "," : "", name, s.alloc_size,
+			(unsigned long long) s.allocs, (unsigned long long) s.frees,
+			(unsigned long long) s.in_use, s.hit_rate, (unsigned long long) s.refills,
+			(unsigned long long) s.chunk_allocs, (unsigned long long) s.chunk_frees,
+			(unsigned long long) s.bytes_held, (unsigned long long) s.bytes_high_water,
+			(unsigned long long) s.shrinks, (unsigned long long) s.retired,
+			s.cached ? "true" : "false");
+		out.append(line);
+	}
+	if (json) out.append("]");
+}
+
+bool slab_mgr::start_sampling(double interval, sample_func func, void* param)
+{
+	auto_lock<spin_type> scoped_lock(_lock);
+	if (_sampler != NULL || func == NULL || interval <= 0) return false;
+
+	_sampler_stop = false;
+	_sample_interval = interval;
+	_sample_func = func;
+	_sample_param = param;
+	_sampler = g_thread_start(sampling_proc, this);
+	return _sampler != NULL;
+}
+
+void slab_mgr::stop_sampling()
+{
+	g_thread_t sampler;
+	{
+		auto_lock<spin_type> scoped_lock(_lock);
+		sampler = _sampler;
+		_sampler_stop = true;
+	}
+	if (sampler == NULL) return;
+
+	g_thread_join(sampler, NULL);
+	auto_lock<spin_type> scoped_lock(_lock);
+	_sampler = NULL;
+}
+
+void* slab_mgr::sampling_proc(void* param)
+{
+	slab_mgr* mgr = (slab_mgr*) param;
+	std::vector<slab_snapshot> snaps;
+
+	int64_t next = g_now_ms();
+	while (1) {
+		next += (int64_t) (mgr->_sample_interval * 1000);
+		if (!sleep_until(next, &mgr->_sampler_stop)) break;
+
+		mgr->snapshot(snaps);
+		mgr->_sample_func(snaps, mgr->_sample_param);
+	}
+	return 0;
+}
+
+void slab_mgr::reclaim(const reclaim_policy& policy)
+{
+	auto_lock<spin_type> scoped_lock(_lock);
+	int64_t now = g_now_ms();
+	slab_t* node = _slab_list.head();
+	while (node != NULL) {
+		node->reclaim(policy, now);
+		node = node->_next;
+	}
+}
+
+bool slab_mgr::start_reclaiming(const reclaim_policy& policy)
+{
+	auto_lock<spin_type> scoped_lock(_lock);
+	if (_reclaimer != NULL || policy.interval <= 0) return false;
+
+	_reclaimer_stop = false;
+	_reclaim_policy = policy;
+	_reclaimer = g_thread_start(reclaiming_proc, this);
+	return _reclaimer != NULL;
+}
+
+void slab_mgr::stop_reclaiming()
+{
+	g_thread_t reclaimer;
+	{
+		auto_lock<spin_type> scoped_lock(_lock);
+		reclaimer = _reclaimer;
+		_reclaimer_stop = true;
+	}
+	if (reclaimer == NULL) return;
+
+	g_thread_join(reclaimer, NULL);
+	auto_lock<spin_type> scoped_lock(_lock);
+	_reclaimer = NULL;
+}
+
+void* slab_mgr::reclaiming_proc(void* param)
+{
+	slab_mgr* mgr = (slab_mgr*) param;
+
+	int64_t next = g_now_ms();
+	while (1) {
+		next += (int64_t) (mgr->_reclaim_policy.interval * 1000);
+		if (!sleep_until(next, &mgr->_reclaimer_stop)) break;
+		mgr->reclaim(mgr->_reclaim_policy);
+	}
+	return 0;
+}
+
+bool slab_mgr::sleep_until(int64_t next_ms, volatile bool* stop)
+{
+	while (!*stop) {
+		int64_t left = next_ms - g_now_ms();
+		if (left <= 0) return true;
+		g_thread_sleep((left < 10 ? left : 10) * 0.001);
+	}
+	return false;
+}
+
+} //namespace
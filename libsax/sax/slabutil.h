@@ -4,6 +4,9 @@
 #include <stddef.h>
 #include <assert.h>
 #include <memory>
+#include <string>
+#include <vector>
+#include <typeinfo>
 #include "os_types.h"
 #include "mempool.h"
 #include "sysutil.h"
@@ -12,41 +15,144 @@
 
 namespace sax {
 
+class slab_t;
+
+/// the cache of a slab_t in a thread, a free-list of at most slab_t::MAGAZINE_SIZE
+/// blocks, which is refilled from and given back to the shared g_xslab_t in batches
+struct slab_magazine
+{
+	slab_t* owner;
+	void* head;
+	int32_t count;
+	uint32_t epoch;
+
+	// updated by the thread itself, summed up by slab_mgr::snapshot()
+	uint64_t allocs;
+	uint64_t frees;
+	uint64_t refills;	// allocs which went to the shared g_xslab_t
+};
+
+/// a snapshot of a slab, returned by slab_mgr::snapshot()
+struct slab_snapshot
+{
+	char name[33];
+	int32_t alloc_size;
+	uint64_t allocs;
+	uint64_t frees;
+	uint64_t in_use;			// blocks held by the users
+	double hit_rate;			// allocs served by the thread caches without the lock
+	uint64_t refills;			// allocs which went to the shared g_xslab_t
+	uint64_t chunk_allocs;		// chunks taken from the system, i.e. the malloc fallbacks
+	uint64_t chunk_frees;		// chunks given back to the system
+	uint64_t bytes_held;		// in the chunks
+	uint64_t bytes_high_water;
+	uint64_t shrinks;
+	uint64_t retired;			// free blocks released with their chunks
+	bool cached;				// false if the slab got no thread caches
+};
+
+/// the background reclaimer of slab_mgr. every "interval" seconds it updates
+/// an EWMA of the blocks in use of each slab, with the weight "alpha" for the
+/// newest sample. once a slab hasn't reached a new peak for "idle_sec" seconds,
+/// its free blocks beyond "headroom" times the EWMA are given back, at most
+/// "max_step" of them at a time, then it waits for another idle period.
+/// only the chunks of the shared g_xslab_t without blocks in use are released,
+/// the thread caches are left alone and no shrink is left pending, so the
+/// frees keep going to the thread caches.
+struct reclaim_policy
+{
+	double interval;
+	double alpha;
+	double idle_sec;
+	double headroom;
+	double max_step;
+
+	reclaim_policy() :
+		interval(1.0), alpha(0.2), idle_sec(10.0), headroom(0.25), max_step(0.25) {}
+};
+
 class slab_t
 {
 public:
-	slab_t(int32_t size);
+	enum {
+		MAGAZINE_SIZE = 64,		// blocks cached by a thread at most
+		MAGAZINE_BATCH = 32		// blocks moved from/to the shared g_xslab_t at a time
+	};
+
+	// "name" shows in slab_mgr::snapshot(), "slab<size>" by default
+	slab_t(int32_t size, const char* name = NULL);
 	~slab_t();
 
-	inline void shrink(double keep)
-	{
-		g_spin_enter(_lock, 128);
-		g_xslab_shrink(_slab, keep);
-		g_spin_leave(_lock);
-	}
+	// the calling thread gives back its magazine at once, the other threads
+	// give back theirs at their next alloc() or free(), then they refill their
+	// magazines as usual
+	void shrink(double keep);
 
 	inline void* alloc()
 	{
-		g_spin_enter(_lock, 128);
-		void* ptr = g_xslab_alloc(_slab);
-		g_spin_leave(_lock);
-		return ptr;
+		slab_magazine* mag = magazine();
+		if (LIKELY(mag != NULL && mag->count > 0)) {
+			void* ptr = mag->head;
+			mag->head = ((void**) ptr)[0];
+			--(mag->count);
+			++(mag->allocs);
+			return ptr;
+		}
+		return alloc_slow();
 	}
 
 	inline void free(void* ptr)
 	{
-		g_spin_enter(_lock, 128);
-		g_xslab_free(_slab, ptr);
-		g_spin_leave(_lock);
+		slab_magazine* mag = magazine();
+		if (LIKELY(mag != NULL && mag->count < MAGAZINE_SIZE)) {
+			((void**) ptr)[0] = mag->head;
+			mag->head = ptr;
+			++(mag->count);
+			++(mag->frees);
+			return;
+		}
+		free_slow(ptr);
 	}
 
 	inline int32_t get_alloc_size() { return g_xslab_alloc_size(_slab); }
-	inline int32_t get_usable_amount() { return g_xslab_usable_amount(_slab); }
+	// blocks in the shared g_xslab_t and in the magazine of the calling thread
+	int32_t get_usable_amount();
 	inline int32_t get_shrink_amount() { return g_xslab_shrink_amount(_slab); }
 
+	inline const char* name() const { return _name; }
+
 private:
+	// the magazine of the calling thread, NULL if it isn't ready for use
+	inline slab_magazine* magazine();
+	slab_magazine* acquire_magazine();
+
+	void* alloc_slow();
+	void free_slow(void* ptr);
+
+	// move "n" blocks from the head of "mag" to the shared g_xslab_t
+	void give_back(slab_magazine* mag, int32_t n);
+
+	// NOTICE: called by slab_mgr::snapshot() under its lock
+	void snapshot(slab_snapshot& out);
+
+	// NOTICE: called by slab_mgr::reclaim() under its lock
+	void reclaim(const reclaim_policy& policy, int64_t now_ms);
+
+	char _name[33];
 	g_xslab_t* _slab;
 	g_spin_t* _lock;
+	int32_t _index;				// of the magazine in every thread, -1 for none
+	volatile uint32_t _epoch;	// increased by shrink(), older magazines are given back
+
+	// of the calls without magazines and of the exited threads, updated atomically
+	uint64_t _allocs;
+	uint64_t _frees;
+	uint64_t _refills;
+
+	// of the reclaimer
+	double _ewma_in_use;
+	uint64_t _peak_in_use;
+	int64_t _peak_ms;			// 0 before the first round
 
 	// declare for linkedlist
 	friend class slab_mgr;
@@ -60,12 +166,17 @@ class slab_mgr
 	friend class slab_t;
 
 public:
+	enum {MAX_CACHED_SLABS = 256};	// slabs beyond it have no magazines
+
 	static slab_mgr* get_instance()
 	{
 		static slab_mgr instance;
 		return &instance;
 	}
 
+	// stops the sampler and the reclaimer
+	~slab_mgr();
+
 	// try to shrunk every slab
 	void shrink_slabs(double keep = 0.9)
 	{
@@ -80,30 +191,75 @@ public:
 	// for test
 	inline size_t get_slabs_size() {return _slabs_size;}
 
-private:
+	/// takes a snapshot of every registered slab. the counters of the
+	/// thread caches are read racily, they may be a little behind
+	void snapshot(std::vector<slab_snapshot>& out);
+
+	/// appends a snapshot of all slabs to out, one line per slab or a json array
+	void dump_stats(std::string& out, bool json = false);
 
-	slab_mgr() {_slabs_size = 0;}
+	typedef void (*sample_func)(const std::vector<slab_snapshot>& snaps, void* param);
 
-	void register_slab(slab_t* slab)
+	/// calls "func" with a snapshot every "interval" seconds, in a thread of
+	/// slab_mgr. returns false if it's already started
+	bool start_sampling(double interval, sample_func func, void* param);
+	void stop_sampling();
+
+	/// one round of the reclaimer, see reclaim_policy
+	void reclaim(const reclaim_policy& policy);
+
+	/// runs reclaim() every policy.interval seconds, in a thread of slab_mgr.
+	/// returns false if it's already started
+	bool start_reclaiming(const reclaim_policy& policy);
+	void stop_reclaiming();
+
+private:
+	// the magazines of a thread, indexed by slab_t::_index
+	struct thread_cache
 	{
-		auto_lock<spin_type> scoped_lock(_lock);
-		_slab_list.push_back(slab);
-		_slabs_size += 1;
-	}
+		thread_cache* _prev;
+		thread_cache* _next;
+		slab_magazine mags[MAX_CACHED_SLABS];
+	};
+
+	slab_mgr();
 
-	void unregister_slab(slab_t* slab)
+	static inline slab_magazine*& thread_slot()
 	{
-		auto_lock<spin_type> scoped_lock(_lock);
-		_slab_list.erase(slab);
-		_slabs_size -= 1;
+		static thread_local slab_magazine* mags = NULL;
+		return mags;
 	}
 
+	// create the magazines of the calling thread at its first use
+	slab_magazine* thread_magazines();
+	static void on_thread_exit(void* param);
+
+	void register_slab(slab_t* slab);
+	void unregister_slab(slab_t* slab);
+
+	static void* sampling_proc(void* param);
+	static void* reclaiming_proc(void* param);
+	// false if "stop" is set before "next_ms"
+	static bool sleep_until(int64_t next_ms, volatile bool* stop);
+
 	spin_type _lock;
 	linkedlist<slab_t> _slab_list;
 	size_t _slabs_size;
+	linkedlist<thread_cache> _caches;
+	slab_t* _cached[MAX_CACHED_SLABS];
+
+	g_thread_t _sampler;
+	volatile bool _sampler_stop;
+	double _sample_interval;
+	sample_func _sample_func;
+	void* _sample_param;
+
+	g_thread_t _reclaimer;
+	volatile bool _reclaimer_stop;
+	reclaim_policy _reclaim_policy;
 };
 
-inline slab_t::slab_t(int32_t size)
+inline slab_t::slab_t(int32_t size, const char* name)
 {
 	_slab = g_xslab_init(size);
 	_lock = g_spin_init();
@@ -111,6 +267,15 @@ inline slab_t::slab_t(int32_t size)
 	assert(_slab);
 	assert(_lock);
 
+	if (name != NULL) g_snprintf(_name, sizeof(_name), "%.32s", name);
+	else g_snprintf(_name, sizeof(_name), "slab<%d>", (int) size);
+
+	_index = -1;
+	_epoch = 0;
+	_allocs = _frees = _refills = 0;
+	_ewma_in_use = 0;
+	_peak_in_use = 0;
+	_peak_ms = 0;
 	_next = _prev = NULL;
 
 	slab_mgr::get_instance()->register_slab(const_cast<slab_t*>(this));
@@ -126,24 +291,77 @@ inline slab_t::~slab_t()
 	_lock = NULL;
 }
 
+inline slab_magazine* slab_t::magazine()
+{
+	slab_magazine* mags = slab_mgr::thread_slot();
+	if (UNLIKELY(mags == NULL || _index < 0)) return NULL;
+
+	slab_magazine* mag = mags + _index;
+	if (LIKELY(mag->owner == this && mag->epoch == _epoch)) return mag;
+	return NULL;
+}
+
 /*********************************************************************/
 
 #ifndef NO_SLAB_NEW
 
-template <size_t ALLOC_SIZE>
+// the demangled name of typeid(T).name() if possible, at most 32 chars
+void slab_type_name(const char* mangled, char* buf, size_t size);
+
+// the slab of the blocks of ALLOC_SIZE, shared by slab_new<T>() and the
+// STL allocators. with SLAB_NEW_BY_TYPE defined, slab_new<T>() has a slab
+// of its own for each T named after T, so the snapshots tell which types
+// hold the memory. NOTICE: only the first slab_mgr::MAX_CACHED_SLABS slabs
+// have thread caches, see slab_snapshot::cached.
+template <size_t ALLOC_SIZE, typename T = void>
 struct slab_holder
 {
 	static slab_t& get_slab()
 	{
-		static slab_t slab(ALLOC_SIZE);
+		static slab_t slab(ALLOC_SIZE, name());
 		return slab;
 	}
+
+	static const char* name()
+	{
+		static char buf[33];
+		slab_type_name(typeid(T).name(), buf, sizeof(buf));
+		return buf;
+	}
 };
 
+template <size_t ALLOC_SIZE>
+struct slab_holder<ALLOC_SIZE, void>
+{
+	static slab_t& get_slab()
+	{
+		static slab_t slab(ALLOC_SIZE, name());
+		return slab;
+	}
+
+	static const char* name()
+	{
+		static char buf[33];
+		g_snprintf(buf, sizeof(buf), "slab_new<%d>", (int) ALLOC_SIZE);
+		return buf;
+	}
+};
+
+// the slab of slab_new<T>()
+template <typename T>
+inline slab_t& slab_of()
+{
+#ifdef SLAB_NEW_BY_TYPE
+	return slab_holder<sizeof(T), T>::get_slab();
+#else
+	return slab_holder<sizeof(T)>::get_slab();
+#endif
+}
+
 template <typename T>
 inline T* slab_new()
 {
-	slab_t& slab = slab_holder<sizeof(T)>::get_slab();
+	slab_t& slab = slab_of<T>();
 	void* ptr = slab.alloc();
 	if (LIKELY(ptr)) {
 		return new (ptr) T();
@@ -154,7 +372,7 @@ inline T* slab_new()
 template <typename T, typename P1>
 inline T* slab_new(P1 p1)
 {
-	void* ptr = slab_holder<sizeof(T)>::get_slab().alloc();
+	void* ptr = slab_of<T>().alloc();
 	if (LIKELY(ptr)) {
 		return new (ptr) T(p1);
 	}
@@ -164,7 +382,7 @@ inline T* slab_new(P1 p1)
 template <typename T, typename P1, typename P2>
 inline T* slab_new(P1 p1, P2 p2)
 {
-	void* ptr = slab_holder<sizeof(T)>::get_slab().alloc();
+	void* ptr = slab_of<T>().alloc();
 	if (LIKELY(ptr)) {
 		return new (ptr) T(p1, p2);
 	}
@@ -174,7 +392,7 @@ inline T* slab_new(P1 p1, P2 p2)
 template <typename T, typename P1, typename P2, typename P3>
 inline T* slab_new(P1 p1, P2 p2, P3 p3)
 {
-	void* ptr = slab_holder<sizeof(T)>::get_slab().alloc();
+	void* ptr = slab_of<T>().alloc();
 	if (LIKELY(ptr)) {
 		return new (ptr) T(p1, p2, p3);
 	}
@@ -185,7 +403,7 @@ template <typename T>
 inline void slab_delete(T* obj)
 {
 	obj->~T();
-	slab_holder<sizeof(T)>::get_slab().free((void*) obj);
+	slab_of<T>().free((void*) obj);
 }
 
 #define SLAB_NEW(type)					slab_new<type>()
@@ -265,6 +483,148 @@ public:
 	void destroy(pointer __p) { __p->~_Tp(); }
 };
 
+/*********************************************************************/
+
+/// a general allocator: sizes up to MAX_SIZE go to the slabs of geometric
+/// classes (4 classes for each power of 2), larger ones go to pages
+class size_classes
+{
+public:
+	enum {
+		MAX_SIZE = 4096,
+		CLASSES = 32
+	};
+
+	// never destroyed, the static objects may free their blocks at exit
+	static size_classes* get_instance()
+	{
+		static size_classes* instance = new size_classes();
+		return instance;
+	}
+
+	inline void* alloc(size_t size)
+	{
+		if (LIKELY(size <= MAX_SIZE)) {
+			return _slabs[_index[(size + 7) >> 3]]->alloc();
+		}
+		return g_shm_alloc_pages((size + g_shm_unit() - 1) / g_shm_unit());
+	}
+
+	// "size" must be the one given to alloc()
+	inline void free(void* ptr, size_t size)
+	{
+		if (LIKELY(size <= MAX_SIZE)) {
+			_slabs[_index[(size + 7) >> 3]]->free(ptr);
+		}
+		else {
+			g_shm_free_pages(ptr);
+		}
+	}
+
+	// the bytes taken for "size", 0 for pages
+	inline size_t class_size(size_t size)
+	{
+		if (size > MAX_SIZE) return 0;
+		return _slabs[_index[(size + 7) >> 3]]->get_alloc_size();
+	}
+
+private:
+	size_classes()
+	{
+		// 8, 16, ..., 64, then 80, 96, 112, 128, 160, ..., 4096
+		int32_t sizes[CLASSES];
+		int32_t n = 0;
+		for (int32_t size = 8; size <= 64; size += 8) sizes[n++] = size;
+		for (int32_t base = 64; base < MAX_SIZE; base *= 2) {
+			for (int32_t i = 1; i <= 4; i++) sizes[n++] = base + base / 4 * i;
+		}
+		assert(n == CLASSES);
+
+		for (int32_t i = 0, c = 0; i <= MAX_SIZE / 8; i++) {
+			while (sizes[c] < i * 8) c++;
+			_index[i] = (uint8_t) c;
+		}
+		char name[33];
+		for (int32_t i = 0; i < CLASSES; i++) {
+			g_snprintf(name, sizeof(name), "size_class<%d>", (int) sizes[i]);
+			_slabs[i] = new slab_t(sizes[i], name);
+		}
+	}
+
+	uint8_t _index[MAX_SIZE / 8 + 1];	// (size + 7) / 8 -> class
+	slab_t* _slabs[CLASSES];
+};
+
+inline void* slab_alloc(size_t size)
+{
+	return size_classes::get_instance()->alloc(size);
+}
+
+inline void slab_free(void* ptr, size_t size)
+{
+	size_classes::get_instance()->free(ptr, size);
+}
+
+/// an STL allocator on size_classes, for the containers of any node size
+/// and for the variable-size ones like std::vector and std::string
+template <typename _Tp>
+class slab_allocator
+{
+public:
+	typedef size_t     size_type;
+	typedef ptrdiff_t  difference_type;
+	typedef _Tp*       pointer;
+	typedef const _Tp* const_pointer;
+	typedef _Tp&       reference;
+	typedef const _Tp& const_reference;
+	typedef _Tp        value_type;
+
+	template <typename _Tp1>
+	struct rebind
+	{typedef slab_allocator<_Tp1> other;};
+
+	slab_allocator() throw() { }
+
+	slab_allocator(const slab_allocator& __a) throw() { }
+
+	template<typename _Tp1>
+	slab_allocator(const slab_allocator<_Tp1>&) throw() { }
+
+	~slab_allocator() throw() { }
+
+	pointer address(reference __x) const { return &__x; }
+
+	const_pointer address(const_reference __x) const { return &__x; }
+
+	pointer allocate(size_type __n, const void* = 0)
+	{
+		void* ptr = slab_alloc(__n * sizeof(_Tp));
+		if (UNLIKELY(ptr == NULL)) throw std::bad_alloc();
+		return static_cast<pointer>(ptr);
+	}
+
+	void deallocate(pointer __p, size_type __n) throw()
+	{
+		slab_free(static_cast<void*>(__p), __n * sizeof(_Tp));
+	}
+
+	size_type max_size() const throw()
+	{ return size_t(-1) / sizeof(_Tp); }
+
+	void construct(pointer __p, const _Tp& __val)
+	{ ::new((void *)__p) _Tp(__val); }
+
+	void destroy(pointer __p) { __p->~_Tp(); }
+};
+
+template <typename _Tp1, typename _Tp2>
+inline bool operator==(const slab_allocator<_Tp1>&, const slab_allocator<_Tp2>&)
+{ return true; }
+
+template <typename _Tp1, typename _Tp2>
+inline bool operator!=(const slab_allocator<_Tp1>&, const slab_allocator<_Tp2>&)
+{ return false; }
+
 #else
 
 #define SLAB_NEW(type) new type()
@@ -278,6 +638,13 @@ template<typename _Tp>
 class slab_stl_allocator : public std::allocator<_Tp>
 {};
 
+inline void* slab_alloc(size_t size) { return ::malloc(size); }
+inline void slab_free(void* ptr, size_t size) { ::free(ptr); }
+
+template<typename _Tp>
+class slab_allocator : public std::allocator<_Tp>
+{};
+
 #endif
 
 } //namespace
@@ -9,16 +9,29 @@
 #define DISPATCHER_H_
 
 #include "sax/os_types.h"
+#include "sax/os_api.h"
+#include "sax/hash.h"
+#include "sax/compiler.h"
 #include "event_type.h"
+#include "event_queue.h"
 
 namespace sax {
 
+/// NOTICE: dispatch() is called by the producer threads concurrently
 class dispatcher_base
 {
 public:
 	virtual ~dispatcher_base() {}
 	virtual void init(uint32_t number_of_queues) = 0;
 	virtual uint32_t dispatch(int32_t event_type, uint64_t shard_key) = 0;
+
+	// called before init(), for the dispatchers that need to look into the queues
+	virtual void attach(event_queue** queues) {}
+
+	// called by elastic stages when the number of active queues changes,
+	// dispatch() may run concurrently and must only return the queues
+	// in [0, number_of_queues) after it returns
+	virtual void resize(uint32_t number_of_queues) { init(number_of_queues); }
 };
 
 class single_dispatcher : public dispatcher_base
@@ -28,6 +41,7 @@ public:
 	inline uint32_t dispatch(int32_t, uint64_t) { return 0; }
 };
 
+/// round-robin, ignores the shard_key
 class default_dispatcher : public dispatcher_base
 {
 public:
@@ -38,13 +52,122 @@ public:
 
 	uint32_t dispatch(int32_t, uint64_t)
 	{
-		if (++_curr >= _queues) _curr = 0;
-		return _curr;
+		return __sync_fetch_and_add(&_curr, 1) % _queues;
+	}
+
+private:
+	volatile uint32_t _curr;
+	volatile uint32_t _queues;
+};
+
+/// the events with the same shard_key always go to the same queue,
+/// the events without a shard_key (zero) are dispatched round-robin
+class hash_dispatcher : public dispatcher_base
+{
+public:
+	hash_dispatcher() : _queues(0) {}
+	~hash_dispatcher() {}
+
+	void init(uint32_t number_of_queues)
+	{
+		_queues = number_of_queues;
+		_round_robin.init(number_of_queues);
+	}
+
+	uint32_t dispatch(int32_t event_type, uint64_t shard_key)
+	{
+		if (UNLIKELY(shard_key == 0)) return _round_robin.dispatch(event_type, 0);
+		return (uint32_t) (murmur_hash64(&shard_key, sizeof(shard_key)) % _queues);
 	}
 
 private:
-	uint32_t _curr;
-	uint32_t _queues;
+	volatile uint32_t _queues;
+	default_dispatcher _round_robin;
+};
+
+/// jump consistent hash (John Lamping, Eric Veach. "A Fast, Minimal Memory,
+/// Consistent Hash Algorithm"). when the number of queues changes from n to
+/// n+1, only 1/(n+1) of the shard_keys move to another queue.
+/// the events without a shard_key (zero) are dispatched round-robin.
+class jump_hash_dispatcher : public dispatcher_base
+{
+public:
+	jump_hash_dispatcher() : _queues(0) {}
+	~jump_hash_dispatcher() {}
+
+	void init(uint32_t number_of_queues)
+	{
+		_queues = number_of_queues;
+		_round_robin.init(number_of_queues);
+	}
+
+	uint32_t dispatch(int32_t event_type, uint64_t shard_key)
+	{
+		if (UNLIKELY(shard_key == 0)) return _round_robin.dispatch(event_type, 0);
+		return jump_hash(shard_key, _queues);
+	}
+
+	static uint32_t jump_hash(uint64_t key, uint32_t buckets)
+	{
+		int64_t b = -1, j = 0;
+		while (j < (int64_t) buckets) {
+			b = j;
+			key = key * 2862933555777941757ULL + 1;
+			j = (int64_t) ((b + 1) * ((double) (1LL << 31) / (double) ((key >> 33) + 1)));
+		}
+		return (uint32_t) b;
+	}
+
+private:
+	volatile uint32_t _queues;
+	default_dispatcher _round_robin;
+};
+
+/// power of two choices: pick two queues at random and send the event to
+/// the shorter one. the events with a shard_key are hashed for keeping
+/// the per-key ordering.
+class p2c_dispatcher : public dispatcher_base
+{
+public:
+	p2c_dispatcher() : _queues(0), _queue_array(NULL) {}
+	~p2c_dispatcher() {}
+
+	void attach(event_queue** queues) { _queue_array = queues; }
+
+	void init(uint32_t number_of_queues) { _queues = number_of_queues; }
+
+	uint32_t dispatch(int32_t, uint64_t shard_key)
+	{
+		uint32_t n = _queues;	// read once, it may be resized concurrently
+		if (UNLIKELY(shard_key != 0)) {
+			return (uint32_t) (murmur_hash64(&shard_key, sizeof(shard_key)) % n);
+		}
+
+		if (UNLIKELY(n == 1 || _queue_array == NULL)) return 0;
+
+		uint32_t r = next_random();
+		uint32_t a = r % n;
+		uint32_t b = (a + 1 + (r >> 16) % (n - 1)) % n;	// b != a
+
+		return _queue_array[a]->size() <= _queue_array[b]->size() ? a : b;
+	}
+
+private:
+	// xorshift, one state per producer thread
+	static inline uint32_t next_random()
+	{
+		static thread_local uint32_t state = 0;
+		uint32_t x = state;
+		if (UNLIKELY(x == 0)) x = (uint32_t) g_thread_id() | 1;
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		state = x;
+		return x;
+	}
+
+	volatile uint32_t _queues;
+	event_queue** _queue_array;
 };
 
 } // namespace
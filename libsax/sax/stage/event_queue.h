@@ -19,82 +19,324 @@
 
 namespace sax {
 
+class event_queue;
+
+/// notified when the used space of an event_queue crosses its watermarks,
+/// upstream stages may stop reading sockets etc. on_high_watermark() runs
+/// in the producer that crosses the high watermark, on_low_watermark()
+/// runs in the consumer that drains the queue under the low watermark.
+/// NOTICE: both are called inline, keep them cheap.
+class watermark_listener
+{
+public:
+	virtual void on_high_watermark(event_queue* queue) = 0;
+	virtual void on_low_watermark(event_queue* queue) = 0;
+	virtual ~watermark_listener() {}
+};
+
 class event_queue
 {
 private:
 	struct event_header
 	{
-		enum state {ALLOCATED, COMMITTED, SKIPPED};
-		volatile state block_state;
+		enum state {ALLOCATED, COMMITTED, SKIPPED, DONE};
+		// (seq << 2) | state, "seq" is the allocation sequence of the block.
+		// the consumer only accepts the header with the expected sequence,
+		// so stale bytes left in the ring never look like a committed block.
+		volatile uint32_t block_tag;
+		// the length is aligned to sizeof(intptr_t), the lowest bit is
+		// used as the PINNED flag: the block can't be stolen by the
+		// other threads of a work-stealing stage
 		int32_t block_size;
 	};
 
+	enum {TAG_STATE_BITS = 2, TAG_STATE_MASK = 3};
+	enum {BLOCK_PINNED = 1};
+
+	static inline int32_t block_length(const event_header* block)
+	{
+		return block->block_size & ~(int32_t) BLOCK_PINNED;
+	}
+
+	static inline uint32_t make_tag(uint32_t seq, event_header::state s)
+	{
+		return (seq << TAG_STATE_BITS) | (uint32_t) s;
+	}
+
+	// the allocation cursor is packed as (seq << 32) | pos, producers
+	// reserve a block by a single CAS on it.
+	static inline uint64_t make_cursor(uint32_t seq, int32_t pos)
+	{
+		return (((uint64_t) seq) << 32) | (uint32_t) pos;
+	}
+
+	static inline int32_t cursor_pos(uint64_t cursor) { return (int32_t) (uint32_t) cursor; }
+	static inline uint32_t cursor_seq(uint64_t cursor) { return (uint32_t) (cursor >> 32); }
+
 public:
-	event_queue(int32_t cap) throw(std::bad_alloc) :
-		_buf(NULL), _lock(128), _cap(cap)
+	// "numa_node" >= 0 places the buffer on that node, it should be
+	// the node of the consumer thread. otherwise the buffer comes from
+	// the huge-page arena if g_shm_arena_init() has set it up.
+	event_queue(int32_t cap, int32_t numa_node = -1) throw(std::bad_alloc) :
+		_buf(NULL), _cap(cap), _buf_pages(0), _buf_arena(false)
 	{
 		assert(_cap > (int32_t) sizeof(event_header));
-		_buf = new char[_cap];	// just throw std::bad_alloc() if failed
+		if (numa_node >= 0) {
+			_buf_pages = (uint32_t) ((_cap + g_shm_unit() - 1) / g_shm_unit());
+			_buf = (char*) g_numa_alloc_pages(_buf_pages, numa_node);
+			if (_buf == NULL) throw std::bad_alloc();
+		}
+		else if (g_shm_arena_stat(NULL, NULL) > 0) {
+			_buf = (char*) g_shm_alloc_pages((uint32_t) ((_cap + g_shm_unit() - 1) / g_shm_unit()));
+			if (_buf == NULL) throw std::bad_alloc();
+			_buf_arena = true;
+		}
+		else {
+			_buf = new char[_cap];	// just throw std::bad_alloc() if failed
+		}
 
-		_alloc_pos = 0;
+		_alloc_cursor = make_cursor(0, 0);
 		_free_pos = 0;
+		_free_seq = 0;
+		_claim_pos = 0;
+		_claim_seq = 0;
+		_claiming = false;
+		_parked = 0;
+		_wake_target = this;
+		_high_watermark = 0;
+		_low_watermark = 0;
+		_listener = NULL;
+		_congested = 0;
+		_space_waiters = 0;
 	}
 
+	// "high" and "low" are in bytes of the buffer, 0 disables the watermarks.
+	// the queue is congested from the moment the used space reaches "high"
+	// until it drops to "low" or below.
+	// NOTICE: call it before any producer starts
+	void set_watermarks(int32_t high, int32_t low, watermark_listener* listener = NULL)
+	{
+		assert(high >= 0 && high <= _cap && low >= 0 && low <= high);
+		_high_watermark = high;
+		_low_watermark = low;
+		_listener = listener;
+	}
+
+	// non-blocking flow control status for producers
+	inline bool congested() const { return _congested != 0; }
+
 	~event_queue()
 	{
-		delete[] _buf;
+		if (_buf_pages > 0) g_numa_free_pages(_buf, _buf_pages);
+		else if (_buf_arena) g_shm_free_pages(_buf);
+		else delete[] _buf;
 		_buf = NULL;
 	}
 
+	// NOTICE: only one consumer thread is allowed
 	event_type* pop_event()
 	{
-		if (UNLIKELY(_free_pos == _alloc_pos)) return NULL;
-		if (UNLIKELY(_cap - _free_pos <= (int32_t) sizeof(event_header))) {
-			_free_pos = 0;
+		int32_t pos = _free_pos;
+		event_type* ev = peek_event(pos, _free_seq);
+		_free_pos = pos;
+		return ev;
+	}
+
+	// pop at most "max" committed events in order without releasing them,
+	// release them by destroy_events() all at once.
+	// returns the number of events stored into "evs".
+	// NOTICE: only one consumer thread is allowed
+	int32_t pop_events(event_type** evs, int32_t max)
+	{
+		int32_t pos = _free_pos;
+		uint32_t seq = _free_seq;
+		int32_t n = 0;
+
+		while (n < max) {
+			event_type* ev = peek_event(pos, seq);
+			if (ev == NULL) break;
+			evs[n++] = ev;
+			pos += block_length((event_header*) (_buf + pos));
+			++seq;
 		}
 
-		event_header::state s = ((event_header*) (_buf + _free_pos))->block_state;
-		if (LIKELY(s == event_header::COMMITTED)) {
-			return (event_type*) (_buf + _free_pos + sizeof(event_header));
+		return n;
+	}
+
+	// destroy the events returned by pop_events(), and release
+	// the space of the whole batch in one update
+	void destroy_events(event_type** evs, int32_t n)
+	{
+		if (UNLIKELY(n <= 0)) return;
+
+		for (int32_t i = 0; i < n; i++) {
+			evs[i]->destroy();
 		}
-		else if (UNLIKELY(s == event_header::SKIPPED)) {
-			_free_pos = 0;
-			s = ((event_header*) (_buf))->block_state;
-			if (LIKELY(s == event_header::COMMITTED)) {
-				return (event_type*) (_buf + sizeof(event_header));
-			}
+
+		event_header* last = (event_header*) ((char*) evs[n - 1] - sizeof(event_header));
+		_free_seq += n;
+		_free_pos = (int32_t) ((char*) last - _buf) + block_length(last);
+		space_released();
+	}
+
+	// park the consumer thread until an event is committed and
+	// wake() is called, or "sec" seconds passed. "other" is another queue
+	// of the same consumer (e.g. a priority lane) whose producers wake
+	// this queue.
+	// NOTICE: only the consumer thread is allowed to call it
+	void park(double sec, event_queue* other = NULL)
+	{
+		_parked = 1;
+		__sync_synchronize();	// pairs with the barrier in wake()
+
+		// check again, a producer may commit before seeing "_parked"
+		if (!has_event() && (other == NULL || !other->has_event())) {
+			_waker.wait(sec);
 		}
 
-		return NULL;
+		// if a producer has cleared the flag, its post() is consumed by
+		// the next park(), which just returns early
+		__sync_bool_compare_and_swap(&_parked, 1, 0);
+	}
+
+	// the queue that commit_event() wakes, the consumer parks on it.
+	// e.g. a priority lane wakes the normal lane of the same thread.
+	// NOTICE: call it before any producer starts
+	void set_wake_target(event_queue* target)
+	{
+		_wake_target = target ? target : this;
+	}
+
+	// wake up the consumer if it is parked, it is cheap when the consumer
+	// is busy. commit_event() calls it on the wake target of the queue.
+	inline void wake()
+	{
+		__sync_synchronize();	// make the committed state visible first
+		if (UNLIKELY(_parked) && __sync_bool_compare_and_swap(&_parked, 1, 0)) {
+			_waker.post();
+		}
+	}
+
+	// whether a committed event is waiting for the consumer, it's read-only
+	// and doesn't move any cursor. in the shared consuming mode the claim
+	// cursor is read under the consumer lock.
+	bool has_event()
+	{
+		if (_claiming) {
+			auto_lock<spin_type> scoped_lock(_consumer_lock);
+			int32_t pos = _claim_pos;
+			return peek_block(pos, cursor_pos(_alloc_cursor), _claim_seq,
+					event_header::COMMITTED) != NULL;
+		}
+
+		int32_t pos = _free_pos;
+		return peek_event(pos, _free_seq) != NULL;
+	}
+
+	// unconditionally wake up the consumer, for stopping the thread
+	void interrupt()
+	{
+		_waker.post();
+	}
+
+	// number of events allocated but not released yet, it's a snapshot
+	// and can be read by any thread (e.g. load-aware dispatchers)
+	inline uint32_t size() const
+	{
+		return cursor_seq(_alloc_cursor) - _free_seq;
+	}
+
+	// sequences of the next event to allocate and of the next event to
+	// consume, both wrap around, "allocated() - consumed()" equals size()
+	inline uint32_t allocated() const { return cursor_seq(_alloc_cursor); }
+	inline uint32_t consumed() const { return _free_seq; }
+
+	// bytes of the buffer in use, including the skipped tail, it's a snapshot
+	inline int32_t used_bytes() const
+	{
+		int32_t used = cursor_pos(_alloc_cursor) - _free_pos;
+		return used >= 0 ? used : used + _cap;
+	}
+
+	inline bool owns(const void* ptr) const
+	{
+		return (const char*) ptr >= _buf && (const char*) ptr < _buf + _cap;
+	}
+
+	// the shared consuming mode, for work-stealing stages.
+	// several threads claim events in order and release them in any order,
+	// the space is given back to producers when the leading blocks are done.
+	// NOTICE: don't mix it with pop_event()/pop_events() on the same queue
+	event_type* claim_event(bool steal)
+	{
+		auto_lock<spin_type> scoped_lock(_consumer_lock);
+		if (UNLIKELY(!_claiming)) _claiming = true;
+
+		int32_t pos = _claim_pos;
+		event_header* block = peek_block(pos, cursor_pos(_alloc_cursor),
+				_claim_seq, event_header::COMMITTED);
+		if (block == NULL) {
+			_claim_pos = pos;
+			return NULL;
+		}
+		if (steal && (block->block_size & BLOCK_PINNED)) {
+			return NULL;
+		}
+
+		_claim_pos = pos + block_length(block);
+		++_claim_seq;
+
+		return (event_type*) ((char*) block + sizeof(event_header));
+	}
+
+	void release_event(event_type* ev)
+	{
+		ev->destroy();
+
+		event_header* block = (event_header*) ((char*) ev - sizeof(event_header));
+		block->block_tag = (block->block_tag & ~(uint32_t) TAG_STATE_MASK) |
+				event_header::DONE;
+
+		auto_lock<spin_type> scoped_lock(_consumer_lock);
+
+		int32_t pos = _free_pos;
+		while ((block = peek_block(pos, _claim_pos, _free_seq, event_header::DONE)) != NULL) {
+			pos += block_length(block);
+			++_free_seq;
+			_free_pos = pos;
+		}
+		space_released();
 	}
 
 	void destroy_event(event_type* ev)
 	{
 		ev->destroy();
 		this->free(ev);
+		space_released();
 	}
 
+	// lock-free, can be called by multiple producers concurrently.
+	// a "pinned" event is never stolen by claim_event(true).
+	// if the queue is full, it returns NULL when "wait" is false, otherwise
+	// blocks until the consumer releases some space.
 	template <class EVENT_TYPE>
-	EVENT_TYPE* allocate_event(bool wait = true)
+	EVENT_TYPE* allocate_event(bool wait = true, bool pinned = false)
 	{
-		_lock.enter();
-		void* ptr = allocate(sizeof(EVENT_TYPE));
-		_lock.leave();
-
-		if (UNLIKELY(ptr == NULL)) {
-			if (UNLIKELY(wait == false)) {
-				return NULL;
-			}
-
-			do {
-				_lock.enter();
-				ptr = allocate(sizeof(EVENT_TYPE));
-				_lock.leave();
-				g_thread_sleep(0.001);	// sleep 1ms
-			} while(ptr == NULL);
-		}
+		void* ptr = allocate_block(sizeof(EVENT_TYPE), wait, pinned);
+		return ptr ? construct_event<EVENT_TYPE>(ptr) : NULL;
+	}
 
-		return new (ptr) EVENT_TYPE();
+	// same as allocate_event(), and reserve "payload_bytes" bytes right after
+	// the event in the same block, see event_payload().
+	// variable-length data (log lines, network messages) takes exactly the
+	// space it needs and can be written in place.
+	template <class EVENT_TYPE>
+	EVENT_TYPE* allocate_event_with_payload(int32_t payload_bytes,
+			bool wait = true, bool pinned = false)
+	{
+		assert(payload_bytes >= 0);
+		void* ptr = allocate_block(sizeof(EVENT_TYPE) + payload_bytes, wait, pinned);
+		return ptr ? construct_event<EVENT_TYPE>(ptr) : NULL;
 	}
 
 	// the following code will be broken when using gcc 4.6.3 and compiling with -O3
@@ -111,87 +353,212 @@ public:
 	// in the meanwhile other threads would pop a uninitialized event.
 	//
 	// force no-inline or add a memory barrier could solve it.
+	//
+	// the consumer is woken up if it's parked, so every producer is
+	// noticed right away, no matter how the event is pushed.
 	NOINLINE
 	static void commit_event(event_type* ev)
 	{
+		event_queue* queue = ev->owner_queue;
 		event_queue::event_header* block = (event_queue::event_header*)
 				(((char*) ev) - sizeof(event_queue::event_header));
-		//MEMORY_BARRIER(&block);
-		block->block_state = event_queue::event_header::COMMITTED;
+		MEMORY_BARRIER(&block);
+		block->block_tag = (block->block_tag & ~(uint32_t) TAG_STATE_MASK) |
+				event_queue::event_header::COMMITTED;
+
+		if (LIKELY(queue != NULL)) queue->_wake_target->wake();
 	}
 
 private:
-	void* allocate(int32_t length)
+	template <class EVENT_TYPE>
+	inline EVENT_TYPE* construct_event(void* ptr)
 	{
-		void* ptr = NULL;
+		EVENT_TYPE* ev = new (ptr) EVENT_TYPE();
+		ev->owner_queue = this;
+		return ev;
+	}
+
+	// return the committed event at "pos" with the sequence "seq",
+	// "pos" may be rolled back to the front of the buffer
+	inline event_type* peek_event(int32_t& pos, uint32_t seq)
+	{
+		event_header* block = peek_block(pos, cursor_pos(_alloc_cursor),
+				seq, event_header::COMMITTED);
+		return block ? (event_type*) ((char*) block + sizeof(event_header)) : NULL;
+	}
 
+	// return the block at "pos" if it's in the state "s", "end_pos" is the
+	// position that the consumer can't go beyond
+	inline event_header* peek_block(int32_t& pos, int32_t end_pos,
+			uint32_t seq, event_header::state s)
+	{
+		if (UNLIKELY(pos == end_pos)) return NULL;
+		if (UNLIKELY(_cap - pos <= (int32_t) sizeof(event_header))) {
+			pos = 0;
+		}
+
+		event_header* block = (event_header*) (_buf + pos);
+		uint32_t tag = block->block_tag;
+		if (LIKELY(tag == make_tag(seq, s))) {
+			return block;
+		}
+		else if (UNLIKELY(tag == make_tag(seq, event_header::SKIPPED))) {
+			pos = 0;
+			block = (event_header*) _buf;
+			if (LIKELY(block->block_tag == make_tag(seq, s))) {
+				return block;
+			}
+		}
+
+		return NULL;
+	}
+
+	void* allocate(int32_t length, bool pinned)
+	{
 		// add header size and align memory
 		int32_t new_len = (length + sizeof(event_header) + sizeof(intptr_t) - 1) &
 				(~(sizeof(intptr_t) - 1));
 
-		int32_t new_alloc_pos = _alloc_pos;
-		int32_t local_free_pos = _free_pos;	// _free_pos may be modified by other thread
-
-		//
-		// "_alloc_pos - _free_pos > 0" says:
-		//
-		//   .......###########........
-		//         ^           ^
-		//    _free_pos   _alloc_pos
-		//
-		//   may allocate from the rear or the front of the buffer.
-		//
-		// and then "_free_pos == _alloc_pos" means empty,
-		// _alloc_pos may point to any position of the buffer.
-		//
-
-		bool cond1 = (_alloc_pos - local_free_pos) >= 0;
-		bool cond2 = (_cap - _alloc_pos - new_len) >= 0;
-
-		// there are not enough space to allocate in the rear,
-		// so roll back to the front.
-		bool skip_flag = cond1 & !cond2;
-		if (UNLIKELY(skip_flag)) new_alloc_pos = 0; // TODO: new_alloc_pos &= (unsigned)(-skip_flag)
-
-		//
-		// if (cond1 & cond2) == true, then it can allocate from the rear;
-		// otherwise, it try to allocate from the front.
-		//
-		// "(_free_pos - new_alloc_pos - new_len) > 0" handles many cases:
-		//   1). if new_alloc_pos == _alloc_pos && _alloc_pos >= _free_pos,
-		//       the result of "_free_pos - new_alloc_pos - length" will be negative;
-		//   2). new_alloc_pos just rolled back to the zero position,
-		//       trying to allocate from the front;
-		//   3). if new_alloc_pos == _alloc_pos && _alloc_pos < _free_pos,
-		//       just a normal case of this algorithm.
-		//
-		// "_alloc_pos < _free_pos" means:
-		//
-		//   ###..............#########...
-		//      ^            ^         ^
-		//   _alloc_pos  _free_pos   too small to allocate
-		//
-		// so "allocated" is telling whether allocation is successful or not.
-		//
-
-		bool allocated = (cond1 & cond2) | ((local_free_pos - new_alloc_pos - new_len) > 0);
-
-		if (LIKELY(allocated)) {
-			ptr = (void*)(_buf + new_alloc_pos);
-			event_header* block = (event_header*) ptr;
-			block->block_state = event_header::ALLOCATED;
-			block->block_size = new_len;
-
-			if (UNLIKELY(skip_flag && (_cap - _alloc_pos > (int32_t) sizeof(event_header)))) {
-				block = (event_header*) (_buf + _alloc_pos);
-				block->block_state = event_header::SKIPPED;
+		while (true) {
+			// read the cursor before _free_pos. the CAS below fails if the
+			// cursor has been moved, so the snapshot of _free_pos is always
+			// consistent with the position we are going to allocate from.
+			uint64_t cursor = _alloc_cursor;
+			MEMORY_BARRIER();
+			int32_t alloc_pos = cursor_pos(cursor);
+			uint32_t seq = cursor_seq(cursor);
+			int32_t local_free_pos = _free_pos;	// _free_pos may be modified by other thread
+			int32_t new_alloc_pos = alloc_pos;
+
+			//
+			// "alloc_pos - _free_pos > 0" says:
+			//
+			//   .......###########........
+			//         ^           ^
+			//    _free_pos    alloc_pos
+			//
+			//   may allocate from the rear or the front of the buffer.
+			//
+			// and then "_free_pos == alloc_pos" means empty,
+			// alloc_pos may point to any position of the buffer.
+			//
+
+			bool cond1 = (alloc_pos - local_free_pos) >= 0;
+			bool cond2 = (_cap - alloc_pos - new_len) >= 0;
+
+			// there are not enough space to allocate in the rear,
+			// so roll back to the front.
+			bool skip_flag = cond1 & !cond2;
+			if (UNLIKELY(skip_flag)) new_alloc_pos = 0;
+
+			//
+			// if (cond1 & cond2) == true, then it can allocate from the rear;
+			// otherwise, it try to allocate from the front.
+			//
+			// "(_free_pos - new_alloc_pos - new_len) > 0" handles many cases:
+			//   1). if new_alloc_pos == alloc_pos && alloc_pos >= _free_pos,
+			//       the result of "_free_pos - new_alloc_pos - length" will be negative;
+			//   2). new_alloc_pos just rolled back to the zero position,
+			//       trying to allocate from the front;
+			//   3). if new_alloc_pos == alloc_pos && alloc_pos < _free_pos,
+			//       just a normal case of this algorithm.
+			//
+			// "alloc_pos < _free_pos" means:
+			//
+			//   ###..............#########...
+			//      ^            ^         ^
+			//   alloc_pos   _free_pos   too small to allocate
+			//
+			// so "allocated" is telling whether allocation is successful or not.
+			//
+
+			bool allocated = (cond1 & cond2) | ((local_free_pos - new_alloc_pos - new_len) > 0);
+
+			if (UNLIKELY(!allocated)) return NULL;
+
+			if (UNLIKELY(!__sync_bool_compare_and_swap(&_alloc_cursor,
+					cursor, make_cursor(seq + 1, new_alloc_pos + new_len)))) {
+				g_thread_pause();	// lost the race, try again
+				continue;
 			}
 
-			_alloc_pos = new_alloc_pos + new_len;
+			// the block is owned by this thread now
+			event_header* block = (event_header*) (_buf + new_alloc_pos);
+			block->block_size = new_len | (pinned ? (int32_t) BLOCK_PINNED : 0);
+			MEMORY_BARRIER(&block);
+			block->block_tag = make_tag(seq, event_header::ALLOCATED);
+
+			if (UNLIKELY(skip_flag && (_cap - alloc_pos > (int32_t) sizeof(event_header)))) {
+				block = (event_header*) (_buf + alloc_pos);
+				block->block_tag = make_tag(seq, event_header::SKIPPED);
+			}
+
+			return _buf + new_alloc_pos + sizeof(event_header);
+		}
+	}
+
+	void* allocate_block(int32_t length, bool wait, bool pinned)
+	{
+		void* ptr = allocate(length, pinned);
+
+		if (UNLIKELY(ptr == NULL)) {
+			check_high_watermark(true);
+			if (UNLIKELY(wait == false)) {
+				return NULL;
+			}
+			ptr = wait_for_space(length, pinned);
+		}
+		else if (UNLIKELY(_high_watermark > 0)) {
+			check_high_watermark(false);
+		}
+
+		return ptr;
+	}
+
+	// called by producers, a full queue is always above the high watermark
+	void check_high_watermark(bool full)
+	{
+		if (_high_watermark > 0 && !_congested && (full || used_bytes() >= _high_watermark) &&
+				__sync_bool_compare_and_swap(&_congested, 0, 1)) {
+			if (_listener) _listener->on_high_watermark(this);
+		}
+	}
+
+	// called by the consumer after moving _free_pos
+	inline void space_released()
+	{
+		if (UNLIKELY(_congested) && used_bytes() <= _low_watermark &&
+				__sync_bool_compare_and_swap(&_congested, 1, 0)) {
+			if (_listener) _listener->on_low_watermark(this);
+		}
+
+		// the new _free_pos is stored before _space_waiters is loaded, and
+		// the waiter increases _space_waiters before retrying. so either the
+		// waiter sees the space, or the consumer sees the waiter.
+		// it's paid once per release, i.e. once per batch of destroy_events().
+		__sync_synchronize();
+		if (UNLIKELY(_space_waiters > 0)) {
+			auto_lock<mutex_type> scoped_lock(_space_mutex);
+			_space_cond.broadcast();
+		}
+	}
+
+	// block the producer on a condition until the consumer frees some space.
+	// the waiter is registered with a full barrier under the mutex before
+	// retrying, so a consumer that frees space after the retry sees it and
+	// broadcasts under the same mutex, see space_released().
+	NOINLINE
+	void* wait_for_space(int32_t length, bool pinned)
+	{
+		auto_lock<mutex_type> scoped_lock(_space_mutex);
+		__sync_fetch_and_add(&_space_waiters, 1);
 
-			return (char*) ptr + sizeof(event_header);
+		void* ptr;
+		while ((ptr = allocate(length, pinned)) == NULL) {
+			_space_cond.wait(&_space_mutex, -1);
 		}
 
+		__sync_fetch_and_sub(&_space_waiters, 1);
 		return ptr;
 	}
 
@@ -199,15 +566,39 @@ private:
 	{
 		//assert(((char*) ptr - sizeof(event_header)) - _buf == _free_pos);
 		event_header* block = (event_header*) ((char*) ptr - sizeof(event_header));
-		_free_pos += block->block_size;
+		_free_pos += block_length(block);
+		++_free_seq;
 	}
 
 private:
 	char* _buf;
-	spin_type _lock;
 	int32_t _cap;
-	volatile int32_t _alloc_pos;
+	uint32_t _buf_pages;	// > 0 if _buf is allocated by g_numa_alloc_pages()
+	bool _buf_arena;		// true if _buf is allocated by g_shm_alloc_pages()
+
+	// keep the producers' cursor and the consumer's cursor
+	// in different cache lines to avoid false sharing
+	char _pad1[64];
+	volatile uint64_t _alloc_cursor;
+	char _pad2[64];
 	volatile int32_t _free_pos;
+	volatile uint32_t _free_seq;
+	int32_t _claim_pos;
+	uint32_t _claim_seq;
+	volatile bool _claiming;	// set by the first claim_event()
+	spin_type _consumer_lock;
+	volatile long _parked;
+	sema_type _waker;
+	event_queue* _wake_target;	// this queue, or the queue the consumer parks on
+
+	// flow control
+	int32_t _high_watermark;
+	int32_t _low_watermark;
+	watermark_listener* _listener;
+	volatile long _congested;
+	volatile long _space_waiters;
+	mutex_type _space_mutex;
+	cond_type _space_cond;
 };
 
 } // namespace sax
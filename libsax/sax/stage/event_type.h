@@ -13,6 +13,8 @@
 
 namespace sax {
 
+class event_queue;
+
 struct event_type {
 public:
 	enum
@@ -23,9 +25,15 @@ public:
 	inline int32_t get_type() const {return type_id;}
 	virtual void destroy() = 0;
 	virtual ~event_type() {}
+
+	// set by stage::push_event() for the stage telemetry, in usec
+	int64_t enqueue_us;
 protected:
-	inline event_type(int32_t id=-1) : type_id(id) {}
+	friend class event_queue;
+	inline event_type(int32_t id=-1) : enqueue_us(0), type_id(id), owner_queue(NULL) {}
 	int32_t type_id;
+	// the queue the event is allocated from, commit_event() wakes its consumer
+	event_queue* owner_queue;
 };
 
 template <int32_t TID, typename REAL_TYPE>
@@ -60,6 +68,20 @@ protected:
 	inline user_event_base() : event_type(TID) {}
 };
 
+/// the trailing byte area reserved by allocate_event_with_payload(),
+/// it follows the event in the same block of the queue
+template <typename EVENT_TYPE>
+inline char* event_payload(EVENT_TYPE* ev)
+{
+	return (char*) ev + sizeof(EVENT_TYPE);
+}
+
+template <typename EVENT_TYPE>
+inline const char* event_payload(const EVENT_TYPE* ev)
+{
+	return (const char*) ev + sizeof(EVENT_TYPE);
+}
+
 } // namespace
 
 #endif /* EVENT_TYPE_H_ */
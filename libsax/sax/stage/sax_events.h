@@ -34,6 +34,48 @@ struct add_timer_event : public sax_event_base<__LINE__, add_timer_event>
 	uint32_t	delay_ms;
 };
 
+/**
+ * brief: add a batch of timers to stimer stage, in one event
+ * sender: any stage
+ * recver: stimer stage
+ * parameters:
+ *   biz_stage: for sending timer_timeout_event, shared by all timers
+ *   count: number of timers
+ *   timers(): the timers, stored in the payload of the event, allocated by
+ *             allocate_event_with_payload<add_timers_event>(add_timers_event::bytes(count))
+ */
+struct add_timers_event : public sax_event_base<__LINE__, add_timers_event>
+{
+	struct timer
+	{
+		uint64_t	trans_id;
+		void*		invoke_param;
+		uint32_t	delay_ms;
+	};
+
+	stage*		biz_stage;
+	int32_t		count;
+
+	static inline int32_t bytes(int32_t count) { return count * (int32_t) sizeof(timer); }
+	inline timer* timers() { return (timer*) event_payload(this); }
+	inline const timer* timers() const { return (const timer*) event_payload(this); }
+};
+
+/**
+ * brief: cancel a pending timer of stimer stage
+ * sender: any stage
+ * recver: stimer stage
+ * parameters:
+ *   trans_id: add_timer_event::trans_id of the timer. if several pending
+ *             timers share it, the latest added one is cancelled.
+ *             nothing happens if the timer has fired, its timer_timeout_event
+ *             may still be on the way.
+ */
+struct cancel_timer_event : public sax_event_base<__LINE__, cancel_timer_event>
+{
+	uint64_t	trans_id;
+};
+
 /**
  * brief: a timer timeout
  * sender: stimer stage
@@ -48,23 +90,22 @@ struct timer_timeout_event : public sax_event_base<__LINE__, timer_timeout_event
 	void*		invoke_param;
 };
 
-template <size_t BODY_SIZE>
-struct log_event;
-
-#define DECL_LOG_EVENT(size)	\
-	template <>	struct log_event<size> : public sax_event_base<__LINE__, log_event<size> > \
-	{ char body[size]; }; \
-	typedef log_event<size> log_event##size
-
-DECL_LOG_EVENT(128);		// sax::log_event128
-DECL_LOG_EVENT(256);		// sax::log_event256
-DECL_LOG_EVENT(512);		// sax::log_event512
-DECL_LOG_EVENT(1024);		// sax::log_event1024
-DECL_LOG_EVENT(2048);		// sax::log_event2048
-DECL_LOG_EVENT(4096);		// sax::log_event4096
-DECL_LOG_EVENT(8192);		// sax::log_event8192
+/**
+ * brief: a log line
+ * sender: any stage
+ * recver: log stage
+ * parameters:
+ *   length: bytes of the line, no terminating '\0'
+ *   body(): the line, stored in the payload of the event,
+ *           allocated by allocate_event_with_payload<log_event>(length)
+ */
+struct log_event : public sax_event_base<__LINE__, log_event>
+{
+	int32_t		length;
 
-#undef DECL_LOG_EVENT
+	inline char* body() { return event_payload(this); }
+	inline const char* body() const { return event_payload(this); }
+};
 
 STATIC_ASSERT(__LINE__ < event_type::USER_TYPE_START,
 		sax_event_type_id_must_smaller_than__event_type__USER_TYPE_START);
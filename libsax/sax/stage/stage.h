@@ -6,9 +6,11 @@
 #include "event_type.h"
 #include "dispatcher.h"
 #include "event_queue.h"
+#include "stage_stats.h"
 #include "stage_mgr.h"
 #include "sax/c++/fifo.h"
 #include "sax/slabutil.h"
+#include "sax/timer.h"
 
 namespace sax {
 
@@ -16,10 +18,167 @@ struct handler_base {
 	virtual bool init(void* param) = 0;
 	virtual void on_start(int32_t thread_id) {}
 	virtual void on_event(const sax::event_type *ev) = 0;
+	// used by the stages in batch mode (stage_options::batch_size > 1),
+	// override it to handle the whole batch at once
+	virtual void on_events(sax::event_type* const* evs, int32_t count)
+	{
+		for (int32_t i = 0; i < count; i++) on_event(evs[i]);
+	}
 	virtual void on_finish(int32_t thread_id) {}
 	virtual ~handler_base() {}
 };
 
+/// how an idle stage thread waits for new events: pause for "spin_rounds"
+/// rounds, then yield the cpu for "yield_rounds" rounds, and then park on
+/// the event queue until a producer wakes it up (or "park_timeout" seconds
+/// passed). a stage that never parks keeps yielding.
+struct wait_policy
+{
+	uint32_t spin_rounds;
+	uint32_t yield_rounds;
+	bool park;
+	double park_timeout;
+
+	wait_policy(uint32_t spin = 64, uint32_t yield = 16,
+			bool park = true, double park_timeout = 0.1) :
+		spin_rounds(spin), yield_rounds(yield), park(park), park_timeout(park_timeout) {}
+
+	static wait_policy busy_spin() { return wait_policy(~0u, 0, false); }
+	static wait_policy yield() { return wait_policy(0, ~0u, false); }
+};
+
+/// an elastic stage starts with the "threads" workers passed to create_stage(),
+/// and adds or retires workers within [min_threads, max_threads] at runtime.
+/// every "interval" seconds it adds a worker if the queues hold "grow_depth"
+/// events per worker on average, and retires one if the queues are empty and
+/// the workers were idle more than "shrink_idle_ratio" of the time for
+/// "shrink_rounds" samples in a row. max_threads == 0 disables it.
+struct elastic_policy
+{
+	uint32_t min_threads;
+	uint32_t max_threads;
+	uint32_t grow_depth;
+	double shrink_idle_ratio;
+	uint32_t shrink_rounds;
+	double interval;
+
+	elastic_policy(uint32_t min = 1, uint32_t max = 0) :
+		min_threads(min), max_threads(max), grow_depth(64),
+		shrink_idle_ratio(0.8), shrink_rounds(10), interval(0.1) {}
+
+	bool enabled() const { return max_threads > 0; }
+};
+
+/// where the threads of a stage run. "cpus" lists the allowed cpus: with
+/// "isolate" the thread i is bound to cpus[i % cpu_num] alone, otherwise
+/// all threads share the whole list. if "cpus" is empty and "numa_node" >= 0,
+/// the threads use the cpus of that node. the ring buffer of each queue is
+/// allocated on the NUMA node of its consumer thread.
+struct stage_placement
+{
+	enum {MAX_CPUS = 256};
+
+	int32_t cpus[MAX_CPUS];
+	int32_t cpu_num;
+	bool isolate;
+	int32_t numa_node;
+
+	stage_placement() : cpu_num(0), isolate(false), numa_node(-1) {}
+
+	// a cpu list like "0-3,8", returns false if it's malformed
+	bool set_cpus(const char* list)
+	{
+		int32_t n = g_parse_cpu_list(list, cpus, MAX_CPUS);
+		if (n < 0) return false;
+		cpu_num = n;
+		return true;
+	}
+
+	// the cpus that the thread "thread_id" may run on, 0 means any cpu
+	int32_t thread_cpus(int32_t thread_id, int32_t* out, int32_t max) const
+	{
+		int32_t n = 0;
+		if (cpu_num > 0) {
+			for (n = 0; n < cpu_num && n < max; n++) out[n] = cpus[n];
+		}
+		else if (numa_node >= 0) {
+			n = g_numa_node_cpus(numa_node, out, max);
+			if (n < 0) n = 0;
+		}
+
+		if (isolate && n > 1) {
+			out[0] = out[thread_id % n];
+			n = 1;
+		}
+		return n;
+	}
+
+	// the NUMA node of the thread "thread_id", -1 if its cpus span nodes
+	int32_t thread_node(int32_t thread_id) const
+	{
+		if (numa_node >= 0) return numa_node;
+
+		int32_t list[MAX_CPUS];
+		int32_t n = thread_cpus(thread_id, list, MAX_CPUS);
+		if (n == 0 || g_numa_node_count() <= 1) return -1;
+
+		int32_t node = g_numa_node_of_cpu(list[0]);
+		for (int32_t i = 1; i < n; i++) {
+			if (g_numa_node_of_cpu(list[i]) != node) return -1;
+		}
+		return node;
+	}
+};
+
+/// the lane of an event, see stage_options::high_lane_bytes
+enum event_priority {PRIORITY_NORMAL, PRIORITY_HIGH};
+
+/// optional settings for stage_creator::create_stage()
+struct stage_options
+{
+	enum {MAX_BATCH_SIZE = 256};
+
+	wait_policy wait;
+
+	// > 1 means the threads pop at most batch_size events at a time
+	// and pass them to handler_base::on_events()
+	uint32_t batch_size;
+
+	// idle threads take committed events from the queues of their siblings,
+	// except the events allocated with a non-zero shard_key (they keep the per-key
+	// ordering). batch_size is ignored in this mode, and an idle thread
+	// parks no longer than 1 millisecond so it keeps looking for work.
+	bool work_stealing;
+
+	// record the queue depth, queueing delay and handler time,
+	// see stage_mgr::snapshot()
+	bool telemetry;
+
+	// resize the thread pool at runtime, see stage::resize().
+	// it's ignored with work_stealing, and turns the telemetry on
+	// for measuring the idle ratio.
+	elastic_policy elastic;
+
+	stage_placement placement;
+
+	// > 0 gives each thread a high priority lane, a second queue of
+	// high_lane_bytes for the events allocated with PRIORITY_HIGH (timeouts,
+	// control events). a thread takes at most high_lane_weight high events
+	// in a row before it takes from the normal lane, so neither lane starves.
+	// it's ignored with work_stealing, PRIORITY_HIGH events go to the
+	// normal lane then.
+	uint32_t high_lane_bytes;
+	uint32_t high_lane_weight;
+
+	// the handlers arm timers on their thread, see thread_obj::local_timer().
+	// not allowed with an elastic stage: a retired worker would take its
+	// pending timers away, so create_stage() fails.
+	bool local_timers;
+
+	stage_options() : batch_size(1), work_stealing(false), telemetry(true),
+		high_lane_bytes(0), high_lane_weight(8), local_timers(false) {}
+};
+
 template <class HANDLER, class THREADOBJ, class STAGE>
 class stage_creator;
 
@@ -30,26 +189,45 @@ public:
 	{
 		_handler->on_start(_thread_id);
 
-		uint32_t idle_count = 0;
-		while (1) {
-			event_type* ev = _ev_queue->pop_event();
-			if (ev) {
-				_handler->on_event(ev);
-				_ev_queue->destroy_event(ev);
-			}
-			else {
-				if (_stop) break;
-				if (++idle_count >= 10) {
-					g_thread_sleep(0.001);
-					idle_count = 0;
-				}
-			}
+		if (_options.work_stealing) {
+			run_stealing();
+		}
+		else {
+			run_lanes();
 		}
 
 		_handler->on_finish(_thread_id);
 	}
 
-	void signal_stop() { _stop = true; }
+	// the counters are updated by the thread itself, just a racy snapshot
+	const thread_stats& stats() const { return _stats; }
+
+	// the thread_obj running the calling thread, NULL out of the stage threads
+	static inline thread_obj* current() { return current_slot(); }
+
+	// a timer wheel of this thread, in milliseconds, created at the first call.
+	// handlers arm it by g_timer_start() directly, and the run loop polls it
+	// between the events, so the timer procs run in this thread with no
+	// event traffic. the pending timers are dropped with the thread_obj,
+	// without calling any free function.
+	// returns NULL unless stage_options::local_timers is set.
+	// NOTICE: only this thread is allowed to use it, e.g. in on_event():
+	//   g_timer_start(thread_obj::current()->local_timer(), 100, proc, data);
+	g_timer_t* local_timer()
+	{
+		if (UNLIKELY(!_options.local_timers)) return NULL;
+		if (_local_timer == NULL) {
+			_local_timer = g_timer_create();
+			_local_timer_ms = g_now_ms();
+		}
+		return _local_timer;
+	}
+
+	void signal_stop()
+	{
+		_stop = true;
+		_ev_queue->interrupt();	// the high lane wakes up this queue too
+	}
 
 	void join_thread()
 	{
@@ -87,12 +265,242 @@ public:
 		while ((ev = _ev_queue->pop_event()) != NULL) {
 			_ev_queue->destroy_event(ev);
 		}
+		while (_high_queue && (ev = _high_queue->pop_event()) != NULL) {
+			_high_queue->destroy_event(ev);
+		}
+
+		if (_local_timer) g_timer_destroy(_local_timer, NULL);
 	}
 
 protected:
 	thread_obj(int32_t thread_id, handler_base* handler, event_queue* ev_queue) :
 		_ev_queue(ev_queue), _handler(handler), _thread(NULL),
-		_thread_id(thread_id), _stop(false), _create_status(CREATING) {}
+		_thread_id(thread_id), _stop(false),
+		_siblings(NULL), _sibling_num(0), _high_queue(NULL), _high_run(0),
+		_local_timer(NULL), _local_timer_ms(0),
+		_fence_state(FENCE_NONE), _fence_seq(0), _fence_high_seq(0), _fence_ack(0),
+		_create_status(CREATING) {}
+
+	// an elastic stage is moving shard keys between the queues, see
+	// stage::resize(). returns how many events of the lane "queue"
+	// can be consumed now, at most "max".
+	int32_t fence_limit(event_queue* queue, int32_t max)
+	{
+		if (_fence_state == FENCE_HOLD) {
+			_fence_ack = 1;
+			return 0;
+		}
+
+		MEMORY_BARRIER();	// the sequences are set before FENCE_LIMIT
+		uint32_t seq = queue == _ev_queue ? _fence_seq : _fence_high_seq;
+		uint32_t left = seq - queue->consumed();
+		return left < (uint32_t) max ? (int32_t) left : max;
+	}
+
+	inline int32_t pop_lane(event_queue* queue, event_type** evs, int32_t max)
+	{
+		if (UNLIKELY(_fence_state != FENCE_NONE)) {
+			max = fence_limit(queue, max);
+			if (max == 0) return 0;
+		}
+
+		if (max == 1) {
+			evs[0] = queue->pop_event();
+			return evs[0] ? 1 : 0;
+		}
+		return queue->pop_events(evs, max);
+	}
+
+	// pop at most "max" events of one lane, "queue" is set to the lane.
+	// the high lane goes first, unless high_lane_weight events in a row
+	// have been taken from it.
+	int32_t pop_lanes(event_type** evs, int32_t max, event_queue*& queue)
+	{
+		int32_t n;
+		if (_high_queue && _high_run < _options.high_lane_weight) {
+			n = pop_lane(_high_queue, evs, max);
+			if (n > 0) {
+				_high_run += n;
+				queue = _high_queue;
+				return n;
+			}
+		}
+
+		_high_run = 0;
+		queue = _ev_queue;
+		n = pop_lane(_ev_queue, evs, max);
+		if (n > 0 || _high_queue == NULL) return n;
+
+		queue = _high_queue;
+		n = pop_lane(_high_queue, evs, max);
+		_high_run = n;
+		return n;
+	}
+
+	inline void handle_event(event_queue* queue, event_type* ev)
+	{
+		if (!_options.telemetry) {
+			_handler->on_event(ev);
+			return;
+		}
+
+		int64_t start = g_now_us();
+		_stats.update_depth(queue->size());
+		_stats.queue_delay.record(start - ev->enqueue_us);
+
+		_handler->on_event(ev);
+
+		_stats.handle_time.record(g_now_us() - start);
+		++_stats.events;
+	}
+
+	// the handler time of a batch is recorded as the average per event
+	inline void handle_events(event_queue* queue, event_type** evs, int32_t n)
+	{
+		if (!_options.telemetry) {
+			_handler->on_events(evs, n);
+			return;
+		}
+
+		int64_t start = g_now_us();
+		_stats.update_depth(queue->size());
+		for (int32_t i = 0; i < n; i++) {
+			_stats.queue_delay.record(start - evs[i]->enqueue_us);
+		}
+
+		_handler->on_events(evs, n);
+
+		int64_t avg = (g_now_us() - start) / n;
+		for (int32_t i = 0; i < n; i++) {
+			_stats.handle_time.record(avg);
+		}
+		_stats.events += n;
+	}
+
+	// one event at a time, or batches of batch_size events
+	void run_lanes()
+	{
+		event_type* evs[stage_options::MAX_BATCH_SIZE];
+		int32_t max = (int32_t) (_options.batch_size < stage_options::MAX_BATCH_SIZE ?
+				_options.batch_size : stage_options::MAX_BATCH_SIZE);
+		if (max < 1) max = 1;
+
+		uint32_t idle_count = 0;
+		while (1) {
+			poll_local_timer();
+
+			event_queue* queue;
+			int32_t n = pop_lanes(evs, max, queue);
+			if (n > 0) {
+				if (max == 1) {
+					handle_event(queue, evs[0]);
+					queue->destroy_event(evs[0]);
+				}
+				else {
+					handle_events(queue, evs, n);
+					queue->destroy_events(evs, n);
+				}
+				idle_count = 0;
+			}
+			else if (UNLIKELY(_fence_state != FENCE_NONE)) {
+				// held by an elastic stage, it will be released soon
+				if (_stop) break;
+				g_thread_sleep(0.0002);
+			}
+			else {
+				if (_stop) break;
+				idle_wait(++idle_count);
+			}
+		}
+	}
+
+	void run_stealing()
+	{
+		uint32_t idle_count = 0;
+		while (1) {
+			poll_local_timer();
+
+			event_queue* queue = _ev_queue;
+			event_type* ev = queue->claim_event(false);
+			if (ev == NULL) ev = steal_event(queue);
+
+			if (ev) {
+				handle_event(queue, ev);
+				queue->release_event(ev);
+				idle_count = 0;
+			}
+			else {
+				if (_stop) break;
+				idle_wait(++idle_count);
+			}
+		}
+	}
+
+	// try the siblings one by one, "queue" is set to the victim's queue
+	event_type* steal_event(event_queue*& queue)
+	{
+		for (uint32_t i = 1; i < _sibling_num; i++) {
+			event_queue* victim = _siblings[(_thread_id + i) % _sibling_num];
+			event_type* ev = victim->claim_event(true);
+			if (ev) {
+				queue = victim;
+				return ev;
+			}
+		}
+		return NULL;
+	}
+
+	void apply_placement()
+	{
+		int32_t cpus[stage_placement::MAX_CPUS];
+		int32_t n = _options.placement.thread_cpus(_thread_id, cpus,
+				stage_placement::MAX_CPUS);
+		if (n > 0 && !g_thread_bind_cpus(cpus, n)) {
+			fprintf(stderr, "%s:%d bind thread %d to %d cpus failed.\n",
+					__FILE__, __LINE__, _thread_id, n);
+		}
+	}
+
+	// called when the queue is empty, "idle_rounds" counts from 1
+	inline void idle_wait(uint32_t idle_rounds)
+	{
+		const wait_policy& wait = _options.wait;
+		if (idle_rounds <= wait.spin_rounds) {
+			g_thread_pause();
+		}
+		else if (!wait.park || idle_rounds - wait.spin_rounds <= wait.yield_rounds) {
+			g_thread_yield();
+		}
+		else {
+			double sec = _options.work_stealing && wait.park_timeout > 0.001 ?
+					0.001 : wait.park_timeout;
+
+			// wake up for the next local timer
+			if (_local_timer && g_timer_count(_local_timer) > 0) {
+				uint32_t ms = g_timer_next_expire(_local_timer);
+				if (ms * 0.001 < sec) sec = ms * 0.001;
+			}
+
+			_ev_queue->park(sec, _high_queue);
+		}
+	}
+
+	inline void poll_local_timer()
+	{
+		if (LIKELY(_local_timer == NULL)) return;
+
+		uint64_t now_ms = g_now_ms();
+		if (now_ms > _local_timer_ms) {
+			g_timer_poll(_local_timer, (uint32_t) (now_ms - _local_timer_ms));
+			_local_timer_ms = now_ms;
+		}
+	}
+
+	static inline thread_obj*& current_slot()
+	{
+		static thread_local thread_obj* obj = NULL;
+		return obj;
+	}
 
 	static void* _thread_proc(void* param)
 	{
@@ -106,6 +514,8 @@ protected:
 		delete[] (void**) param;
 
 		if (obj->wait_for_stage_creator()) {
+			current_slot() = obj;
+			obj->apply_placement();
 			obj->run();
 		}
 
@@ -118,10 +528,28 @@ protected:
 	g_thread_t _thread;
 	int32_t _thread_id;
 	volatile bool _stop;
+	stage_options _options;
+	thread_stats _stats;
+	event_queue** _siblings;	// queues of the stage, for work-stealing
+	uint32_t _sibling_num;
+	event_queue* _high_queue;	// the high priority lane, may be NULL
+	uint32_t _high_run;			// high events taken in a row
+	g_timer_t* _local_timer;	// see local_timer()
+	uint64_t _local_timer_ms;
+
+	// FENCE_HOLD: don't consume, and set _fence_ack;
+	// FENCE_LIMIT: consume until event_queue::consumed() reaches _fence_seq,
+	// and _fence_high_seq for the high lane
+	enum fence_state {FENCE_NONE, FENCE_HOLD, FENCE_LIMIT};
+	volatile int32_t _fence_state;
+	volatile uint32_t _fence_seq;
+	volatile uint32_t _fence_high_seq;
+	volatile int32_t _fence_ack;
 
 private:
 	template <class HANDLER, class THREADOBJ, class STAGE>
 	friend class stage_creator;
+	friend class stage;
 
 	bool wait_for_stage_creator()
 	{
@@ -142,23 +570,74 @@ public:
 	template <class HANDLER, class THREADOBJ, class STAGE>
 	friend class stage_creator;
 
+	// PRIORITY_HIGH events go to the high priority lane of the thread,
+	// if the stage has one (see stage_options::high_lane_bytes)
 	template <class EVENT_TYPE>
-	inline EVENT_TYPE* allocate_event(uint64_t shard_key = 0, bool wait = true)
+	inline EVENT_TYPE* allocate_event(uint64_t shard_key = 0, bool wait = true,
+			event_priority priority = PRIORITY_NORMAL)
 	{
-		return _queues[_dispatcher->dispatch(EVENT_TYPE::ID, shard_key)]->
-				template allocate_event<EVENT_TYPE>(wait);
+		event_queue** lanes = lane(priority);
+		if (UNLIKELY(_new_worker != NULL)) {
+			return allocate_elastic<EVENT_TYPE>(lanes, 0, shard_key, wait);
+		}
+
+		// sharded events are pinned to their queue for keeping the ordering
+		return lanes[_dispatcher->dispatch(EVENT_TYPE::ID, shard_key)]->
+				template allocate_event<EVENT_TYPE>(wait, shard_key != 0);
+	}
+
+	template <class EVENT_TYPE>
+	inline EVENT_TYPE* allocate_event_with_payload(int32_t payload_bytes,
+			uint64_t shard_key = 0, bool wait = true,
+			event_priority priority = PRIORITY_NORMAL)
+	{
+		event_queue** lanes = lane(priority);
+		if (UNLIKELY(_new_worker != NULL)) {
+			return allocate_elastic<EVENT_TYPE>(lanes, payload_bytes, shard_key, wait);
+		}
+
+		return lanes[_dispatcher->dispatch(EVENT_TYPE::ID, shard_key)]->
+				template allocate_event_with_payload<EVENT_TYPE>(
+						payload_bytes, wait, shard_key != 0);
 	}
 
 	void push_event(event_type* ev)
 	{
+		if (_options.telemetry) ev->enqueue_us = g_now_us();
+
+		// wakes up the consumer if it's parked
 		event_queue::commit_event(ev);
 	}
 
+	// set the watermarks of every queue of the stage, in bytes of each queue.
+	// NOTICE: call it before any producer starts
+	void set_watermarks(int32_t high, int32_t low, watermark_listener* listener = NULL)
+	{
+		for (uint32_t i=0; i<_thread_num; i++) {
+			_queues[i]->set_watermarks(high, low, listener);
+		}
+	}
+
+	// true if any queue is above its high watermark, producers that
+	// can't block (e.g. network stages) should stop reading for a while
+	bool congested() const
+	{
+		for (uint32_t i=0; i<_thread_num; i++) {
+			if (_queues[i]->congested()) return true;
+		}
+		return false;
+	}
+
 	stage() :
-		_handlers(NULL), _threads(NULL), _queues(NULL), _dispatcher(NULL),
-		_thread_num(0), _stopped(true), _next(NULL), _prev(NULL) {}
+		_handlers(NULL), _threads(NULL), _queues(NULL), _high_queues(NULL), _dispatcher(NULL),
+		_thread_num(0), _active_num(0), _stopped(true),
+		_last_snapshot_us(0), _last_snapshot_events(0),
+		_new_worker(NULL), _controller(NULL), _controller_stop(false),
+		_rerouting(false), _routing(0), _next(NULL), _prev(NULL) {}
 	
 	inline ~stage() {
+		stop_controller();
+
 		if (_threads) {
 			assert(_stopped);
 			for (uint32_t i=0; i<_thread_num; i++) {
@@ -184,13 +663,94 @@ public:
 			delete[] _queues;
 		}
 
+		if (_high_queues) {
+			for (uint32_t i=0; i<_thread_num; i++) {
+				event_queue* p = _high_queues[i];
+				if (p) delete p;
+			}
+			delete[] _high_queues;
+		}
+
 		if (_dispatcher) delete _dispatcher;
 	}
 
 	void start() { _stopped = false; }
 
+	const char* name() const { return _name; }
+
+	// number of running workers, it only changes in elastic stages
+	uint32_t active_threads() const { return _active_num; }
+
+	// NOTICE: not thread-safe, it's called by stage_mgr::snapshot() under its lock
+	void snapshot(stage_snapshot& out)
+	{
+		memset(out.name, 0, sizeof(out.name));
+		g_strlcpy(out.name, _name, sizeof(out.name));
+		out.threads = _active_num;
+		out.depth = 0;
+
+		thread_stats total;
+		{
+			auto_lock<spin_type> scoped_lock(_resize_lock);
+			total = _retired_stats;
+			for (uint32_t i=0; i<_thread_num; i++) {
+				out.depth += _queues[i]->size();
+				if (_high_queues) out.depth += _high_queues[i]->size();
+				if (_threads[i]) total.merge(_threads[i]->stats());
+			}
+		}
+
+		out.depth_high_water = total.depth_high_water;
+		out.events = total.events;
+		out.queue_delay = total.queue_delay;
+		out.handle_time = total.handle_time;
+
+		int64_t now = g_now_us();
+		out.events_per_sec = 0.0;
+		if (_last_snapshot_us != 0 && now > _last_snapshot_us) {
+			out.events_per_sec = (out.events - _last_snapshot_events) * 1000000.0 /
+					(now - _last_snapshot_us);
+		}
+		_last_snapshot_us = now;
+		_last_snapshot_events = out.events;
+	}
+
+	// change the number of workers of an elastic stage to "n", within
+	// [1, elastic_policy::max_threads]. the shard keys moved to another queue
+	// keep their ordering: the workers pass a fence, so every event dispatched
+	// before the change is handled before any event dispatched after it.
+	// it's called by the controller thread of the stage, or by the user when
+	// the controller is not wanted (e.g. elastic_policy::interval is 0).
+	// NOTICE: not reentrant. the producers are held for a moment, so the
+	// handlers of the stage must not allocate events from the stage itself.
+	bool resize(uint32_t n)
+	{
+		if (_new_worker == NULL || n == 0 || n > _thread_num) return false;
+
+		uint32_t old = _active_num;
+		if (n == old) return true;
+
+		for (uint32_t i=old; i<n; i++) {
+			if (!start_worker(i)) {
+				n = i;
+				if (n == old) return false;
+				break;
+			}
+		}
+
+		pass_fence(old > n ? old : n, n);
+
+		for (uint32_t i=n; i<old; i++) {
+			retire_worker(i);
+		}
+
+		return true;
+	}
+
 	void signal_stop()
 	{
+		stop_controller();
+
 		if (_threads) {
 			for (uint32_t i=0; i<_thread_num; i++) {
 				thread_obj *p = _threads[i];
@@ -211,13 +771,225 @@ public:
 	}
 
 protected:
+	inline event_queue** lane(event_priority priority) const
+	{
+		return priority == PRIORITY_HIGH && _high_queues ? _high_queues : _queues;
+	}
+
+	// dispatch and allocate in one "routing" section, so resize() knows
+	// when no producer still uses the old number of queues
+	template <class EVENT_TYPE>
+	EVENT_TYPE* allocate_elastic(event_queue** lanes, int32_t payload_bytes,
+			uint64_t shard_key, bool wait)
+	{
+		while (1) {
+			__sync_fetch_and_add(&_routing, 1);
+			if (LIKELY(!_rerouting)) break;
+
+			__sync_fetch_and_sub(&_routing, 1);
+			while (_rerouting) g_thread_yield();
+		}
+
+		EVENT_TYPE* ev = lanes[_dispatcher->dispatch(EVENT_TYPE::ID, shard_key)]->
+				template allocate_event_with_payload<EVENT_TYPE>(
+						payload_bytes, wait, shard_key != 0);
+		__sync_fetch_and_sub(&_routing, 1);
+		return ev;
+	}
+
+	typedef thread_obj* (*new_worker_func)(const char* name,
+			int32_t thread_id, handler_base* handler, event_queue* ev_queue);
+
+	bool start_worker(uint32_t i)
+	{
+		thread_obj* t = _new_worker(_name, i, _handlers[i], _queues[i]);
+		if (t == NULL) return false;
+
+		t->_options = _options;
+		t->_siblings = _queues;
+		t->_sibling_num = _thread_num;
+		t->_high_queue = _high_queues ? _high_queues[i] : NULL;
+		t->_fence_state = thread_obj::FENCE_HOLD;	// until the next fence is passed
+
+		{
+			auto_lock<spin_type> scoped_lock(_resize_lock);
+			_threads[i] = t;
+		}
+
+		MEMORY_BARRIER();
+		t->_create_status = thread_obj::OK;
+		return true;
+	}
+
+	void retire_worker(uint32_t i)
+	{
+		// the queue has been drained by the fence, and nothing is
+		// dispatched to it any more
+		thread_obj* t = _threads[i];
+		t->signal_stop();
+		t->join_thread();
+
+		{
+			auto_lock<spin_type> scoped_lock(_resize_lock);
+			_retired_stats.merge(t->stats());
+			_threads[i] = NULL;
+		}
+
+		delete t;
+	}
+
+	// switch the dispatcher to "active" queues at a consistent cut of the
+	// first "n" queues: the workers consume up to the cut, and then they
+	// are released all together
+	void pass_fence(uint32_t n, uint32_t active)
+	{
+		// hold the producers, and wait for those still using the old dispatching
+		_rerouting = true;
+		__sync_synchronize();	// pairs with the increment in allocate_elastic()
+		while (_routing != 0) {
+			g_thread_yield();
+		}
+
+		_dispatcher->resize(active);
+		_active_num = active;
+
+		uint32_t i;
+		for (i=0; i<n; i++) {
+			_threads[i]->_fence_ack = 0;
+			MEMORY_BARRIER();
+			_threads[i]->_fence_state = thread_obj::FENCE_HOLD;
+			_queues[i]->interrupt();
+		}
+
+		for (i=0; i<n; i++) {
+			while (!_threads[i]->_fence_ack) {
+				if (_controller_stop) goto release;
+				g_thread_sleep(0.0002);
+			}
+		}
+
+		for (i=0; i<n; i++) {
+			_threads[i]->_fence_seq = _queues[i]->allocated();
+			if (_high_queues) _threads[i]->_fence_high_seq = _high_queues[i]->allocated();
+			MEMORY_BARRIER();
+			_threads[i]->_fence_state = thread_obj::FENCE_LIMIT;
+		}
+
+		MEMORY_BARRIER();
+		_rerouting = false;
+
+		for (i=0; i<n; i++) {
+			while (_queues[i]->consumed() != _threads[i]->_fence_seq ||
+					(_high_queues && _high_queues[i]->consumed() != _threads[i]->_fence_high_seq)) {
+				if (_controller_stop) goto release;
+				g_thread_sleep(0.0002);
+			}
+		}
+
+	release:
+		_rerouting = false;
+		for (i=0; i<n; i++) {
+			_threads[i]->_fence_state = thread_obj::FENCE_NONE;
+			_queues[i]->interrupt();
+		}
+	}
+
+	// total handler time of all workers, including the retired ones
+	uint64_t busy_us()
+	{
+		auto_lock<spin_type> scoped_lock(_resize_lock);
+		uint64_t sum = _retired_stats.handle_time.sum;
+		for (uint32_t i=0; i<_thread_num; i++) {
+			if (_threads[i]) sum += _threads[i]->stats().handle_time.sum;
+		}
+		return sum;
+	}
+
+	static void* _controller_proc(void* param)
+	{
+		g_thread_bind(-1, "stage_elastic");
+		((stage*) param)->control();
+		return 0;
+	}
+
+	// the elastic controller, see elastic_policy
+	void control()
+	{
+		const elastic_policy& policy = _options.elastic;
+		uint64_t last_busy = busy_us();
+		int64_t last_us = g_now_us();
+		uint32_t idle_rounds = 0;
+
+		while (!_controller_stop) {
+			g_thread_sleep(policy.interval);
+			if (_controller_stop) break;
+
+			uint32_t n = _active_num;
+			uint32_t depth = 0;
+			for (uint32_t i=0; i<n; i++) {
+				depth += _queues[i]->size();
+				if (_high_queues) depth += _high_queues[i]->size();
+			}
+
+			uint64_t busy = busy_us();
+			int64_t now = g_now_us();
+			double busy_ratio = now > last_us ?
+					(double) (busy - last_busy) / ((double) (now - last_us) * n) : 1.0;
+			last_busy = busy;
+			last_us = now;
+
+			if (depth >= policy.grow_depth * n && n < policy.max_threads) {
+				idle_rounds = 0;
+				resize(n + 1);
+			}
+			else if (depth < n && busy_ratio <= 1.0 - policy.shrink_idle_ratio &&
+					n > policy.min_threads) {
+				if (++idle_rounds < policy.shrink_rounds) continue;
+				idle_rounds = 0;
+				resize(n - 1);
+			}
+			else {
+				idle_rounds = 0;
+				continue;
+			}
+
+			// don't count the time spent in resize()
+			last_busy = busy_us();
+			last_us = g_now_us();
+		}
+	}
+
+	void stop_controller()
+	{
+		if (_controller) {
+			_controller_stop = true;
+			long ret;
+			g_thread_join(_controller, &ret);
+			_controller = NULL;
+		}
+	}
+
 	handler_base** _handlers;
 	thread_obj** _threads;
 	event_queue** _queues;
+	event_queue** _high_queues;		// the high priority lanes, may be NULL
 	dispatcher_base* _dispatcher;
-	uint32_t _thread_num;
+	uint32_t _thread_num;			// slots, the max number of workers
+	volatile uint32_t _active_num;	// the workers [0, _active_num) are running
 	char _name[33];
 	bool _stopped;
+	stage_options _options;
+	int64_t _last_snapshot_us;
+	uint64_t _last_snapshot_events;
+
+	// elastic stages
+	new_worker_func _new_worker;
+	spin_type _resize_lock;			// guards _threads and _retired_stats
+	thread_stats _retired_stats;
+	g_thread_t _controller;
+	volatile bool _controller_stop;
+	volatile bool _rerouting;		// resize() is switching the dispatcher
+	volatile long _routing;			// producers in allocate_elastic()
 
 private:
 	// for linkedlist
@@ -232,17 +1004,40 @@ class stage_creator
 {
 public:
 	static stage* create_stage(const char* name, uint32_t threads, void* handler_param,
-			uint32_t queue_bytes, dispatcher_base* dispatcher) throw(std::bad_alloc)
+			uint32_t queue_bytes, dispatcher_base* dispatcher,
+			const stage_options& options = stage_options()) throw(std::bad_alloc)
 	{
 		stage *st = new STAGE();
 
-		uint32_t i, n = threads;
+		stage_options opts = options;
+		bool elastic = opts.elastic.enabled() && !opts.work_stealing;
+		if (elastic && opts.local_timers) {
+			fprintf(stderr, "%s:%d an elastic stage can't have local timers.\n", __FILE__, __LINE__);
+			delete st;
+			return NULL;
+		}
+		if (elastic) {
+			if (opts.elastic.min_threads == 0) opts.elastic.min_threads = 1;
+			if (opts.elastic.max_threads < opts.elastic.min_threads) {
+				opts.elastic.max_threads = opts.elastic.min_threads;
+			}
+			if (threads < opts.elastic.min_threads) threads = opts.elastic.min_threads;
+			if (threads > opts.elastic.max_threads) threads = opts.elastic.max_threads;
+			opts.telemetry = true;
+		}
+
+		// the handlers and the queues of the elastic workers are created
+		// up front, only the threads come and go
+		uint32_t i, n = elastic ? opts.elastic.max_threads : threads;
 
 		handler_base** hb = new handler_base* [n];
 		thread_obj** to = new thread_obj* [n];
 		event_queue** eq = new event_queue* [n];
+		bool lanes = opts.high_lane_bytes > 0 && !opts.work_stealing;
+		event_queue** hq = lanes ? new event_queue* [n] : NULL;
+		if (opts.high_lane_weight == 0) opts.high_lane_weight = 1;
 
-		for (i=0; i<n; i++) {hb[i]=NULL; to[i]=NULL; eq[i]=NULL;}
+		for (i=0; i<n; i++) {hb[i]=NULL; to[i]=NULL; eq[i]=NULL; if (hq) hq[i]=NULL;}
 
 		for (i=0; i<n; i++) {
 			hb[i] = new HANDLER();
@@ -253,29 +1048,55 @@ public:
 		}
 
 		for (i=0; i<n; i++) {
-			eq[i] = new event_queue(queue_bytes);
+			eq[i] = new event_queue(queue_bytes, opts.placement.thread_node(i));
+			if (hq) {
+				// the consumer parks on the normal lane
+				hq[i] = new event_queue(opts.high_lane_bytes, opts.placement.thread_node(i));
+				hq[i]->set_wake_target(eq[i]);
+			}
 		}
 
-		for (i=0; i<n; i++) {
+		g_snprintf(st->_name, sizeof(st->_name), "%.32s", name);
+
+		for (i=0; i<threads; i++) {
 			to[i] = thread_obj::new_thread_obj<THREADOBJ, HANDLER>(
-					name, i, static_cast<HANDLER*>(hb[i]), eq[i]);
+					st->_name, i, static_cast<HANDLER*>(hb[i]), eq[i]);
 			if (!to[i]) goto create_stage_failed;
 		}
 
-		g_snprintf(st->_name, sizeof(st->_name), "%.32s", name);
 		st->_thread_num = n;
+		st->_active_num = threads;
 		st->_handlers = hb;
 		st->_threads = to;
 		st->_queues = eq;
+		st->_high_queues = hq;
 		st->_dispatcher = dispatcher;
+		st->_options = opts;
+		st->_dispatcher->attach(eq);
 		st->_dispatcher->init(threads);
 
-		for (i=0; i<n; i++) {
+		for (i=0; i<threads; i++) {
+			to[i]->_options = opts;
+			to[i]->_siblings = eq;
+			to[i]->_sibling_num = n;
+			to[i]->_high_queue = hq ? hq[i] : NULL;
+		}
+
+		MEMORY_BARRIER();
+
+		for (i=0; i<threads; i++) {
 			to[i]->_create_status = thread_obj::OK;
 		}
 
 		st->start();
 
+		if (elastic) {
+			st->_new_worker = new_worker;
+			if (opts.elastic.interval > 0) {
+				st->_controller = g_thread_start(stage::_controller_proc, st);
+			}
+		}
+
 		stage_mgr::get_instance()->register_stage(st);
 
 		return st;
@@ -307,10 +1128,25 @@ public:
 			delete[] eq;
 		}
 
+		if (hq) {
+			for (i=0; i<n; i++) {
+				if (hq[i]) delete hq[i];
+			}
+			delete[] hq;
+		}
+
 		delete st;
 
 		return NULL;
 	}
+
+private:
+	static thread_obj* new_worker(const char* name,
+			int32_t thread_id, handler_base* handler, event_queue* ev_queue)
+	{
+		return thread_obj::new_thread_obj<THREADOBJ, HANDLER>(
+				name, thread_id, static_cast<HANDLER*>(handler), ev_queue);
+	}
 };
 
 } //namespace
@@ -63,3 +63,50 @@ void stage_mgr::stop_all()
 		delete node;
 	}
 }
+
+void stage_mgr::snapshot(std::vector<stage_snapshot>& out)
+{
+	auto_lock<spin_type> scoped_lock(_lock);
+	stage* node = _stages.head();
+	while (node != NULL) {
+		out.resize(out.size() + 1);
+		node->snapshot(out.back());
+		node = node->_next;
+	}
+}
+
+void stage_mgr::dump_stats(std::string& out, bool json)
+{
+	std::vector<stage_snapshot> snaps;
+	snapshot(snaps);
+
+	char line[512];
+	char name[sizeof(snaps[0].name) * 6];
+	if (json) out.append("[");
+	for (size_t i = 0; i < snaps.size(); i++) {
+		const stage_snapshot& s = snaps[i];
+		if (json) g_json_escape(s.name, name, sizeof(name));
+		else g_strlcpy(name, s.name, sizeof(name));
+		const char* fmt = json ?
+			"%s{\"name\":\"%s\",\"threads\":%u,\"depth\":%u,\"depth_high_water\":%u,"
+			"\"events\":%llu,\"events_per_sec\":%.1f,"
+			"\"queue_delay_us\":{\"avg\":%llu,\"p50\":%llu,\"p99\":%llu,\"max\":%llu},"
+			"\"handle_time_us\":{\"avg\":%llu,\"p50\":%llu,\"p99\":%llu,\"max\":%llu}}" :
+			"%s%s: threads=%u depth=%u depth_high_water=%u events=%llu events_per_sec=%.1f "
+			"queue_delay_us(avg/p50/p99/max)=%llu/%llu/%llu/%llu "
+			"handle_time_us(avg/p50/p99/max)=%llu/%llu/%llu/%llu\n";
+		g_snprintf(line, sizeof(line), fmt,
+			json && i > 0 ? "," : "", name, s.threads, s.depth, s.depth_high_water,
+			(unsigned long long) s.events, s.events_per_sec,
+			(unsigned long long) s.queue_delay.average(),
+			(unsigned long long) s.queue_delay.percentile(0.5),
+			(unsigned long long) s.queue_delay.percentile(0.99),
+			(unsigned long long) s.queue_delay.max,
+			(unsigned long long) s.handle_time.average(),
+			(unsigned long long) s.handle_time.percentile(0.5),
+			(unsigned long long) s.handle_time.percentile(0.99),
+			(unsigned long long) s.handle_time.max);
+		out.append(line);
+	}
+	if (json) out.append("]");
+}
@@ -8,8 +8,11 @@
 #ifndef STAGE_MGR_H_
 #define STAGE_MGR_H_
 
+#include <string>
+#include <vector>
 #include "sax/c++/linkedlist.h"
 #include "sax/sysutil.h"
+#include "stage_stats.h"
 
 namespace sax {
 
@@ -27,6 +30,13 @@ public:
 
 	void stop_all();
 
+	/// takes a snapshot of every registered stage, events_per_sec is computed
+	/// since the previous call
+	void snapshot(std::vector<stage_snapshot>& out);
+
+	/// appends a snapshot of all stages to out, one line per stage or a json array
+	void dump_stats(std::string& out, bool json = false);
+
 private:
 	stage_mgr() {}
 	~stage_mgr() {}
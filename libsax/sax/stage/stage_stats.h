@@ -0,0 +1,119 @@
+/*
+ * stage_stats.h
+ *
+ *  Created on: 2012-9-12
+ *      Author: x
+ */
+
+#ifndef STAGE_STATS_H_
+#define STAGE_STATS_H_
+
+#include <string.h>
+
+#include "sax/os_types.h"
+#include "sax/compiler.h"
+
+namespace sax {
+
+/// a histogram with log2 buckets, bucket i counts the values in [2^(i-1), 2^i)
+/// (bucket 0 counts zero). it has only one writer, readers just take
+/// a racy but harmless snapshot.
+struct latency_histogram
+{
+	enum {BUCKETS = 32};
+
+	uint64_t buckets[BUCKETS];
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+
+	latency_histogram() { reset(); }
+
+	void reset()
+	{
+		memset(buckets, 0, sizeof(buckets));
+		count = sum = max = 0;
+	}
+
+	inline void record(int64_t value)
+	{
+		uint64_t v = value > 0 ? (uint64_t) value : 0;
+		uint32_t i = 0;
+		if (v != 0) {
+			i = 64 - __builtin_clzll(v);
+			if (UNLIKELY(i >= BUCKETS)) i = BUCKETS - 1;
+		}
+		++buckets[i];
+		++count;
+		sum += v;
+		if (UNLIKELY(v > max)) max = v;
+	}
+
+	void merge(const latency_histogram& other)
+	{
+		for (int32_t i = 0; i < BUCKETS; i++) buckets[i] += other.buckets[i];
+		count += other.count;
+		sum += other.sum;
+		if (other.max > max) max = other.max;
+	}
+
+	// returns the upper bound of the bucket holding the percentile
+	uint64_t percentile(double p) const
+	{
+		if (count == 0) return 0;
+		uint64_t target = (uint64_t) (count * p);
+		if (target >= count) target = count - 1;
+		uint64_t seen = 0;
+		for (int32_t i = 0; i < BUCKETS; i++) {
+			seen += buckets[i];
+			if (seen > target) {
+				uint64_t bound = i == 0 ? 0 : ((uint64_t) 1 << i) - 1;
+				return bound < max ? bound : max;
+			}
+		}
+		return max;
+	}
+
+	uint64_t average() const { return count ? sum / count : 0; }
+};
+
+/// counters of a stage thread, only updated by the thread itself
+struct thread_stats
+{
+	uint64_t events;
+	uint32_t depth_high_water;		// in events
+	latency_histogram queue_delay;	// from push_event() to dequeue, in usec
+	latency_histogram handle_time;	// time spent in the handler, in usec
+
+	thread_stats() : events(0), depth_high_water(0) {}
+
+	inline void update_depth(uint32_t depth)
+	{
+		if (UNLIKELY(depth > depth_high_water)) depth_high_water = depth;
+	}
+
+	void merge(const thread_stats& other)
+	{
+		events += other.events;
+		update_depth(other.depth_high_water);
+		queue_delay.merge(other.queue_delay);
+		handle_time.merge(other.handle_time);
+	}
+};
+
+/// a snapshot of a stage, returned by stage_mgr::snapshot()
+struct stage_snapshot
+{
+	char name[33];
+	uint32_t threads;
+	uint32_t depth;				// events in all queues
+	uint32_t depth_high_water;	// the max of all queues
+	uint64_t events;			// handled events since the stage started
+	double events_per_sec;		// since the previous snapshot
+	latency_histogram queue_delay;
+	latency_histogram handle_time;
+};
+
+} // namespace
+
+#endif /* STAGE_STATS_H_ */
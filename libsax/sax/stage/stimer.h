@@ -11,6 +11,7 @@
 #include "stage.h"
 #include "sax_events.h"
 #include "sax/timer.h"
+#include "sax/slabutil.h"
 
 namespace sax {
 
@@ -22,21 +23,32 @@ class stimer_handler : public handler_base
 		stage* biz_stage;
 		void* param;
 		stimer_handler* self;
+		g_timer_handle_t handle;
+		timer_param* next;	// in the bucket of _index
 	};
 
+	enum {MIN_INDEX_SIZE = 1024};
+
 public:
 
-	stimer_handler() : _timer(NULL), _last_ms(g_now_ms()) {}
+	stimer_handler() : _timer(NULL), _last_ms(g_now_ms()), _params(sizeof(timer_param)),
+		_index(NULL), _index_mask(0), _index_count(0) {}
 
 	virtual ~stimer_handler()
 	{
 		if (_timer) g_timer_destroy(_timer, _free_func);
+		if (_index) delete[] _index;
 	}
 
 	virtual bool init(void* param)
 	{
 		_timer = g_timer_create();
-		return _timer != NULL;
+		if (_timer == NULL) return false;
+
+		_index = new timer_param* [MIN_INDEX_SIZE];
+		memset(_index, 0, sizeof(timer_param*) * MIN_INDEX_SIZE);
+		_index_mask = MIN_INDEX_SIZE - 1;
+		return true;
 	}
 
 	virtual void on_event(const sax::event_type* ev)
@@ -45,17 +57,28 @@ public:
 		{
 		case add_timer_event::ID:
 		{
-			add_timer_event* event = (add_timer_event*) ev;
-
-			timer_param* p = new timer_param();
-			p->trans_id = event->trans_id;
-			p->biz_stage = event->biz_stage;
-			p->param = event->invoke_param;
-			p->self = this;
-
-			g_timer_start(_timer, event->delay_ms,
-					stimer_handler::_timer_proc, p);
-
+			const add_timer_event* event = (const add_timer_event*) ev;
+			add_timer(event->trans_id, event->biz_stage, event->invoke_param,
+					event->delay_ms);
+			break;
+		}
+		case add_timers_event::ID:
+		{
+			const add_timers_event* event = (const add_timers_event*) ev;
+			const add_timers_event::timer* timers = event->timers();
+			for (int32_t i = 0; i < event->count; i++) {
+				add_timer(timers[i].trans_id, event->biz_stage, timers[i].invoke_param,
+						timers[i].delay_ms);
+			}
+			break;
+		}
+		case cancel_timer_event::ID:
+		{
+			timer_param* p = unindex(((const cancel_timer_event*) ev)->trans_id);
+			if (p) {
+				g_timer_cancel(_timer, p->handle, NULL);
+				_params.free(p);
+			}
 			break;
 		}
 		default:
@@ -73,29 +96,135 @@ public:
 		_last_ms = now_ms;
 	}
 
+	// milliseconds until the next timer may fire, G_TIMER_NEVER if none
+	inline uint32_t next_expire_ms() { return g_timer_next_expire(_timer); }
+
+	// pending timers
+	inline uint32_t count() const { return _index_count; }
+
 private:
 
+	void add_timer(uint64_t trans_id, stage* biz_stage, void* param, uint32_t delay_ms)
+	{
+		timer_param* p = (timer_param*) _params.alloc();
+		if (UNLIKELY(p == NULL)) {
+			fprintf(stderr, "%s:%d alloc timer failed.\n", __FILE__, __LINE__);
+			return;
+		}
+
+		p->trans_id = trans_id;
+		p->biz_stage = biz_stage;
+		p->param = param;
+		p->self = this;
+		p->handle = g_timer_start(_timer, delay_ms, stimer_handler::_timer_proc, p);
+		if (UNLIKELY(p->handle == NULL)) {
+			fprintf(stderr, "%s:%d start timer failed.\n", __FILE__, __LINE__);
+			_params.free(p);
+			return;
+		}
+
+		index(p);
+	}
+
+	inline uint32_t bucket(uint64_t trans_id) const
+	{
+		return (uint32_t) ((trans_id * 0x9E3779B97F4A7C15ULL) >> 32) & _index_mask;
+	}
+
+	// the latest added timer goes first in its bucket
+	void index(timer_param* p)
+	{
+		if (_index_count > _index_mask) {
+			grow_index();
+		}
+
+		timer_param** head = &_index[bucket(p->trans_id)];
+		p->next = *head;
+		*head = p;
+		_index_count++;
+	}
+
+	timer_param* unindex(uint64_t trans_id)
+	{
+		timer_param** link = &_index[bucket(trans_id)];
+		while (*link != NULL) {
+			timer_param* p = *link;
+			if (p->trans_id == trans_id) {
+				*link = p->next;
+				_index_count--;
+				return p;
+			}
+			link = &p->next;
+		}
+		return NULL;
+	}
+
+	// the fired timer is not always the first one of its trans_id
+	void unindex(timer_param* target)
+	{
+		timer_param** link = &_index[bucket(target->trans_id)];
+		while (*link != target) {
+			link = &(*link)->next;
+		}
+		*link = target->next;
+		_index_count--;
+	}
+
+	void grow_index()
+	{
+		uint32_t size = (_index_mask + 1) * 2;
+		timer_param** old = _index;
+		uint32_t old_size = _index_mask + 1;
+
+		_index = new timer_param* [size];
+		memset(_index, 0, sizeof(timer_param*) * size);
+		_index_mask = size - 1;
+
+		// keep the order of each bucket, so the latest added stays first
+		for (uint32_t i = 0; i < old_size; i++) {
+			timer_param* p = old[i];
+			while (p != NULL) {
+				timer_param* next = p->next;
+				timer_param** link = &_index[bucket(p->trans_id)];
+				while (*link != NULL) link = &(*link)->next;
+				p->next = NULL;
+				*link = p;
+				p = next;
+			}
+		}
+
+		delete[] old;
+	}
+
 	static void _timer_proc(g_timer_handle_t handle, void* param)
 	{
 		timer_param* p = (timer_param*) param;
 
-		timer_timeout_event* invoke =
-				p->biz_stage->allocate_event<timer_timeout_event>(p->trans_id);
+		// timeouts go ahead of the bulk traffic if the stage has a high lane
+		timer_timeout_event* invoke = p->biz_stage->allocate_event<timer_timeout_event>(
+				p->trans_id, true, PRIORITY_HIGH);
 		invoke->trans_id = p->trans_id;
 		invoke->invoke_param = p->param;
 		p->biz_stage->push_event(invoke);
 
-		delete p;
+		p->self->unindex(p);
+		p->self->_params.free(p);
 	}
 
 	static void _free_func(void* user_data)
 	{
 		timer_param* p = (timer_param*) user_data;
-		delete p;
+		p->self->_params.free(p);
 	}
 
 	g_timer_t* _timer;
 	uint64_t _last_ms;
+
+	// only the timer thread touches them
+	slab_t _params;
+	timer_param** _index;	// trans_id => pending timers
+	uint32_t _index_mask;
+	uint32_t _index_count;
 };
 
 class stimer_threadobj : public thread_obj
@@ -105,41 +234,44 @@ public:
 		thread_obj(thread_id, handler, ev_queue) {}
 	virtual ~stimer_threadobj() {}
 
+	// tickless: the thread parks until the next timer is due or an event comes.
+	// the high lane, if any, is drained first as in thread_obj::run_lanes()
 	virtual void run()
 	{
 		const int POLLING_COUNT = 10;
-		const int SLEEP_IDLE_COUNT = 10;
+		const uint32_t MAX_PARK_MS = 1000;
+		stimer_handler* handler = (stimer_handler*) _handler;
 		int32_t count = 0;
-		int32_t idle_count = 0;
-		double sec = 0.001;	// 1 millisecond
 		while (!_stop) {
-			count++;
-			event_type* ev;
-			if ((ev = _ev_queue->pop_event()) != NULL) {
-				_handler->on_event(ev);
-				_ev_queue->destroy_event(ev);
-			}
-			else {
-				if (++idle_count >= SLEEP_IDLE_COUNT) {
-					g_thread_sleep(sec);
-					((stimer_handler*) _handler)->poll_timer();
-					idle_count = 0;
-				}
-			}
+			event_type* ev = NULL;
+			event_queue* queue;
+			if (pop_lanes(&ev, 1, queue) > 0) {
+				handle_event(queue, ev);
+				queue->destroy_event(ev);
 
-			if (count >= POLLING_COUNT) {
-				((stimer_handler*) _handler)->poll_timer();
+				// keep the timers going under a flood of events
+				if (++count < POLLING_COUNT) continue;
 			}
+
+			count = 0;
+			handler->poll_timer();
+			if (ev != NULL) continue;
+
+			uint32_t ms = handler->next_expire_ms();
+			if (ms > MAX_PARK_MS) ms = MAX_PARK_MS;
+			_ev_queue->park(ms * 0.001, _high_queue);
 		}
 	}
 };
 
-stage* create_stimer(size_t queue_bytes = 2 * 1024 * 1024)
+// "options" places the timer thread, see stage_placement
+stage* create_stimer(size_t queue_bytes = 2 * 1024 * 1024,
+		const stage_options& options = stage_options())
 {
 	dispatcher_base* dispatcher = new single_dispatcher();
 	if (dispatcher == NULL) return NULL;
 	stage* timer = stage_creator<stimer_handler, stimer_threadobj>::create_stage(
-			"global_timer", 1, NULL, queue_bytes, dispatcher);
+			"global_timer", 1, NULL, queue_bytes, dispatcher, options);
 	return timer;
 }
 
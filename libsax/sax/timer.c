@@ -1,4 +1,5 @@
 #include <stdlib.h>
+#include <string.h>
 #include "timer.h"
 #include "compiler.h"
 #include "mempool.h"
@@ -12,8 +13,16 @@ struct timer_node
 	g_timer_proc func;
 	void* user_data;
 	uint32_t expire;
+	uint32_t slot;		/* index of the list head in lv1..lv4 */
+	uint32_t period;	/* 0 for one-shot timers */
+	uint32_t flags;
 };
 
+/* the proc of the node is running, fire() releases or keeps the node after it */
+#define NODE_FIRING		1
+/* cancelled in its own proc */
+#define NODE_STOPPED	2
+
 struct g_timer_t
 {
 	timer_node* lv1;
@@ -23,12 +32,22 @@ struct g_timer_t
 	g_xslab_t* pool;
 	uint32_t last;
 	uint32_t count;
+	uint32_t bits[4][8];	/* non-empty slots of each level */
 };
 
-static void remove_node(timer_node* node)
+#define SLOT_SET(t, slot)	((t)->bits[(slot) >> 8][((slot) >> 5) & 7] |= 1u << ((slot) & 31))
+#define SLOT_CLEAR(t, slot)	((t)->bits[(slot) >> 8][((slot) >> 5) & 7] &= ~(1u << ((slot) & 31)))
+
+static void remove_node(g_timer_t* t, timer_node* node)
 {
 	node->prev->next = node->next;
 	node->next->prev = node->prev;
+
+	timer_node* list_head = &t->lv1[node->slot];
+	if (list_head->next == list_head) {
+		SLOT_CLEAR(t, node->slot);
+	}
+
 	node->prev = node->next = NULL;
 }
 
@@ -53,6 +72,9 @@ static void schedule(g_timer_t* t, timer_node* node, uint32_t delay_ticks)
 	node->next = list_head->next;
 	list_head->next = node;
 	node->prev = list_head;
+
+	node->slot = (uint32_t) (list_head - t->lv1);
+	SLOT_SET(t, node->slot);
 }
 
 static void reschedule(g_timer_t* t, timer_node* list_head, uint32_t now)
@@ -64,6 +86,7 @@ static void reschedule(g_timer_t* t, timer_node* list_head, uint32_t now)
 		node = tmp;
 	}
 	list_head->next = list_head->prev = list_head;
+	SLOT_CLEAR(t, (uint32_t) (list_head - t->lv1));
 }
 
 static void fire(g_timer_t* t, timer_node* list_head)
@@ -71,11 +94,30 @@ static void fire(g_timer_t* t, timer_node* list_head)
 	timer_node* node = list_head->next;
 	while (node != list_head) {
 		--(t->count);
-		remove_node(node);
+		remove_node(t, node);
 
+		node->flags = NODE_FIRING;
 		node->func((g_timer_handle_t) node, node->user_data);
 
-		g_xslab_free(t->pool, node);
+		if (node->flags & NODE_STOPPED) {
+			node->flags = 0;
+			g_xslab_free(t->pool, node);
+		}
+		else if (node->prev != NULL) {
+			/* restarted by its proc */
+			node->flags = 0;
+		}
+		else if (node->period != 0) {
+			node->flags = 0;
+			node->expire = t->last + node->period;
+			schedule(t, node, node->period);
+			++(t->count);
+		}
+		else {
+			node->flags = 0;
+			g_xslab_free(t->pool, node);
+		}
+
 		node = list_head->next;
 	}
 }
@@ -100,6 +142,7 @@ g_timer_t* g_timer_create2(uint32_t now)
 
 	timer->last = now;
 	timer->count = 0;
+	memset(timer->bits, 0, sizeof(timer->bits));
 
 	int32_t i;
 	for (i = 0; i < 4 * 256; i++) {
@@ -145,6 +188,12 @@ void g_timer_destroy(g_timer_t* t, g_timer_free free_func)
 
 g_timer_handle_t g_timer_start(g_timer_t* t, uint32_t delay_ticks,
 		g_timer_proc func, void* user_data)
+{
+	return g_timer_start_periodic(t, delay_ticks, 0, func, user_data);
+}
+
+g_timer_handle_t g_timer_start_periodic(g_timer_t* t, uint32_t delay_ticks,
+		uint32_t period_ticks, g_timer_proc func, void* user_data)
 {
 	timer_node* node = (timer_node*) g_xslab_alloc(t->pool);
 	if (UNLIKELY(node == NULL)) return NULL;
@@ -152,6 +201,8 @@ g_timer_handle_t g_timer_start(g_timer_t* t, uint32_t delay_ticks,
 	node->func = func;
 	node->user_data = user_data;
 	node->expire = t->last + delay_ticks;
+	node->period = period_ticks;
+	node->flags = 0;
 
 	schedule(t, node, delay_ticks);
 
@@ -164,6 +215,23 @@ int32_t g_timer_cancel(g_timer_t* t, g_timer_handle_t handle, void** user_data)
 {
 	timer_node* node = (timer_node*) handle;
 
+	if (UNLIKELY(node->flags & NODE_FIRING)) {
+		/* in its own proc, nothing is pending for a one-shot timer unless
+		 * it has been restarted. fire() releases the node after the proc */
+		if ((node->flags & NODE_STOPPED) ||
+				(node->prev == NULL && node->period == 0)) {
+			return 1;
+		}
+
+		if (node->prev != NULL) {
+			--(t->count);
+			remove_node(t, node);
+		}
+		node->flags |= NODE_STOPPED;
+		if (user_data) *user_data = node->user_data;
+		return 0;
+	}
+
 	/**
 	 * the xslib pool manages memory nodes as a singly linked list,
 	 * so it reuses node->next to make the linked list.
@@ -175,37 +243,117 @@ int32_t g_timer_cancel(g_timer_t* t, g_timer_handle_t handle, void** user_data)
 	if (user_data) *user_data = node->user_data;
 
 	--(t->count);
-	remove_node(node);
+	remove_node(t, node);
 	g_xslab_free(t->pool, node);
 
 	return 0;
 }
 
-void g_timer_poll(g_timer_t* t, uint32_t lapsed_ticks)
+int32_t g_timer_restart(g_timer_t* t, g_timer_handle_t handle, uint32_t delay_ticks)
 {
-	while ((lapsed_ticks--) != 0) {
-		++(t->last);
-		timer_node* list_head;
-		if (LIKELY(t->last & 0x0FF)) {
-			list_head = &t->lv1[t->last & 0x0FF];
-		}
-		else if (LIKELY(t->last & 0x0ffFF)) {
-			reschedule(t, &t->lv2[(t->last >> 8) & 0x0FF], t->last);
-			list_head = &t->lv1[0];
-		}
-		else if (LIKELY(t->last & 0x0FFffFF)) {
-			reschedule(t, &t->lv3[(t->last >> 16) & 0x0FF], t->last);
-			reschedule(t, &t->lv2[0], t->last);
-			list_head = &t->lv1[0];
+	timer_node* node = (timer_node*) handle;
+
+	if (node->prev != NULL) {
+		--(t->count);
+		remove_node(t, node);
+	}
+	else if (!(node->flags & NODE_FIRING) || (node->flags & NODE_STOPPED)) {
+		return 1;
+	}
+
+	/* 0 would put it into the slot being fired */
+	if (delay_ticks == 0) delay_ticks = 1;
+
+	node->expire = t->last + delay_ticks;
+	schedule(t, node, delay_ticks);
+	++(t->count);
+
+	return 0;
+}
+
+/* fires or cascades the slots of the tick "t->last + 1" */
+static void step(g_timer_t* t)
+{
+	++(t->last);
+	timer_node* list_head;
+	if (LIKELY(t->last & 0x0FF)) {
+		list_head = &t->lv1[t->last & 0x0FF];
+	}
+	else if (LIKELY(t->last & 0x0ffFF)) {
+		reschedule(t, &t->lv2[(t->last >> 8) & 0x0FF], t->last);
+		list_head = &t->lv1[0];
+	}
+	else if (LIKELY(t->last & 0x0FFffFF)) {
+		reschedule(t, &t->lv3[(t->last >> 16) & 0x0FF], t->last);
+		reschedule(t, &t->lv2[0], t->last);
+		list_head = &t->lv1[0];
+	}
+	else {
+		reschedule(t, &t->lv4[(t->last >> 24) & 0x0FF], t->last);
+		reschedule(t, &t->lv3[0], t->last);
+		reschedule(t, &t->lv2[0], t->last);
+		list_head = &t->lv1[0];
+	}
+
+	fire(t, list_head);
+}
+
+/* the distance (1..256) from slot "cur" to the next non-empty slot of
+ * a level, going round; 0 if the level is empty */
+static uint32_t next_slot(const uint32_t* bits, uint32_t cur)
+{
+	uint32_t start = (cur + 1) & 0x0FF;
+	uint32_t word = start >> 5;
+	uint32_t mask = bits[word] & (~0u << (start & 31));
+
+	/* the 9th word is the first one again, for the slots before "start" */
+	int32_t i;
+	for (i = 0; i < 9; i++) {
+		if (mask != 0) {
+			uint32_t slot = (word << 5) + (uint32_t) __builtin_ctz(mask);
+			return ((slot - cur - 1) & 0x0FF) + 1;
 		}
-		else {
-			reschedule(t, &t->lv4[(t->last >> 24) & 0x0FF], t->last);
-			reschedule(t, &t->lv3[0], t->last);
-			reschedule(t, &t->lv2[0], t->last);
-			list_head = &t->lv1[0];
+		word = (word + 1) & 7;
+		mask = bits[word];
+	}
+	return 0;
+}
+
+uint32_t g_timer_next_expire(g_timer_t* t)
+{
+	uint64_t next = G_TIMER_NEVER;
+	uint32_t level;
+
+	/*
+	 * the slot "k" ticks of a level ahead of the current one is due at the
+	 * k-th next multiple of 256^level, when it fires (level 0) or cascades
+	 */
+	for (level = 0; level < 4; level++) {
+		uint32_t shift = level * 8;
+		uint32_t k = next_slot(t->bits[level], (t->last >> shift) & 0x0FF);
+		if (k == 0) continue;
+
+		uint64_t due = (((uint64_t) (t->last >> shift) + k) << shift) - t->last;
+		if (due >= G_TIMER_NEVER) due = G_TIMER_NEVER - 1;
+		if (due < next) next = due;
+	}
+
+	return (uint32_t) next;
+}
+
+void g_timer_poll(g_timer_t* t, uint32_t lapsed_ticks)
+{
+	while (lapsed_ticks != 0) {
+		/* skip the ticks of empty slots at once */
+		uint32_t next = g_timer_next_expire(t);
+		if (next > lapsed_ticks) {
+			t->last += lapsed_ticks;
+			break;
 		}
 
-		fire(t, list_head);
+		t->last += next - 1;
+		lapsed_ticks -= next;
+		step(t);
 	}
 }
 
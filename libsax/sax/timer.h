@@ -34,14 +34,37 @@ g_timer_t* g_timer_create2(uint32_t now);
 // the free_func is used for releasing user_data of timers, can be NULL
 void g_timer_destroy(g_timer_t* t, g_timer_free free_func);
 
-// NOTICE: the returning handle become invalid after the timer fired
+// NOTICE: the returning handle become invalid after the timer fired,
+//         unless its proc restarts it by g_timer_restart()
 g_timer_handle_t g_timer_start(g_timer_t* t, uint32_t delay_ticks,
 		g_timer_proc func, void* user_data);
 
+// fires after delay_ticks, and then every period_ticks (0 for one-shot).
+// the handle stays valid until the timer is cancelled, and it costs
+// no allocation after the start.
+g_timer_handle_t g_timer_start_periodic(g_timer_t* t, uint32_t delay_ticks,
+		uint32_t period_ticks, g_timer_proc func, void* user_data);
+
+// returns 0 if the pending timer is cancelled, 1 if nothing is pending.
+// a periodic timer can be cancelled in its own proc.
 int32_t g_timer_cancel(g_timer_t* t, g_timer_handle_t handle, void** user_data);
 
+// move a pending timer in place, to fire delay_ticks later from now
+// (0 is taken as 1). a periodic timer keeps its period after it. the proc of
+// a one-shot timer can restart its own handle to use the node again.
+// returns 0 on success, 1 if the timer has fired or been cancelled.
+int32_t g_timer_restart(g_timer_t* t, g_timer_handle_t handle, uint32_t delay_ticks);
+
+// the empty slots are skipped at once, so a long gap costs nothing
 void g_timer_poll(g_timer_t* t, uint32_t lapsed_ticks);
 
+#define G_TIMER_NEVER 0xFFFFFFFFu
+
+// ticks until the next timer may fire, polling less ticks fires nothing.
+// it's a lower bound when the next timer is in a higher level of the wheel,
+// query it again after the poll. returns G_TIMER_NEVER if no timer is pending.
+uint32_t g_timer_next_expire(g_timer_t* t);
+
 uint32_t g_timer_count(g_timer_t* t);
 
 void g_timer_shrink_mempool(g_timer_t* t, double keep);
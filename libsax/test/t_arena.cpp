@@ -0,0 +1,183 @@
+/*
+ * t_arena.cpp
+ *
+ *  Created on: 2012-9-28
+ *      Author: x
+ */
+
+#include <string>
+#include <vector>
+#include <map>
+#include <list>
+
+#include "gtest/gtest.h"
+#include "sax/c++/pools.h"
+
+using namespace sax;
+
+static int alive = 0;
+static std::vector<int> destroyed;
+
+struct tracked
+{
+	tracked(int id) : id(id) { alive++; }
+	~tracked() { alive--; destroyed.push_back(id); }
+	int id;
+};
+
+struct counted
+{
+	counted(int id) : id(id) { alive++; }
+	~counted() { alive--; }
+	int id;
+	char body[40];
+};
+
+struct plain
+{
+	int a;
+	double b;
+};
+
+TEST(arena, bump_and_align)
+{
+	arena a;
+	EXPECT_EQ(0u, a.capacity());
+
+	char* p1 = (char*) a.alloc(1);
+	char* p2 = (char*) a.alloc(1);
+	ASSERT_TRUE(p1 != NULL);
+	EXPECT_EQ(p1 + arena::ALIGN, p2);
+	EXPECT_EQ(0u, (uintptr_t) p1 % arena::ALIGN);
+	EXPECT_EQ(arena::ALIGN + 1, a.used());
+	EXPECT_EQ((size_t) g_shm_unit(), a.capacity());
+
+	char* p3 = (char*) a.alloc(3, 1);
+	EXPECT_EQ(p2 + 1, p3);
+	char* p4 = (char*) a.alloc(8, 64);
+	EXPECT_EQ(0u, (uintptr_t) p4 % 64);
+
+	// chained blocks, larger allocations get a block of their own size
+	char* big = (char*) a.alloc(g_shm_unit() * 3);
+	ASSERT_TRUE(big != NULL);
+	memset(big, 1, g_shm_unit() * 3);
+	EXPECT_EQ((size_t) g_shm_unit() * 5, a.capacity());
+
+	plain* obj = a.alloc_obj<plain>();
+	ASSERT_TRUE(obj != NULL);
+	EXPECT_EQ(0, obj->a);
+}
+
+TEST(arena, destructors)
+{
+	alive = 0;
+	destroyed.clear();
+	{
+		arena a(100);
+		for (int i = 0; i < 1000; i++) {
+			tracked* t = a.alloc_obj<tracked>(i);
+			ASSERT_TRUE(t != NULL);
+			EXPECT_EQ(i, t->id);
+		}
+		std::string* s = a.alloc_obj<std::string>("a string longer than the small buffer");
+		EXPECT_EQ("a string longer than the small buffer", *s);
+		EXPECT_EQ(1000, alive);
+
+		// in the reverse order
+		a.reset();
+		EXPECT_EQ(0, alive);
+		ASSERT_EQ(1000u, destroyed.size());
+		EXPECT_EQ(999, destroyed.front());
+		EXPECT_EQ(0, destroyed.back());
+
+		a.alloc_obj<tracked>(1000);
+		EXPECT_EQ(1, alive);
+	}
+	EXPECT_EQ(0, alive);
+	EXPECT_EQ(1000, destroyed.back());
+}
+
+TEST(arena, reset_reuses_blocks)
+{
+	arena a;
+	std::vector<void*> first;
+	for (int i = 0; i < 1000; i++) first.push_back(a.alloc(24));
+	size_t capacity = a.capacity();
+	EXPECT_GT(capacity, (size_t) g_shm_unit());
+
+	for (int round = 0; round < 10; round++) {
+		a.reset();
+		EXPECT_EQ(0u, a.used());
+		for (int i = 0; i < 1000; i++) {
+			ASSERT_EQ(first[i], a.alloc(24));
+		}
+		EXPECT_EQ(capacity, a.capacity());
+	}
+
+	// a large one in the middle of the chain does not lose the rest
+	a.reset();
+	a.alloc(24);
+	a.alloc(g_shm_unit() * 2);
+	for (int i = 0; i < 1000; i++) a.alloc(24);
+	EXPECT_EQ(capacity + g_shm_unit() * 3, a.capacity());
+}
+
+TEST(arena, stl_allocator)
+{
+	arena a;
+	for (int round = 0; round < 3; round++) {
+		{
+			typedef std::basic_string<char, std::char_traits<char>, arena_allocator<char> > astring;
+			std::vector<int, arena_allocator<int> > v((arena_allocator<int>(&a)));
+			for (int i = 0; i < 1000; i++) v.push_back(i);
+			EXPECT_EQ(999, v[999]);
+
+			typedef arena_allocator<std::pair<const int, astring> > map_allocator;
+			map_allocator ma(&a);
+			std::map<int, astring, std::less<int>, map_allocator> m(std::less<int>(), ma);
+			for (int i = 0; i < 100; i++) {
+				m.insert(std::make_pair(i, astring("value of a request", arena_allocator<char>(&a))));
+			}
+			EXPECT_EQ(100u, m.size());
+			EXPECT_EQ("value of a request", std::string(m.find(50)->second.c_str()));
+
+			std::list<int, arena_allocator<int> > l((arena_allocator<int>(&a)));
+			l.push_back(1);
+			EXPECT_TRUE(l.get_allocator() == arena_allocator<char>(&a));
+		}
+		a.reset();
+	}
+
+	arena b;
+	EXPECT_TRUE(arena_allocator<int>(&a) != arena_allocator<int>(&b));
+}
+
+TEST(arena, benchmark)
+{
+	const int requests = 20000, objects = 200;
+	std::vector<counted*> objs(objects);
+
+	int64_t start = g_now_us();
+	for (int r = 0; r < requests; r++) {
+		for (int i = 0; i < objects; i++) objs[i] = new counted(i);
+		for (int i = 0; i < objects; i++) delete objs[i];
+	}
+	int64_t heap_us = g_now_us() - start;
+
+	arena a;
+	start = g_now_us();
+	for (int r = 0; r < requests; r++) {
+		for (int i = 0; i < objects; i++) objs[i] = a.alloc_obj<counted>(i);
+		a.reset();
+	}
+	int64_t arena_us = g_now_us() - start;
+
+	printf("%d requests of %d objects, new/delete: %lld us, arena: %lld us\n",
+			requests, objects, (long long) heap_us, (long long) arena_us);
+}
+
+int main(int argc, char* argv[])
+{
+	testing::InitGoogleTest(&argc, argv);
+	return RUN_ALL_TESTS();
+}
@@ -0,0 +1,174 @@
+/*
+ * t_dispatcher.cpp
+ *
+ *  Created on: 2012-9-10
+ *      Author: x
+ */
+
+#include <algorithm>
+#include <vector>
+
+#include "sax/stage/stage.h"
+#include "gtest/gtest.h"
+
+struct test_event : public sax::user_event_base<1, test_event>
+{
+	int32_t index;
+	int32_t cost_us;
+	int64_t start_us;
+};
+
+TEST(dispatcher, round_robin)
+{
+	sax::default_dispatcher d;
+	d.init(3);
+
+	uint32_t counts[3] = {0, 0, 0};
+	for (int i = 0; i < 300; i++) {
+		uint32_t q = d.dispatch(test_event::ID, 0);
+		ASSERT_LT(q, 3u);
+		counts[q]++;
+	}
+
+	ASSERT_EQ(100u, counts[0]);
+	ASSERT_EQ(100u, counts[1]);
+	ASSERT_EQ(100u, counts[2]);
+}
+
+TEST(dispatcher, hash_is_stable)
+{
+	sax::hash_dispatcher d;
+	d.init(7);
+
+	for (uint64_t key = 1; key < 1000; key++) {
+		uint32_t q = d.dispatch(test_event::ID, key);
+		ASSERT_LT(q, 7u);
+		ASSERT_EQ(q, d.dispatch(test_event::ID, key));
+	}
+}
+
+TEST(dispatcher, jump_hash_moves_few_keys)
+{
+	const uint32_t keys = 100000;
+	uint32_t moved = 0;
+	for (uint64_t key = 1; key <= keys; key++) {
+		uint32_t a = sax::jump_hash_dispatcher::jump_hash(key, 10);
+		uint32_t b = sax::jump_hash_dispatcher::jump_hash(key, 11);
+		ASSERT_LT(a, 10u);
+		ASSERT_LT(b, 11u);
+		if (a != b) {
+			ASSERT_EQ(10u, b);	// keys only move to the new bucket
+			moved++;
+		}
+	}
+
+	// about 1/11 of the keys move
+	ASSERT_GT(moved, keys / 11 * 9 / 10);
+	ASSERT_LT(moved, keys / 11 * 11 / 10);
+}
+
+TEST(dispatcher, p2c_prefers_shorter_queue)
+{
+	sax::event_queue q0(64 * 1024);
+	sax::event_queue q1(64 * 1024);
+	sax::event_queue* queues[] = {&q0, &q1};
+
+	sax::p2c_dispatcher d;
+	d.attach(queues);
+	d.init(2);
+
+	for (int i = 0; i < 10; i++) {
+		sax::event_queue::commit_event(q0.allocate_event<test_event>(false));
+	}
+	ASSERT_EQ(10u, q0.size());
+
+	for (int i = 0; i < 100; i++) {
+		ASSERT_EQ(1u, d.dispatch(test_event::ID, 0));
+	}
+
+	// sharded events are hashed
+	uint32_t q = d.dispatch(test_event::ID, 12345);
+	for (int i = 0; i < 100; i++) {
+		ASSERT_EQ(q, d.dispatch(test_event::ID, 12345));
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////
+// benchmark: tail latency (from allocation to handling) under skewed load
+
+static const int32_t BENCH_EVENTS = 20000;
+static int64_t latency_us[BENCH_EVENTS];
+static volatile long handled_events = 0;
+
+class bench_handler : public sax::handler_base
+{
+public:
+	virtual bool init(void* param) { return true; }
+	virtual void on_event(const sax::event_type* ev)
+	{
+		const test_event* e = (const test_event*) ev;
+		int64_t end = g_now_us() + e->cost_us;
+		while (g_now_us() < end) g_thread_pause();
+		latency_us[e->index] = g_now_us() - e->start_us;
+		__sync_fetch_and_add(&handled_events, 1);
+	}
+};
+
+// zipf-like keys, the first keys are very hot
+static uint64_t skewed_key(uint32_t r)
+{
+	uint32_t x = r % 1024;
+	return (uint64_t) (x * x / 1024 / 16) + 1;
+}
+
+static void run_skewed(const char* name, sax::dispatcher_base* dispatcher, bool use_key)
+{
+	handled_events = 0;
+
+	sax::stage* st = sax::stage_creator<bench_handler>::create_stage(
+			name, 4, NULL, 1024 * 1024, dispatcher);
+	ASSERT_TRUE(st != NULL);
+
+	uint32_t r = 2463534242u;
+	for (int32_t i = 0; i < BENCH_EVENTS; i++) {
+		r ^= r << 13; r ^= r >> 17; r ^= r << 5;
+		uint64_t key = skewed_key(r);
+
+		test_event* ev = st->allocate_event<test_event>(use_key ? key : 0);
+		ev->index = i;
+		ev->cost_us = (r >> 24) < 3 ? 200 : 2;	// about 1% of events are expensive
+		ev->start_us = g_now_us();
+		st->push_event(ev);
+
+		if (i % 100 == 99) g_thread_sleep(0.0005);
+	}
+
+	while (handled_events < BENCH_EVENTS) g_thread_sleep(0.001);
+
+	std::vector<int64_t> lat(latency_us, latency_us + BENCH_EVENTS);
+	std::sort(lat.begin(), lat.end());
+	printf("%-12s p50: %6lld us, p99: %6lld us, p999: %6lld us, max: %6lld us\n", name,
+			(long long) lat[BENCH_EVENTS / 2],
+			(long long) lat[BENCH_EVENTS * 99 / 100],
+			(long long) lat[BENCH_EVENTS * 999 / 1000],
+			(long long) lat[BENCH_EVENTS - 1]);
+
+	st->signal_stop();
+	st->wait_for_stop();
+	sax::stage_mgr::get_instance()->unregister_stage(st);
+	delete st;
+}
+
+TEST(dispatcher, skewed_load_benchmark)
+{
+	run_skewed("round_robin", new sax::default_dispatcher(), false);
+	run_skewed("hash", new sax::hash_dispatcher(), true);
+	run_skewed("jump_hash", new sax::jump_hash_dispatcher(), true);
+	run_skewed("p2c", new sax::p2c_dispatcher(), false);
+}
+
+int main(int argc, char* argv[])
+{
+	testing::InitGoogleTest(&argc, argv);
+	return RUN_ALL_TESTS();
+}
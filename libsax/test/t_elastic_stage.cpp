@@ -0,0 +1,181 @@
+/*
+ * t_elastic_stage.cpp
+ *
+ *  Created on: 2012-9-14
+ *      Author: x
+ */
+
+#include "sax/stage/stage.h"
+#include "gtest/gtest.h"
+
+struct keyed_event : public sax::user_event_base<1, keyed_event>
+{
+	uint32_t key;
+	uint32_t seq;
+	int32_t cost_us;
+};
+
+static const uint32_t KEYS = 64;
+static uint32_t last_seq[KEYS];
+static volatile long out_of_order = 0;
+static volatile long handled_events = 0;
+
+class keyed_handler : public sax::handler_base
+{
+public:
+	virtual bool init(void* param) { return true; }
+	virtual void on_event(const sax::event_type* ev)
+	{
+		const keyed_event* e = (const keyed_event*) ev;
+		int64_t end = g_now_us() + e->cost_us;
+		while (g_now_us() < end) g_thread_pause();
+
+		if (last_seq[e->key] + 1 != e->seq) {
+			__sync_fetch_and_add(&out_of_order, 1);
+		}
+		last_seq[e->key] = e->seq;
+		__sync_fetch_and_add(&handled_events, 1);
+	}
+};
+
+static void reset()
+{
+	memset(last_seq, 0, sizeof(last_seq));
+	out_of_order = 0;
+	handled_events = 0;
+}
+
+static void push_keyed(sax::stage* st, uint32_t i, int32_t cost_us)
+{
+	static uint32_t seqs[KEYS];
+	if (i == 0) memset(seqs, 0, sizeof(seqs));
+
+	uint32_t key = (i * 2654435761u) % KEYS;
+	keyed_event* ev = st->allocate_event<keyed_event>(key + 1);
+	ev->key = key;
+	ev->seq = ++seqs[key];
+	ev->cost_us = cost_us;
+	st->push_event(ev);
+}
+
+static void stop_stage(sax::stage* st)
+{
+	st->signal_stop();
+	st->wait_for_stop();
+	sax::stage_mgr::get_instance()->unregister_stage(st);
+	delete st;
+}
+
+static volatile bool resizing_done = false;
+
+void* resize_loop(void* param)
+{
+	sax::stage* st = (sax::stage*) param;
+	const uint32_t sizes[] = {4, 2, 3, 1, 4, 1};
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		g_thread_sleep(0.01);
+		st->resize(sizes[i]);
+	}
+	resizing_done = true;
+	return 0;
+}
+
+// the shard keys keep their ordering while the workers come and go
+TEST(elastic_stage, resize_keeps_key_order)
+{
+	const uint32_t EVENTS = 20000;
+	reset();
+	resizing_done = false;
+
+	sax::stage_options options;
+	options.elastic = sax::elastic_policy(1, 4);
+	options.elastic.interval = 0;	// no controller, resize by hand
+
+	sax::stage* st = sax::stage_creator<keyed_handler>::create_stage(
+			"elastic_resize", 1, NULL, 64 * 1024, new sax::jump_hash_dispatcher(), options);
+	ASSERT_TRUE(st != NULL);
+	ASSERT_EQ(1u, st->active_threads());
+	ASSERT_FALSE(st->resize(5));
+
+	g_thread_t tid = g_thread_start(resize_loop, st);
+
+	uint32_t i = 0;
+	while (!resizing_done) {
+		push_keyed(st, i++, 2);
+		if (i % 64 == 0) g_thread_yield();
+	}
+	for (uint32_t j = 0; j < EVENTS; j++) {
+		push_keyed(st, i++, 0);
+	}
+	g_thread_join(tid, NULL);
+
+	while (handled_events < (long) i) g_thread_sleep(0.001);
+	ASSERT_EQ(0, out_of_order);
+	ASSERT_EQ(1u, st->active_threads());
+
+	std::vector<sax::stage_snapshot> snaps;
+	sax::stage_mgr::get_instance()->snapshot(snaps);
+	ASSERT_EQ(1u, snaps.size());
+	ASSERT_EQ((uint64_t) i, snaps[0].events);	// including the retired workers
+
+	stop_stage(st);
+}
+
+// a retired worker would drop its pending local timers
+TEST(elastic_stage, no_local_timers)
+{
+	sax::stage_options options;
+	options.elastic = sax::elastic_policy(1, 4);
+	options.elastic.interval = 0;
+	options.local_timers = true;
+
+	sax::single_dispatcher dispatcher;
+	ASSERT_TRUE(sax::stage_creator<keyed_handler>::create_stage(
+			"elastic_timers", 1, NULL, 64 * 1024, &dispatcher, options) == NULL);
+}
+
+// the controller adds workers under load and retires them when idle
+TEST(elastic_stage, grow_and_shrink)
+{
+	const uint32_t EVENTS = 3000;
+	reset();
+
+	sax::stage_options options;
+	options.elastic = sax::elastic_policy(1, 3);
+	options.elastic.grow_depth = 8;
+	options.elastic.interval = 0.01;
+	options.elastic.shrink_rounds = 3;
+	options.elastic.shrink_idle_ratio = 0.5;
+
+	sax::stage* st = sax::stage_creator<keyed_handler>::create_stage(
+			"elastic_auto", 1, NULL, 64 * 1024, new sax::hash_dispatcher(), options);
+	ASSERT_TRUE(st != NULL);
+
+	uint32_t max_active = 0;
+	for (uint32_t i = 0; i < EVENTS; i++) {
+		push_keyed(st, i, 100);
+		if (st->active_threads() > max_active) max_active = st->active_threads();
+	}
+	while (handled_events < (long) EVENTS) {
+		if (st->active_threads() > max_active) max_active = st->active_threads();
+		g_thread_sleep(0.001);
+	}
+	ASSERT_GT(max_active, 1u);
+	ASSERT_EQ(0, out_of_order);
+
+	int64_t start = g_now_ms();
+	while (st->active_threads() > 1 && g_now_ms() - start < 5000) {
+		g_thread_sleep(0.01);
+	}
+	ASSERT_EQ(1u, st->active_threads());
+	printf("max workers: %u, back to 1 worker in %lld ms\n",
+			max_active, (long long) (g_now_ms() - start));
+
+	stop_stage(st);
+}
+
+int main(int argc, char* argv[])
+{
+	testing::InitGoogleTest(&argc, argv);
+	return RUN_ALL_TESTS();
+}
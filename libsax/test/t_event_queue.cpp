@@ -202,6 +202,88 @@ TEST(event_queue, multi_allocate)
 	queue.destroy_event(ev3);
 }
 
+TEST(event_queue, pop_events)
+{
+	sax::event_queue queue((sizeof(test_event) + 8) * 3 + 8);
+	sax::event_type* evs[8];
+
+	ASSERT_EQ(0, queue.pop_events(evs, 8));
+
+	test_event* ev1 = queue.allocate_event<test_event>(false);
+	test_event* ev2 = queue.allocate_event<test_event>(false);
+	test_event* ev3 = queue.allocate_event<test_event>(false);
+
+	sax::event_queue::commit_event(ev1);
+	sax::event_queue::commit_event(ev3);
+
+	// stop at the uncommitted one
+	ASSERT_EQ(1, queue.pop_events(evs, 8));
+	ASSERT_EQ(ev1, evs[0]);
+
+	sax::event_queue::commit_event(ev2);
+
+	// events are not released until destroy_events()
+	ASSERT_EQ(3, queue.pop_events(evs, 8));
+	ASSERT_EQ(ev1, evs[0]);
+	ASSERT_EQ(ev2, evs[1]);
+	ASSERT_EQ(ev3, evs[2]);
+	ASSERT_EQ(NULL, queue.allocate_event<test_event>(false));
+
+	ASSERT_EQ(2, queue.pop_events(evs, 2));
+	queue.destroy_events(evs, 2);
+	ASSERT_EQ(ev3, queue.pop_event());
+
+	// roll back to the front
+	test_event* ev4 = queue.allocate_event<test_event>(false);
+	ASSERT_EQ(ev1, ev4);
+	sax::event_queue::commit_event(ev4);
+
+	ASSERT_EQ(2, queue.pop_events(evs, 8));
+	ASSERT_EQ(ev3, evs[0]);
+	ASSERT_EQ(ev4, evs[1]);
+	queue.destroy_events(evs, 2);
+
+	ASSERT_EQ(0, queue.pop_events(evs, 8));
+	ASSERT_EQ(NULL, queue.pop_event());
+}
+
+TEST(event_queue, claim_and_release)
+{
+	sax::event_queue queue((sizeof(test_event) + 8) * 3 + 8);
+
+	ASSERT_EQ(NULL, queue.claim_event(false));
+
+	test_event* ev1 = queue.allocate_event<test_event>(false);
+	test_event* ev2 = queue.allocate_event<test_event>(false, true);	// pinned
+	test_event* ev3 = queue.allocate_event<test_event>(false);
+	sax::event_queue::commit_event(ev1);
+	sax::event_queue::commit_event(ev2);
+	sax::event_queue::commit_event(ev3);
+
+	ASSERT_EQ(ev1, queue.claim_event(true));
+	ASSERT_EQ(NULL, queue.claim_event(true));	// can't steal a pinned event
+	ASSERT_EQ(ev2, queue.claim_event(false));
+	ASSERT_EQ(ev3, queue.claim_event(true));
+	ASSERT_EQ(NULL, queue.claim_event(false));
+
+	// space is not given back until the leading events are released
+	queue.release_event(ev2);
+	queue.release_event(ev3);
+	ASSERT_EQ(NULL, queue.allocate_event<test_event>(false));
+
+	queue.release_event(ev1);
+
+	// roll back to the front
+	test_event* ev4 = queue.allocate_event<test_event>(false);
+	ASSERT_EQ(ev1, ev4);
+	sax::event_queue::commit_event(ev4);
+	ASSERT_EQ(ev4, queue.claim_event(true));
+	queue.release_event(ev4);
+
+	ASSERT_EQ(NULL, queue.claim_event(false));
+	ASSERT_EQ(NULL, queue.pop_event());
+}
+
 void* wait_and_pop(void* param)
 {
 	sax::event_queue* queue = (sax::event_queue*) ((void**)param)[0];
@@ -253,6 +335,427 @@ TEST(event_queue, wait)
 	g_thread_join(tid, NULL);
 }
 
+void* delay_and_push(void* param)
+{
+	sax::event_queue* queue = (sax::event_queue*) ((void**)param)[0];
+	double sec = *(double*) ((void**)param)[1];
+
+	g_thread_sleep(sec);
+	test_event* ev = queue->allocate_event<test_event>(false);
+	sax::event_queue::commit_event(ev);	// wakes up the parked consumer
+
+	return 0;
+}
+
+TEST(event_queue, park_and_wake)
+{
+	sax::event_queue queue((sizeof(test_event) + 8) * 3);
+	double sec = 0.05;
+
+	// nothing to wake up, just return after the timeout
+	int64_t start = g_now_ms();
+	queue.park(0.05);
+	ASSERT_TRUE(g_now_ms() - start >= 50);
+
+	void* param[] = {&queue, &sec};
+	g_thread_t tid = g_thread_start(delay_and_push, param);
+
+	start = g_now_ms();
+	queue.park(2.0);	// should be woken up by the producer, far before the timeout
+	int64_t end = g_now_ms();
+	ASSERT_TRUE((end-start) < 500);
+
+	sax::event_type* ev = queue.pop_event();
+	ASSERT_TRUE(ev != NULL);
+	queue.destroy_event(ev);
+
+	g_thread_join(tid, NULL);
+
+	// return immediately if there is a committed event
+	ev = queue.allocate_event<test_event>(false);
+	sax::event_queue::commit_event(ev);
+	start = g_now_ms();
+	queue.park(2.0);
+	ASSERT_TRUE(g_now_ms() - start < 500);
+	ASSERT_EQ(ev, queue.pop_event());
+	queue.destroy_event(ev);
+}
+
+// in the shared consuming mode park() checks the claim cursor, and
+// never moves the free cursor under the claiming threads
+TEST(event_queue, park_when_claiming)
+{
+	sax::event_queue queue((sizeof(test_event) + 8) * 4);
+	ASSERT_EQ(NULL, queue.claim_event(false));
+
+	test_event* ev1 = queue.allocate_event<test_event>(false);
+	test_event* ev2 = queue.allocate_event<test_event>(false);
+	sax::event_queue::commit_event(ev1);
+	sax::event_queue::commit_event(ev2);
+	ASSERT_EQ(ev1, queue.claim_event(false));
+	EXPECT_TRUE(queue.has_event());
+
+	// ev2 is committed but not claimed yet, so it returns immediately
+	int64_t start = g_now_ms();
+	queue.park(2.0);
+	ASSERT_TRUE(g_now_ms() - start < 500);
+	EXPECT_EQ((int32_t) (sizeof(test_event) + 8) * 2, queue.used_bytes());
+	EXPECT_EQ(2u, queue.size());
+
+	ASSERT_EQ(ev2, queue.claim_event(true));
+	EXPECT_FALSE(queue.has_event());
+
+	// both claimed, nothing to do until the timeout
+	start = g_now_ms();
+	queue.park(0.05);
+	ASSERT_TRUE(g_now_ms() - start >= 50);
+
+	queue.release_event(ev2);
+	EXPECT_EQ(2u, queue.size());
+	queue.release_event(ev1);
+	EXPECT_EQ(0u, queue.size());
+	EXPECT_EQ(0, queue.used_bytes());
+}
+
+struct payload_event : public sax::user_event_base<125, payload_event>
+{
+	int32_t length;
+};
+
+TEST(event_queue, payload)
+{
+	const int32_t header = 8;
+	const int32_t base = sizeof(payload_event) + header;
+	sax::event_queue queue(1024);
+
+	// the block takes the event plus exactly the payload, aligned
+	payload_event* ev = queue.allocate_event_with_payload<payload_event>(0, false);
+	ASSERT_EQ(base, queue.used_bytes());
+	sax::event_queue::commit_event(ev);
+	queue.destroy_event(queue.pop_event());
+
+	ev = queue.allocate_event_with_payload<payload_event>(100, false);
+	ASSERT_EQ((base + 100 + 7) & ~7, queue.used_bytes());
+	sax::event_queue::commit_event(ev);
+	queue.destroy_event(queue.pop_event());
+
+	// write the payloads in place, they survive the wrap around
+	for (int32_t i = 0; i < 200; i++) {
+		int32_t len = (i * 37) % 300;
+		ev = queue.allocate_event_with_payload<payload_event>(len, false);
+		ASSERT_TRUE(ev != NULL);
+		ev->length = len;
+		memset(sax::event_payload(ev), (char) i, len);
+		sax::event_queue::commit_event(ev);
+
+		payload_event* got = (payload_event*) queue.pop_event();
+		ASSERT_EQ(ev, got);
+		ASSERT_EQ(len, got->length);
+		for (int32_t j = 0; j < len; j++) {
+			ASSERT_EQ((char) i, sax::event_payload(got)[j]);
+		}
+		queue.destroy_event(got);
+	}
+
+	ASSERT_EQ(NULL, queue.allocate_event_with_payload<payload_event>(1024, false));
+}
+
+struct counting_listener : public sax::watermark_listener
+{
+	counting_listener() : high(0), low(0) {}
+	virtual void on_high_watermark(sax::event_queue* queue) { high++; }
+	virtual void on_low_watermark(sax::event_queue* queue) { low++; }
+
+	int high;
+	int low;
+};
+
+TEST(event_queue, watermarks)
+{
+	const int32_t block = sizeof(test_event) + 8;
+	sax::event_queue queue(block * 10);
+	counting_listener listener;
+	queue.set_watermarks(block * 6, block * 2, &listener);
+
+	test_event* evs[10];
+	for (int i = 0; i < 5; i++) {
+		evs[i] = queue.allocate_event<test_event>(false);
+		sax::event_queue::commit_event(evs[i]);
+		ASSERT_FALSE(queue.congested());
+	}
+	ASSERT_EQ(block * 5, queue.used_bytes());
+
+	// crossing the high watermark fires the callback only once
+	for (int i = 5; i < 8; i++) {
+		evs[i] = queue.allocate_event<test_event>(false);
+		sax::event_queue::commit_event(evs[i]);
+		ASSERT_TRUE(queue.congested());
+	}
+	ASSERT_EQ(1, listener.high);
+	ASSERT_EQ(0, listener.low);
+
+	// still congested until the used space drops to the low watermark
+	for (int i = 0; i < 5; i++) {
+		ASSERT_EQ(evs[i], queue.pop_event());
+		queue.destroy_event(evs[i]);
+		ASSERT_TRUE(queue.congested());
+	}
+	ASSERT_EQ(evs[5], queue.pop_event());
+	queue.destroy_event(evs[5]);
+	ASSERT_FALSE(queue.congested());
+	ASSERT_EQ(1, listener.low);
+
+	for (int i = 6; i < 8; i++) {
+		ASSERT_EQ(evs[i], queue.pop_event());
+		queue.destroy_event(evs[i]);
+	}
+	ASSERT_EQ(0, queue.used_bytes());
+	ASSERT_EQ(1, listener.high);
+	ASSERT_EQ(1, listener.low);
+
+	// a failed non-blocking allocation also reports the congestion
+	sax::event_queue small(block + 8);
+	small.set_watermarks(block + 8, 0, &listener);
+	test_event* ev = small.allocate_event<test_event>(false);
+	ASSERT_FALSE(small.congested());
+	ASSERT_EQ(NULL, small.allocate_event<test_event>(false));
+	ASSERT_TRUE(small.congested());
+	ASSERT_EQ(2, listener.high);
+	sax::event_queue::commit_event(ev);
+	small.destroy_event(small.pop_event());
+	ASSERT_FALSE(small.congested());
+	ASSERT_EQ(2, listener.low);
+}
+
+void* slow_consumer(void* param)
+{
+	sax::event_queue* queue = (sax::event_queue*) ((void**)param)[0];
+	int32_t total = *(int32_t*) ((void**)param)[1];
+
+	for (int32_t i = 0; i < total; ) {
+		sax::event_type* ev = queue->pop_event();
+		if (ev == NULL) {
+			g_thread_sleep(0.001);
+			continue;
+		}
+		queue->destroy_event(ev);
+		i++;
+	}
+
+	return 0;
+}
+
+// blocked producers sleep on a condition and are woken up by the consumer
+TEST(event_queue, blocking_producer)
+{
+	sax::event_queue queue((sizeof(test_event) + 8) * 4);
+	int32_t total = 2000;
+
+	void* param[] = {&queue, &total};
+	g_thread_t tid = g_thread_start(slow_consumer, param);
+
+	for (int32_t i = 0; i < total; i++) {
+		test_event* ev = queue.allocate_event<test_event>(true);
+		ASSERT_TRUE(ev != NULL);
+		sax::event_queue::commit_event(ev);
+	}
+
+	g_thread_join(tid, NULL);
+	ASSERT_EQ(0u, queue.size());
+}
+
+static void* blocking_proc(void* param)
+{
+	sax::event_queue* queue = (sax::event_queue*) ((void**)param)[0];
+	int32_t count = *(int32_t*) ((void**)param)[1];
+
+	for (int32_t i = 0; i < count; i++) {
+		test_event* ev = queue->allocate_event<test_event>(true);
+		sax::event_queue::commit_event(ev);
+	}
+
+	return 0;
+}
+
+// the waits have no timeout, a missed wakeup would hang the producers
+TEST(event_queue, blocking_producers)
+{
+	sax::event_queue queue((sizeof(test_event) + 8) * 2);
+	int32_t count = 20000;
+
+	void* param[] = {&queue, &count};
+	g_thread_t tids[4];
+	for (int i = 0; i < 4; i++) {
+		tids[i] = g_thread_start(blocking_proc, param);
+	}
+
+	for (int32_t i = 0; i < 4 * count; ) {
+		sax::event_type* ev = queue.pop_event();
+		if (ev == NULL) {
+			g_thread_yield();
+			continue;
+		}
+		queue.destroy_event(ev);
+		i++;
+	}
+
+	for (int i = 0; i < 4; i++) {
+		g_thread_join(tids[i], NULL);
+	}
+	ASSERT_EQ(0u, queue.size());
+}
+
+struct bench_event : public sax::user_event_base<124, bench_event>
+{
+	int32_t producer;
+	int32_t seq;
+};
+
+// the allocation path before it became lock-free, used as the baseline
+struct spin_locked_queue
+{
+	spin_locked_queue(int32_t cap) : queue(cap), lock(128) {}
+
+	bench_event* allocate_event()
+	{
+		bench_event* ev;
+		while (1) {
+			lock.enter();
+			ev = queue.allocate_event<bench_event>(false);
+			lock.leave();
+			if (ev) return ev;
+			g_thread_yield();
+		}
+	}
+
+	sax::event_queue queue;
+	sax::spin_type lock;
+};
+
+struct lock_free_queue
+{
+	lock_free_queue(int32_t cap) : queue(cap) {}
+
+	bench_event* allocate_event()
+	{
+		bench_event* ev;
+		while ((ev = queue.allocate_event<bench_event>(false)) == NULL) {
+			g_thread_yield();
+		}
+		return ev;
+	}
+
+	sax::event_queue queue;
+};
+
+template <typename QUEUE>
+struct bench_param
+{
+	QUEUE* queue;
+	int32_t producer;
+	int32_t count;
+};
+
+template <typename QUEUE>
+void* bench_producer(void* param)
+{
+	bench_param<QUEUE>* p = (bench_param<QUEUE>*) param;
+	for (int32_t i = 0; i < p->count; i++) {
+		bench_event* ev = p->queue->allocate_event();
+		ev->producer = p->producer;
+		ev->seq = i;
+		sax::event_queue::commit_event(ev);
+	}
+	return 0;
+}
+
+// returns the elapsed time in milliseconds
+template <typename QUEUE>
+int64_t run_contention(int32_t producers, int32_t count_per_producer)
+{
+	QUEUE queue(64 * 1024);
+	bench_param<QUEUE>* params = new bench_param<QUEUE>[producers];
+	g_thread_t* threads = new g_thread_t[producers];
+	int32_t* next_seq = new int32_t[producers];
+
+	int64_t start = g_now_ms();
+
+	for (int32_t i = 0; i < producers; i++) {
+		params[i].queue = &queue;
+		params[i].producer = i;
+		params[i].count = count_per_producer;
+		next_seq[i] = 0;
+		threads[i] = g_thread_start(bench_producer<QUEUE>, &params[i]);
+	}
+
+	int64_t total = (int64_t) producers * count_per_producer;
+	bool in_order = true;
+	for (int64_t popped = 0; popped < total; ) {
+		sax::event_type* ev = queue.queue.pop_event();
+		if (ev == NULL) {
+			g_thread_yield();
+			continue;
+		}
+
+		bench_event* bev = (bench_event*) ev;
+		in_order &= (bev->seq == next_seq[bev->producer]);
+		next_seq[bev->producer] = bev->seq + 1;
+		queue.queue.destroy_event(ev);
+		popped++;
+	}
+
+	int64_t elapsed = g_now_ms() - start;
+
+	for (int32_t i = 0; i < producers; i++) {
+		g_thread_join(threads[i], NULL);
+	}
+
+	EXPECT_TRUE(in_order);
+	EXPECT_EQ(NULL, queue.queue.pop_event());
+
+	delete[] next_seq;
+	delete[] threads;
+	delete[] params;
+
+	return elapsed;
+}
+
+TEST(event_queue, contention_benchmark)
+{
+	const int32_t total = 400000;
+	for (int32_t producers = 1; producers <= 16; producers *= 2) {
+		int32_t count = total / producers;
+		int64_t spin_ms = run_contention<spin_locked_queue>(producers, count);
+		int64_t free_ms = run_contention<lock_free_queue>(producers, count);
+		printf("producers: %2d, events: %d, spin_lock: %4lld ms, lock_free: %4lld ms\n",
+				producers, total, (long long) spin_ms, (long long) free_ms);
+	}
+}
+
+TEST(event_queue, hugepage_arena)
+{
+	ASSERT_GT(g_shm_arena_init(1, 0), 0);
+
+	uint32_t base, used;
+	g_shm_arena_stat(&base, NULL);
+	{
+		sax::event_queue queue(g_shm_unit() * 3 + 1);
+		g_shm_arena_stat(&used, NULL);
+		EXPECT_EQ(4u, used - base);
+
+		test_event* ev = queue.allocate_event<test_event>(false);
+		sax::event_queue::commit_event(ev);
+		ASSERT_EQ(ev, queue.pop_event());
+		queue.destroy_event(ev);
+	}
+	g_shm_arena_stat(&used, NULL);
+	EXPECT_EQ(base, used);
+
+	// the later queues come from the heap again
+	ASSERT_EQ(1, g_shm_arena_fini());
+	ASSERT_EQ(0, g_shm_arena_stat(NULL, NULL));
+}
+
 int main(int argc, char* argv[])
 {
 	testing::InitGoogleTest(&argc, argv);
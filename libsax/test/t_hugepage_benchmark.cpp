@@ -0,0 +1,188 @@
+/*
+ * t_hugepage_benchmark.cpp
+ *
+ *  Created on: 2012-9-27
+ *      Author: x
+ */
+
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "sax/os_api.h"
+#include "sax/net/linked_buffer.h"
+
+using namespace sax;
+
+// a connection keeps "depth" blocks of data pending in both of its
+// buffers, so the working set is spread over lots of pages
+struct conn
+{
+	int fd[2];
+	linked_buffer out;
+	linked_buffer in;
+};
+
+static uint32_t block_size() { return g_shm_unit() - 8; }
+
+// send "length" bytes of "out" through the socket pair into "in"
+static bool transfer(conn* c, uint32_t length, bool use_socket, char* tmp)
+{
+	if (!c->out.flip()) return false;
+	while (length > 0) {
+		uint32_t limit;
+		char* ptr = c->out.direct_get(limit);
+		if (ptr == NULL) return false;
+		if (limit > length) limit = length;
+
+		if (use_socket) {
+			ssize_t n = write(c->fd[0], ptr, limit);
+			if (n <= 0) return false;
+			c->out.commit_get(ptr, (uint32_t) n);
+			for (ssize_t got = 0; got < n; ) {
+				ssize_t r = read(c->fd[1], tmp, n - got);
+				if (r <= 0) return false;
+				c->in.put((uint8_t*) tmp, (uint32_t) r);
+				got += r;
+			}
+			length -= (uint32_t) n;
+		}
+		else {
+			c->in.put((uint8_t*) ptr, limit);
+			c->out.commit_get(ptr, limit);
+			length -= limit;
+		}
+	}
+	return c->out.compact();
+}
+
+// consume the data of "in" beyond "keep" bytes
+static bool consume(conn* c, uint32_t keep, char* tmp, uint32_t tmp_size)
+{
+	uint32_t length = c->in.position();
+	if (length <= keep) return true;
+	length -= keep;
+
+	if (!c->in.flip()) return false;
+	while (length > 0) {
+		uint32_t n = length < tmp_size ? length : tmp_size;
+		if (!c->in.get((uint8_t*) tmp, n)) return false;
+		length -= n;
+	}
+	return c->in.compact();
+}
+
+static int run(bool use_arena, bool use_socket, int conns, int depth, int rounds, uint32_t msg_size)
+{
+	if (use_arena) {
+		size_t bytes = (size_t) conns * 2 * (depth + 4) * g_shm_unit();
+		int mode = g_shm_arena_init(bytes, 1);
+		if (mode == 0) {
+			printf("  failed to set up the arena\n");
+			return 1;
+		}
+		printf("  arena of %lu MB by %s\n", (unsigned long) (bytes >> 20),
+				mode == 2 ? "MAP_HUGETLB" : "THP madvise");
+	}
+
+	std::vector<char> msg(msg_size, 'm');
+	std::vector<char> tmp(msg_size);
+	std::vector<conn*> all;
+	uint32_t backlog = block_size() * depth;
+
+	for (int i = 0; i < conns; i++) {
+		conn* c = new conn();
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, c->fd) != 0) {
+			printf("  socketpair() failed, %d connections are opened\n", i);
+			return 1;
+		}
+		std::vector<char> fill(backlog, 'f');
+		c->out.put((uint8_t*) &fill[0], backlog);
+		c->in.put((uint8_t*) &fill[0], backlog);
+		all.push_back(c);
+	}
+
+	std::vector<int> order(conns);
+	for (int i = 0; i < conns; i++) order[i] = i;
+
+	int64_t bytes = 0;
+	int64_t start = g_now_us();
+	for (int r = 0; r < rounds; r++) {
+		std::random_shuffle(order.begin(), order.end());
+		for (int i = 0; i < conns; i++) {
+			conn* c = all[order[i]];
+			c->out.put((uint8_t*) &msg[0], msg_size);
+			if (!transfer(c, msg_size, use_socket, &tmp[0])
+					|| !consume(c, backlog, &tmp[0], msg_size)) {
+				printf("  failed to transfer\n");
+				return 1;
+			}
+			bytes += msg_size;
+		}
+	}
+	int64_t elapsed = g_now_us() - start;
+
+	uint32_t used = 0;
+	g_shm_arena_stat(&used, NULL);
+	printf("  %s %s: %lld bytes in %.3f s, %.1f MB/s, %u arena pages in use\n",
+			use_arena ? "arena" : "heap ", use_socket ? "socket" : "memory",
+			(long long) bytes, elapsed / 1e6, bytes / (elapsed + 1.0), used);
+
+	for (int i = 0; i < conns; i++) {
+		close(all[i]->fd[0]);
+		close(all[i]->fd[1]);
+		delete all[i];
+	}
+	return 0;
+}
+
+// the arena is process wide, so each case runs in a child process
+static void run_child(bool use_arena, bool use_socket, int conns, int depth, int rounds, uint32_t msg_size)
+{
+	fflush(stdout);
+	pid_t pid = fork();
+	if (pid == 0) {
+		srand(1);
+		int ret = run(use_arena, use_socket, conns, depth, rounds, msg_size);
+		fflush(stdout);
+		_exit(ret);
+	}
+	else if (pid > 0) {
+		int status;
+		waitpid(pid, &status, 0);
+	}
+	else {
+		printf("fork() failed\n");
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	if (argc < 2) {
+		printf("usage: %s rounds [connections] [depth in blocks] [message size]\n", argv[0]);
+		return 1;
+	}
+
+	int rounds = std::atoi(argv[1]);
+	int conns = argc > 2 ? std::atoi(argv[2]) : 256;
+	int depth = argc > 3 ? std::atoi(argv[3]) : 16;
+	uint32_t msg_size = argc > 4 ? (uint32_t) std::atoi(argv[4]) : 1460;
+	if (rounds <= 0 || conns <= 0 || depth < 0 || msg_size == 0) {
+		printf("invalid arguments\n");
+		return 1;
+	}
+
+	printf("%d rounds, %d connections, %d blocks pending per buffer, %u bytes per message\n",
+			rounds, conns, depth, msg_size);
+	for (int s = 0; s < 2; s++) {
+		run_child(false, s == 1, conns, depth, rounds, msg_size);
+		run_child(true, s == 1, conns, depth, rounds, msg_size);
+	}
+
+	return 0;
+}
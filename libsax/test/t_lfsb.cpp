@@ -0,0 +1,233 @@
+/*
+ * t_lfsb.cpp
+ *
+ *  Created on: 2012-9-29
+ *      Author: x
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <vector>
+#include <set>
+
+#include "gtest/gtest.h"
+#include "sax/mempool.h"
+#include "sax/sysutil.h"
+
+TEST(lfsb, alloc_and_free)
+{
+	long total = g_lfsb_needed(100, 4);
+	std::vector<uint64_t> region(total / 8 + 1);
+	EXPECT_EQ(NULL, g_lfsb_attach(&region[0]));
+	EXPECT_EQ(NULL, g_lfsb_init(&region[0], total - 1, 100, 4));
+
+	struct lfsb_pool_t* pool = g_lfsb_init(&region[0], total, 100, 4);
+	ASSERT_TRUE(pool != NULL);
+	EXPECT_EQ(pool, g_lfsb_attach(&region[0]));
+	EXPECT_EQ(100, g_lfsb_size(pool));
+	EXPECT_EQ(4, g_lfsb_count(pool));
+
+	std::set<void*> blocks;
+	for (int i = 0; i < 4; i++) {
+		char* p = (char*) g_lfsb_alloc(pool);
+		ASSERT_TRUE(p != NULL);
+		EXPECT_EQ(0u, (uintptr_t) p % 8);
+		memset(p, i, 100);
+		blocks.insert(p);
+	}
+	EXPECT_EQ(4u, blocks.size());
+	EXPECT_EQ(4, g_lfsb_used(pool));
+	EXPECT_EQ(NULL, g_lfsb_alloc(pool));
+
+	void* p = *blocks.begin();
+	uint64_t key = g_lfsb_getkey(pool, p);
+	EXPECT_NE(0u, key);
+	EXPECT_EQ(p, g_lfsb_getblock(pool, key));
+
+	EXPECT_EQ(-1, g_lfsb_free(pool, (char*) p + 1));
+	EXPECT_EQ(0, g_lfsb_free(pool, p));
+	EXPECT_EQ(-1, g_lfsb_free(pool, p));
+	EXPECT_EQ(0u, g_lfsb_getkey(pool, p));
+	EXPECT_EQ(NULL, g_lfsb_getblock(pool, key));
+	EXPECT_EQ(NULL, g_lfsb_getblock(pool, key + 1));
+	EXPECT_EQ(NULL, g_lfsb_getblock(pool, total * 2));
+	EXPECT_EQ(3, g_lfsb_used(pool));
+
+	EXPECT_EQ(p, g_lfsb_alloc(pool));
+	for (std::set<void*>::iterator it = blocks.begin(); it != blocks.end(); ++it) {
+		EXPECT_EQ(0, g_lfsb_free(pool, *it));
+	}
+	EXPECT_EQ(0, g_lfsb_used(pool));
+}
+
+// the same file mapped twice at different addresses
+TEST(lfsb, mapped_at_different_addresses)
+{
+	char fn[] = "/tmp/t_lfsb_XXXXXX";
+	int fd = mkstemp(fn);
+	ASSERT_GE(fd, 0);
+	close(fd);
+
+	uint32_t len = (uint32_t) g_lfsb_needed(64, 100);
+	shm_t* m1 = g_shm_open(fn, NULL, len, 0);
+	shm_t* m2 = g_shm_open(fn, NULL, len, 0);
+	ASSERT_TRUE(m1 != NULL && m2 != NULL);
+	ASSERT_NE(m1->ptr, m2->ptr);
+
+	struct lfsb_pool_t* p1 = g_lfsb_init(m1->ptr, len, 64, 100);
+	struct lfsb_pool_t* p2 = g_lfsb_attach(m2->ptr);
+	ASSERT_TRUE(p1 != NULL && p2 != NULL);
+
+	char* a = (char*) g_lfsb_alloc(p1);
+	strcpy(a, "from the first mapping");
+	char* b = (char*) g_lfsb_getblock(p2, g_lfsb_getkey(p1, a));
+	ASSERT_TRUE(b != NULL);
+	EXPECT_STREQ("from the first mapping", b);
+
+	char* c = (char*) g_lfsb_alloc(p2);
+	EXPECT_NE(a - (char*) m1->ptr, c - (char*) m2->ptr);
+	EXPECT_EQ(2, g_lfsb_used(p1));
+	EXPECT_EQ(0, g_lfsb_free(p2, b));
+	EXPECT_EQ(-1, g_lfsb_free(p1, a));
+	EXPECT_EQ(0, g_lfsb_free(p1, c + (m1->ptr - m2->ptr)));
+	EXPECT_EQ(0, g_lfsb_used(p2));
+
+	g_shm_close(m1);
+	g_shm_close(m2);
+	unlink(fn);
+}
+
+// every worker keeps a few blocks stamped with its id, and checks the
+// stamps before giving them back
+static int run_worker(struct lfsb_pool_t* pool, int id, int rounds)
+{
+	const int HOLD = 8;
+	uint32_t* held[HOLD];
+	int errors = 0;
+	for (int r = 0; r < rounds; r++) {
+		int n = 0;
+		for (; n < HOLD; n++) {
+			held[n] = (uint32_t*) g_lfsb_alloc(pool);
+			if (held[n] == NULL) break;
+			held[n][0] = id;
+			held[n][1] = r;
+		}
+		for (int i = 0; i < n; i++) {
+			if (held[i][0] != (uint32_t) id || held[i][1] != (uint32_t) r) errors++;
+			if (g_lfsb_free(pool, held[i]) != 0) errors++;
+		}
+	}
+	return errors;
+}
+
+static void* thread_worker(void* param)
+{
+	struct lfsb_pool_t* pool = (struct lfsb_pool_t*) param;
+	static long next_id = 0;
+	long errors = run_worker(pool, (int) __sync_fetch_and_add(&next_id, 1), 100000);
+	return (void*) errors;
+}
+
+TEST(lfsb, threads)
+{
+	const int THREADS = 4;
+	long total = g_lfsb_needed(16, 24);
+	std::vector<uint64_t> region(total / 8 + 1);
+	struct lfsb_pool_t* pool = g_lfsb_init(&region[0], total, 16, 24);
+
+	g_thread_t threads[THREADS];
+	for (int i = 0; i < THREADS; i++) {
+		threads[i] = g_thread_start(thread_worker, pool);
+	}
+	for (int i = 0; i < THREADS; i++) {
+		long errors = -1;
+		g_thread_join(threads[i], &errors);
+		EXPECT_EQ(0, errors);
+	}
+	EXPECT_EQ(0, g_lfsb_used(pool));
+}
+
+// the same work by processes, on an anonymous shared mapping.
+// the baseline is g_fsb serialized by a file lock
+static int64_t run_processes(int procs, int rounds, bool lock_free, int& errors)
+{
+	const int BLOCKS = 64;
+	uint32_t len = (uint32_t) std::max(g_lfsb_needed(16, BLOCKS), g_fsb_needed(16, BLOCKS));
+	shm_t* map = g_shm_open(NULL, NULL, len, 0);
+	if (map == NULL) return -1;
+
+	struct lfsb_pool_t* lf = NULL;
+	struct fsb_pool_t* fsb = NULL;
+	FILE* lock = NULL;
+	if (lock_free) {
+		lf = g_lfsb_init(map->ptr, len, 16, BLOCKS);
+	}
+	else {
+		fsb = g_fsb_init(map->ptr, len, 16, BLOCKS);
+		lock = tmpfile();
+	}
+
+	int64_t start = g_now_us();
+	std::vector<pid_t> pids;
+	for (int i = 0; i < procs; i++) {
+		pid_t pid = fork();
+		if (pid == 0) {
+			int errs = 0;
+			if (lock_free) {
+				errs = run_worker(g_lfsb_attach(map->ptr), i, rounds);
+			}
+			else {
+				for (int r = 0; r < rounds; r++) {
+					void* p;
+					{
+						sax::auto_flock guard(lock, 1);
+						p = g_fsb_alloc(fsb);
+					}
+					if (p == NULL) { errs++; continue; }
+					*(int*) p = i;
+					if (*(int*) p != i) errs++;
+					sax::auto_flock guard(lock, 1);
+					if (g_fsb_free(fsb, p) != 0) errs++;
+				}
+			}
+			_exit(errs > 0 ? 1 : 0);
+		}
+		pids.push_back(pid);
+	}
+
+	errors = 0;
+	for (size_t i = 0; i < pids.size(); i++) {
+		int status = -1;
+		if (pids[i] < 0 || waitpid(pids[i], &status, 0) < 0
+				|| !WIFEXITED(status) || WEXITSTATUS(status) != 0) errors++;
+	}
+	int64_t elapsed = g_now_us() - start;
+
+	if (lock_free && g_lfsb_used(lf) != 0) errors++;
+	if (!lock_free && g_fsb_used(fsb) != 0) errors++;
+	if (lock) fclose(lock);
+	g_shm_close(map);
+	return elapsed;
+}
+
+TEST(lfsb, processes)
+{
+	const int procs = 4, rounds = 20000;
+	int errors = 0;
+
+	// run_worker() does 8 allocations per round
+	int64_t lf_us = run_processes(procs, rounds / 8, true, errors);
+	EXPECT_EQ(0, errors);
+	int64_t lock_us = run_processes(procs, rounds, false, errors);
+	EXPECT_EQ(0, errors);
+
+	printf("%d processes x %d alloc/free, lock free: %lld us, g_fsb with flock: %lld us\n",
+			procs, rounds, (long long) lf_us, (long long) lock_us);
+}
+
+int main(int argc, char* argv[])
+{
+	testing::InitGoogleTest(&argc, argv);
+	return RUN_ALL_TESTS();
+}
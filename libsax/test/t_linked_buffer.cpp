@@ -514,6 +514,56 @@ TEST(buffer, direct_get)
 	EXPECT_EQ(0, limit_length);
 }
 
+TEST(buffer, hugepage_arena)
+{
+	char* before = (char*) g_shm_alloc_pages(1);	// from the heap
+
+	int mode = g_shm_arena_init(1, 1);
+	ASSERT_GT(mode, 0);
+	EXPECT_EQ(0, g_shm_arena_init(1, 1));
+
+	uint32_t base, used, total;
+	EXPECT_EQ(mode, g_shm_arena_stat(&base, &total));
+	EXPECT_EQ((2u << 20) / g_shm_unit(), total);
+
+	{
+		linked_buffer buf;
+		buf.reserve(BLOCK_SIZE * 3);
+		g_shm_arena_stat(&used, NULL);
+		EXPECT_EQ(4u, used - base);
+
+		char tmp[BLOCK_SIZE * 2];
+		memset(tmp, 'x', sizeof(tmp));
+		EXPECT_TRUE(buf.put((uint8_t*) tmp, sizeof(tmp)));
+		EXPECT_TRUE(buf.flip());
+		EXPECT_TRUE(buf.get((uint8_t*) tmp, sizeof(tmp)));
+		EXPECT_EQ(std::string(sizeof(tmp), 'x'), std::string(tmp, sizeof(tmp)));
+	}
+	g_shm_arena_stat(&used, NULL);
+	EXPECT_EQ(base, used);
+
+	// runs are recycled by their length, too long ones fall back to the heap
+	char* run = (char*) g_shm_alloc_pages(8);
+	g_shm_free_pages(run);
+	EXPECT_EQ(run, (char*) g_shm_alloc_pages(8));
+	char* big = (char*) g_shm_alloc_pages(total);
+	g_shm_arena_stat(&used, NULL);
+	EXPECT_EQ(8u, used - base);
+	big[0] = big[total * g_shm_unit() - 1] = 1;
+	g_shm_free_pages(big);
+	g_shm_free_pages(run);
+
+	g_shm_free_pages(before);
+	g_shm_arena_stat(&used, NULL);
+	EXPECT_EQ(base, used);
+
+	// not released while a page is in use
+	run = (char*) g_shm_alloc_pages(1);
+	EXPECT_EQ(0, g_shm_arena_fini());
+	g_shm_free_pages(run);
+	ASSERT_EQ(1, g_shm_arena_fini());
+	EXPECT_EQ(0, g_shm_arena_stat(NULL, NULL));
+}
 
 int main(int argc, char *argv[])
 {
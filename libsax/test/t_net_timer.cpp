@@ -0,0 +1,96 @@
+/*
+ * t_net_timer.cpp
+ *
+ *  Created on: 2012-9-24
+ *      Author: x
+ */
+
+#include <algorithm>
+#include <vector>
+
+#include "sax/net/netutil.h"
+#include "sax/os_api.h"
+#include "gtest/gtest.h"
+
+struct null_handler : public sax::transport_handler
+{
+	null_handler(sax::transport* trans) : sax::transport_handler(trans) {}
+
+	virtual void on_accepted(const sax::transport::id& new_conn,
+			const sax::transport::id& from, uint32_t ip_n, uint16_t port_h) {}
+	virtual void on_tcp_send(const sax::transport::id& tid, size_t send_bytes) {}
+	virtual void on_tcp_received(const sax::transport::id& tid, sax::linked_buffer* buf) {}
+	virtual void on_udp_received(const sax::transport::id& tid, const char* data,
+			size_t length, uint32_t ip_n, uint16_t port_h) {}
+	virtual void on_closed(const sax::transport::id& tid, int err) {}
+};
+
+struct pacing_state
+{
+	int64_t start_us;
+	uint32_t period_us;
+	std::vector<int64_t> lates;	// usec later than the schedule
+};
+
+static void pacing_proc(g_timer_handle_t handle, void* param)
+{
+	pacing_state* st = (pacing_state*) param;
+	int64_t due = st->start_us + (int64_t) (st->lates.size() + 1) * st->period_us;
+	st->lates.push_back(g_timerfd_now() - due);
+}
+
+static void once_proc(g_timer_handle_t handle, void* param)
+{
+	*(int64_t*) param = g_timerfd_now();
+}
+
+// the timers wake up poll() before its timeout, at sub-millisecond ticks
+TEST(transport, timer)
+{
+	sax::transport trans;
+	ASSERT_TRUE(trans.init(1024, new null_handler(&trans)));
+	ASSERT_TRUE(trans.timer() == NULL);
+	ASSERT_TRUE(trans.enable_timer(50));	// 50us ticks
+	ASSERT_FALSE(trans.enable_timer(50));
+
+	// one-shot, 300us
+	int64_t fired_us = 0;
+	int64_t start = g_timerfd_now();
+	ASSERT_TRUE(NULL != g_timer_start(trans.timer(), 6, once_proc, &fired_us));
+	while (fired_us == 0 && g_timerfd_now() - start < 1000000) {
+		trans.poll(100);
+	}
+	ASSERT_NE(0, fired_us);
+	ASSERT_GE(fired_us - start, 250);
+	ASSERT_LT(fired_us - start, 50000);	// far less than the poll timeout
+
+	// periodic, 500us
+	pacing_state st;
+	st.start_us = g_timerfd_now();
+	st.period_us = 500;
+	g_timer_handle_t h = g_timer_start_periodic(trans.timer(), 10, 10, pacing_proc, &st);
+	ASSERT_TRUE(h != NULL);
+	while (st.lates.size() < 200) {
+		trans.poll(100);
+	}
+	ASSERT_EQ(0, g_timer_cancel(trans.timer(), h, NULL));
+
+	std::sort(st.lates.begin(), st.lates.end());
+	printf("500us pacing, late p50 %lld us, p99 %lld us, max %lld us\n",
+			(long long) st.lates[st.lates.size() / 2],
+			(long long) st.lates[st.lates.size() * 99 / 100],
+			(long long) st.lates.back());
+	ASSERT_GE(st.lates.front(), -50);	// never early, within a tick
+	ASSERT_LT(st.lates[st.lates.size() / 2], 5000);
+
+	// nothing pending, poll() waits for its timeout
+	start = g_timerfd_now();
+	trans.poll(20);
+	ASSERT_GE(g_timerfd_now() - start, 15000);
+}
+
+int main(int argc, char* argv[])
+{
+	testing::InitGoogleTest(&argc, argv);
+	return RUN_ALL_TESTS();
+}
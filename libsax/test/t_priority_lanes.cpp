@@ -0,0 +1,131 @@
+/*
+ * t_priority_lanes.cpp
+ *
+ *  Created on: 2012-9-19
+ *      Author: x
+ */
+
+#include "sax/stage/stage.h"
+#include "gtest/gtest.h"
+
+struct gate_event : public sax::user_event_base<1, gate_event> {};
+struct bulk_event : public sax::user_event_base<2, bulk_event>
+{
+	int32_t cost_us;
+};
+struct timeout_event : public sax::user_event_base<3, timeout_event> {};
+
+static volatile bool gate_open = false;
+static volatile bool gate_entered = false;
+static volatile long handled_events = 0;
+static char handled_order[64];
+
+class lane_handler : public sax::handler_base
+{
+public:
+	virtual bool init(void* param) { return true; }
+
+	void record(char lane)
+	{
+		if (handled_events < (long) sizeof(handled_order) - 1) {
+			handled_order[handled_events] = lane;
+		}
+	}
+
+	virtual void on_event(const sax::event_type* ev)
+	{
+		if (dynamic_cast<const gate_event*>(ev)) {
+			gate_entered = true;
+			while (!gate_open) g_thread_sleep(0.001);
+		}
+		else if (const bulk_event* e = dynamic_cast<const bulk_event*>(ev)) {
+			int64_t end = g_now_us() + e->cost_us;
+			while (g_now_us() < end) g_thread_pause();
+			record('N');
+		}
+		else if (dynamic_cast<const timeout_event*>(ev)) {
+			record('H');
+		}
+		__sync_fetch_and_add(&handled_events, 1);
+	}
+};
+
+static void reset()
+{
+	gate_open = false;
+	gate_entered = false;
+	handled_events = 0;
+	memset(handled_order, 0, sizeof(handled_order));
+}
+
+static void push_bulk(sax::stage* st, int32_t cost_us)
+{
+	bulk_event* ev = st->allocate_event<bulk_event>();
+	ev->cost_us = cost_us;
+	st->push_event(ev);
+}
+
+static void push_timeout(sax::stage* st)
+{
+	st->push_event(st->allocate_event<timeout_event>(0, true, sax::PRIORITY_HIGH));
+}
+
+static void stop_stage(sax::stage* st)
+{
+	st->signal_stop();
+	st->wait_for_stop();
+	sax::stage_mgr::get_instance()->unregister_stage(st);
+	delete st;
+}
+
+TEST(priority_lanes, weighted_draining)
+{
+	reset();
+
+	sax::stage_options options;
+	options.high_lane_bytes = 64 * 1024;
+	options.high_lane_weight = 4;
+	sax::stage* st = sax::stage_creator<lane_handler>::create_stage(
+			"lanes", 1, NULL, 64 * 1024, new sax::single_dispatcher(), options);
+	ASSERT_TRUE(st != NULL);
+
+	st->push_event(st->allocate_event<gate_event>());
+	while (!gate_entered) g_thread_sleep(0.001);
+
+	for (int i = 0; i < 8; i++) push_timeout(st);
+	for (int i = 0; i < 2; i++) push_bulk(st, 0);
+
+	gate_open = true;
+	while (handled_events < 11) g_thread_sleep(0.001);
+
+	// the gate, then at most 4 high events in a row
+	ASSERT_STREQ("HHHHNHHHHN", handled_order + 1);
+
+	stop_stage(st);
+}
+
+TEST(priority_lanes, no_lane)
+{
+	reset();
+
+	// PRIORITY_HIGH falls back to the normal lane
+	sax::stage* st = sax::stage_creator<lane_handler>::create_stage(
+			"no_lanes", 1, NULL, 64 * 1024, new sax::single_dispatcher());
+	ASSERT_TRUE(st != NULL);
+
+	st->push_event(st->allocate_event<gate_event>());
+	while (!gate_entered) g_thread_sleep(0.001);
+	push_bulk(st, 0);
+	push_timeout(st);
+	gate_open = true;
+	while (handled_events < 3) g_thread_sleep(0.001);
+	ASSERT_STREQ("NH", handled_order + 1);
+
+	stop_stage(st);
+}
+
+int main(int argc, char* argv[])
+{
+	testing::InitGoogleTest(&argc, argv);
+	return RUN_ALL_TESTS();
+}
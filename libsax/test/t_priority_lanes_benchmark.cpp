@@ -0,0 +1,99 @@
+/*
+ * t_priority_lanes_benchmark.cpp
+ *
+ *  Created on: 2012-9-19
+ *      Author: x
+ */
+
+#include <cstdlib>
+#include <cstdio>
+#include <vector>
+#include <algorithm>
+
+#include "sax/stage/stage.h"
+
+struct bulk_event : public sax::user_event_base<2, bulk_event>
+{
+	int32_t cost_us;
+};
+struct timeout_event : public sax::user_event_base<3, timeout_event>
+{
+	int64_t sent_us;
+};
+
+static volatile long handled_events = 0;
+static std::vector<int64_t> timeout_delays;
+
+class lane_handler : public sax::handler_base
+{
+public:
+	virtual bool init(void* param) { return true; }
+
+	virtual void on_event(const sax::event_type* ev)
+	{
+		if (const bulk_event* e = dynamic_cast<const bulk_event*>(ev)) {
+			int64_t end = g_now_us() + e->cost_us;
+			while (g_now_us() < end) g_thread_pause();
+		}
+		else if (const timeout_event* e = dynamic_cast<const timeout_event*>(ev)) {
+			timeout_delays.push_back(g_now_us() - e->sent_us);
+		}
+		__sync_fetch_and_add(&handled_events, 1);
+	}
+};
+
+// the delay of timeout events pushed while the stage is flooded
+// by bulk events of "cost_us" each, returns the p50 in usec
+static int64_t timeout_latency(bool high_lane, int32_t bulk, int32_t cost_us)
+{
+	const int32_t TIMEOUTS = 40;
+	handled_events = 0;
+	timeout_delays.clear();
+
+	sax::stage_options options;
+	if (high_lane) options.high_lane_bytes = 64 * 1024;
+	sax::stage* st = sax::stage_creator<lane_handler>::create_stage(
+			high_lane ? "bench_lanes" : "bench_no_lanes", 1, NULL, 1024 * 1024,
+			new sax::single_dispatcher(), options);
+	if (st == NULL) return -1;
+
+	for (int32_t i = 0; i < bulk; i++) {
+		bulk_event* ev = st->allocate_event<bulk_event>();
+		ev->cost_us = cost_us;
+		st->push_event(ev);
+		if (i % (bulk / TIMEOUTS) == 0) {
+			timeout_event* tev = st->allocate_event<timeout_event>(0, true, sax::PRIORITY_HIGH);
+			tev->sent_us = g_now_us();
+			st->push_event(tev);
+		}
+	}
+	while (handled_events < bulk + TIMEOUTS) g_thread_sleep(0.001);
+
+	st->signal_stop();
+	st->wait_for_stop();
+	sax::stage_mgr::get_instance()->unregister_stage(st);
+	delete st;
+
+	std::sort(timeout_delays.begin(), timeout_delays.end());
+	int64_t p50 = timeout_delays[timeout_delays.size() / 2];
+	printf("%s: timeout delay p50 %lld us, p99 %lld us, max %lld us\n",
+			high_lane ? "high lane" : "one lane", (long long) p50,
+			(long long) timeout_delays[timeout_delays.size() * 99 / 100],
+			(long long) timeout_delays.back());
+	return p50;
+}
+
+int main(int argc, char* argv[])
+{
+	int32_t bulk = argc > 1 ? std::atoi(argv[1]) : 4000;
+	int32_t cost_us = argc > 2 ? std::atoi(argv[2]) : 20;
+	if (bulk < 40 || cost_us < 0) {
+		printf("usage: %s [bulk_events >= 40] [cost_us]\n", argv[0]);
+		return 1;
+	}
+
+	timeout_latency(false, bulk, cost_us);
+	timeout_latency(true, bulk, cost_us);
+
+	return 0;
+}
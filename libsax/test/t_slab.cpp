@@ -7,6 +7,8 @@
 
 #include "gtest/gtest.h"
 #include "sax/slabutil.h"
+#include <vector>
+#include <map>
 
 using namespace sax;
 
@@ -60,14 +62,168 @@ TEST(slab_mgr, shrink_slabs)
 			{
 				slab_t slab3(16);
 
+				// the rest of the batch carved for the magazine is free, too
+				int32_t usable = slab1.get_usable_amount();
+				ASSERT_EQ(slab_t::MAGAZINE_BATCH, usable);
+
 				slab_mgr::get_instance()->shrink_slabs(0.9);
 
-				ASSERT_EQ(1, slab1.get_shrink_amount());
+				// the current chunk is kept, nothing is left pending
+				ASSERT_EQ(usable, slab1.get_usable_amount());
+				ASSERT_EQ(0, slab1.get_shrink_amount());
 			}
 		}
 	}
 }
 
+static const slab_snapshot* find_snapshot(const std::vector<slab_snapshot>& snaps,
+		const char* name)
+{
+	for (size_t i = 0; i < snaps.size(); i++) {
+		if (strcmp(snaps[i].name, name) == 0) return &snaps[i];
+	}
+	return NULL;
+}
+
+static volatile long samples = 0;
+static volatile uint64_t sampled_in_use = 0;
+
+static void sample_proc(const std::vector<slab_snapshot>& snaps, void* param)
+{
+	const slab_snapshot* s = find_snapshot(snaps, (const char*) param);
+	if (s != NULL) sampled_in_use = s->in_use;
+	__sync_fetch_and_add(&samples, 1);
+}
+
+TEST(slab_mgr, stats)
+{
+	slab_t slab(100, "stats_test");
+	std::vector<void*> ptrs;
+	for (int i = 0; i < 1000; i++) ptrs.push_back(slab.alloc());
+	for (int i = 0; i < 400; i++) slab.free(ptrs[i]);
+
+	std::vector<slab_snapshot> snaps;
+	slab_mgr::get_instance()->snapshot(snaps);
+	const slab_snapshot* s = find_snapshot(snaps, "stats_test");
+	ASSERT_TRUE(s != NULL);
+	ASSERT_EQ(104, s->alloc_size);
+	ASSERT_EQ(1000u, s->allocs);
+	ASSERT_EQ(400u, s->frees);
+	ASSERT_EQ(600u, s->in_use);
+	ASSERT_GT(s->chunk_allocs, 0u);
+	ASSERT_EQ(s->chunk_allocs * 4096, s->bytes_held);
+	ASSERT_EQ(s->bytes_held, s->bytes_high_water);
+
+	// served by the magazine, no refill
+	for (int i = 0; i < 10; i++) slab.free(slab.alloc());
+	slab_mgr::get_instance()->snapshot(snaps);
+	ASSERT_EQ(s->refills, find_snapshot(snaps, "stats_test")->refills);
+	ASSERT_GT(find_snapshot(snaps, "stats_test")->hit_rate, 0.0);
+
+	for (int i = 400; i < 1000; i++) slab.free(ptrs[i]);
+	slab.shrink(0.0);
+	slab_mgr::get_instance()->snapshot(snaps);
+	s = find_snapshot(snaps, "stats_test");
+	ASSERT_EQ(0u, s->in_use);
+	ASSERT_EQ(1u, s->shrinks);
+	ASSERT_GT(s->chunk_frees, 0u);
+	ASSERT_LT(s->bytes_held, s->bytes_high_water);
+
+	std::string out;
+	slab_mgr::get_instance()->dump_stats(out);
+	ASSERT_NE(std::string::npos, out.find("stats_test: alloc_size=104 allocs=1010"));
+	out.clear();
+	slab_mgr::get_instance()->dump_stats(out, true);
+	ASSERT_NE(std::string::npos, out.find("{\"name\":\"stats_test\",\"alloc_size\":104,"));
+
+	ptrs[0] = slab.alloc();
+	ASSERT_TRUE(slab_mgr::get_instance()->start_sampling(0.01, sample_proc, (void*) "stats_test"));
+	ASSERT_FALSE(slab_mgr::get_instance()->start_sampling(0.01, sample_proc, NULL));
+	while (samples < 3) g_thread_sleep(0.001);
+	slab_mgr::get_instance()->stop_sampling();
+	ASSERT_EQ(1u, sampled_in_use);
+	slab.free(ptrs[0]);
+}
+
+TEST(slab_mgr, reclaim)
+{
+	slab_t slab(100, "reclaim_test");
+	std::vector<void*> ptrs;
+	for (int i = 0; i < 10000; i++) ptrs.push_back(slab.alloc());
+
+	reclaim_policy policy;
+	policy.idle_sec = 0;
+	policy.alpha = 0.5;
+	policy.max_step = 0.5;
+
+	// the blocks in use are never touched
+	std::vector<slab_snapshot> snaps;
+	slab_mgr::get_instance()->snapshot(snaps);
+	uint64_t held = find_snapshot(snaps, "reclaim_test")->bytes_held;
+	for (int i = 0; i < 5; i++) slab_mgr::get_instance()->reclaim(policy);
+	slab_mgr::get_instance()->snapshot(snaps);
+	ASSERT_EQ(held, find_snapshot(snaps, "reclaim_test")->bytes_held);
+
+	// a spike is over, half of the free blocks are given back at a time
+	for (int i = 0; i < 9000; i++) slab.free(ptrs[i]);
+	slab_mgr::get_instance()->reclaim(policy);
+	slab_mgr::get_instance()->snapshot(snaps);
+	const slab_snapshot* s = find_snapshot(snaps, "reclaim_test");
+	ASSERT_LT(s->bytes_held, held * 6 / 10);
+	ASSERT_GT(s->bytes_held, held * 4 / 10);
+	// nothing is left pending, the frees still go to the thread cache
+	ASSERT_EQ(0, slab.get_shrink_amount());
+
+	for (int i = 0; i < 10; i++) slab_mgr::get_instance()->reclaim(policy);
+	slab_mgr::get_instance()->snapshot(snaps);
+	s = find_snapshot(snaps, "reclaim_test");
+	ASSERT_LT(s->bytes_held, held * 2 / 10);
+	// the headroom: 25% of the blocks in use are kept free
+	ASSERT_GE(slab.get_usable_amount(), 1000 / 4 - 20);
+
+	for (int i = 9000; i < 10000; i++) slab.free(ptrs[i]);
+
+	// a live block in every chunk keeps the chunks, and their free blocks
+	slab_t slab3(100, "reclaim_test3");
+	for (int i = 0; i < 10000; i++) ptrs[i] = slab3.alloc();
+	for (int i = 0; i < 10000; i++) {
+		if (i % 20 != 0) slab3.free(ptrs[i]);
+	}
+	slab_mgr::get_instance()->snapshot(snaps);
+	held = find_snapshot(snaps, "reclaim_test3")->bytes_held;
+	for (int i = 0; i < 10; i++) slab_mgr::get_instance()->reclaim(policy);
+	slab_mgr::get_instance()->snapshot(snaps);
+	ASSERT_EQ(held, find_snapshot(snaps, "reclaim_test3")->bytes_held);
+	ASSERT_EQ(0, slab3.get_shrink_amount());
+	int32_t usable = slab3.get_usable_amount();
+	for (int i = 0; i < 10000; i += 20) slab3.free(ptrs[i]);
+	ASSERT_EQ(usable + 500, slab3.get_usable_amount());
+
+	// in the background, after an idle period
+	slab_t slab2(200, "reclaim_test2");
+	for (int i = 0; i < 10000; i++) ptrs[i] = slab2.alloc();
+	for (int i = 0; i < 10000; i++) slab2.free(ptrs[i]);
+	slab_mgr::get_instance()->snapshot(snaps);
+	held = find_snapshot(snaps, "reclaim_test2")->bytes_held;
+
+	policy.interval = 0.01;
+	policy.idle_sec = 0.05;
+	ASSERT_TRUE(slab_mgr::get_instance()->start_reclaiming(policy));
+	ASSERT_FALSE(slab_mgr::get_instance()->start_reclaiming(policy));
+	int64_t start = g_now_ms();
+	do {
+		g_thread_sleep(0.01);
+		slab_mgr::get_instance()->snapshot(snaps);
+		s = find_snapshot(snaps, "reclaim_test2");
+	} while (s->bytes_held > held / 10 && g_now_ms() - start < 5000);
+	slab_mgr::get_instance()->stop_reclaiming();
+	ASSERT_LE(s->bytes_held, held / 10);
+	ASSERT_GE(g_now_ms() - start, 50);
+	printf("reclaimed %llu of %llu bytes in %lld ms\n",
+			(unsigned long long) (held - s->bytes_held), (unsigned long long) held,
+			(long long) (g_now_ms() - start));
+}
+
 TEST(slab, basic_test)
 {
 	{
@@ -77,22 +233,24 @@ TEST(slab, basic_test)
 
 		void* ptr = slab.alloc();
 
-		ASSERT_EQ((size_t) 0, slab.get_usable_amount());
+		// a batch is carved for the magazine at once
+		const int32_t batch = slab_t::MAGAZINE_BATCH;
+		ASSERT_EQ(batch - 1, slab.get_usable_amount());
 		ASSERT_EQ((size_t) 0, slab.get_shrink_amount());
 
 		slab.free(ptr);
 
-		ASSERT_EQ((size_t) 1, slab.get_usable_amount());
+		ASSERT_EQ(batch, slab.get_usable_amount());
 		ASSERT_EQ((size_t) 0, slab.get_shrink_amount());
 
 		ptr = slab.alloc();
 
-		ASSERT_EQ((size_t) 0, slab.get_usable_amount());
+		ASSERT_EQ(batch - 1, slab.get_usable_amount());
 		ASSERT_EQ((size_t) 0, slab.get_shrink_amount());
 
 		void* ptr2 = slab.alloc();
 
-		ASSERT_EQ((size_t) 0, slab.get_usable_amount());
+		ASSERT_EQ(batch - 2, slab.get_usable_amount());
 		ASSERT_EQ((size_t) 0, slab.get_shrink_amount());
 
 		slab.free(ptr2);
@@ -109,58 +267,370 @@ TEST(slab, basic_test)
 
 TEST(slab, shrink)
 {
-	slab_t slab(128);
+	slab_t slab(128, "shrink_test");
 	void* ptr = slab.alloc();
 
 	ASSERT_EQ(0, slab.get_shrink_amount());
 
+	// the magazine goes back, the rest of its batch is free. the chunks
+	// have a block in use, they are kept
+	int32_t usable = slab.get_usable_amount();
 	slab.shrink(0.9);
-
+	ASSERT_EQ(usable, slab.get_usable_amount());
 	ASSERT_EQ(0, slab.get_shrink_amount());
 
+	// free now, released by the next shrink
 	slab.free(ptr);
-	slab.shrink(0.9);
-
-	ASSERT_EQ(1, slab.get_shrink_amount());
-
-	ptr = slab.alloc();
-	slab.free(ptr);
-
-	ASSERT_EQ(0, slab.get_usable_amount());
+	slab.shrink(0.0);
 	ASSERT_EQ(0, slab.get_shrink_amount());
+	ASSERT_LT(slab.get_usable_amount(), usable);
 
 	{
-		void* ptrs[10];
+		// 10 chunks of 31 blocks
+		void* ptrs[310];
 		for (size_t i = 0; i < sizeof(ptrs) / sizeof(ptrs[0]); i++) {
 			ptrs[i] = slab.alloc();
 		}
 
+		// one block in use for every chunk
 		for (size_t i = 0; i < sizeof(ptrs) / sizeof(ptrs[0]); i++) {
-			slab.free(ptrs[i]);
+			if (i % 31 != 0) slab.free(ptrs[i]);
 		}
 
 		slab.shrink(0.6);
 
-		ASSERT_EQ(4, slab.get_shrink_amount());
+		std::vector<slab_snapshot> snaps;
+		slab_mgr::get_instance()->snapshot(snaps);
+		uint64_t held = find_snapshot(snaps, "shrink_test")->bytes_held;
+		ASSERT_EQ(0, slab.get_shrink_amount());
 
-		for (size_t i = 0; i < sizeof(ptrs) / sizeof(ptrs[0]); i++) {
-			ptrs[i] = slab.alloc();
+		// the blocks freed meanwhile are used again, no chunk is added
+		for (int round = 0; round < 10; round++) {
+			for (size_t i = 0; i < sizeof(ptrs) / sizeof(ptrs[0]); i++) {
+				if (i % 31 != 0) ptrs[i] = slab.alloc();
+			}
+			for (size_t i = 0; i < sizeof(ptrs) / sizeof(ptrs[0]); i++) {
+				if (i % 31 != 0) slab.free(ptrs[i]);
+			}
 		}
+		slab_mgr::get_instance()->snapshot(snaps);
+		ASSERT_EQ(held, find_snapshot(snaps, "shrink_test")->bytes_held);
 
-		for (size_t i = 0; i < sizeof(ptrs) / sizeof(ptrs[0]); i++) {
+		// the chunks go by the next shrink after their last blocks come back
+		for (size_t i = 0; i < sizeof(ptrs) / sizeof(ptrs[0]); i += 31) {
 			slab.free(ptrs[i]);
 		}
+		slab.shrink(0.6);
 
-		ASSERT_EQ(6, slab.get_usable_amount());
 		ASSERT_EQ(0, slab.get_shrink_amount());
+		slab_mgr::get_instance()->snapshot(snaps);
+		ASSERT_LT(find_snapshot(snaps, "shrink_test")->bytes_held, held);
+	}
+}
+
+TEST(xslab, chunks)
+{
+	g_xslab_t* slab = g_xslab_init(24);
+	ASSERT_EQ(4096, g_xslab_chunk_size(slab));
+	ASSERT_EQ(0, g_xslab_chunk_count(slab));
+
+	// carved one after another
+	std::vector<char*> ptrs;
+	for (int i = 0; i < 1000; i++) {
+		ptrs.push_back((char*) g_xslab_alloc(slab));
+	}
+	ASSERT_EQ(ptrs[0] + 24, ptrs[1]);
+	int32_t chunks = g_xslab_chunk_count(slab);
+	ASSERT_GE(chunks, 1000 * 24 / 4096);
+	ASSERT_LE(chunks, 1000 * 24 / 4096 + 2);
+	ASSERT_EQ(0, g_xslab_usable_amount(slab));
+
+	for (int i = 0; i < 1000; i++) g_xslab_free(slab, ptrs[i]);
+	ASSERT_EQ(1000, g_xslab_usable_amount(slab));
+
+	// all chunks but the current one go away at once
+	g_xslab_shrink(slab, 0.0);
+	ASSERT_EQ(1, g_xslab_chunk_count(slab));
+	ASSERT_LT(g_xslab_usable_amount(slab), 4096 / 24);
+	g_xslab_destroy(slab);
+
+	// a chunk in use goes away by a shrink after its last block comes back
+	slab = g_xslab_init(24);
+	for (int i = 0; i < 1000; i++) ptrs[i] = (char*) g_xslab_alloc(slab);
+	for (int i = 0; i < 500; i++) g_xslab_free(slab, ptrs[i]);
+	g_xslab_shrink(slab, 0.0);
+	chunks = g_xslab_chunk_count(slab);
+	for (int i = 500; i < 1000; i++) g_xslab_free(slab, ptrs[i]);
+	g_xslab_shrink(slab, 0.0);
+	ASSERT_LT(g_xslab_chunk_count(slab), chunks);
+	ASSERT_EQ(1, g_xslab_chunk_count(slab));
+	g_xslab_destroy(slab);
+}
+
+// the chunks with blocks in use are kept with their free blocks,
+// and nothing is left pending for the later frees
+TEST(xslab, shrink_with_live_blocks)
+{
+	g_xslab_t* slab = g_xslab_init(24);
+
+	// 10 full chunks
+	std::vector<char*> ptrs;
+	ptrs.push_back((char*) g_xslab_alloc(slab));
+	while (g_xslab_chunk_count(slab) == 1) ptrs.push_back((char*) g_xslab_alloc(slab));
+	size_t per_chunk = ptrs.size() - 1;
+	g_xslab_free(slab, ptrs.back());
+	ptrs.pop_back();
+	while (ptrs.size() < per_chunk * 10) ptrs.push_back((char*) g_xslab_alloc(slab));
+	ASSERT_EQ(10, g_xslab_chunk_count(slab));
+
+	// a long-lived block in every chunk
+	std::vector<char*> live;
+	for (size_t i = 0; i < ptrs.size(); i++) {
+		if (i % per_chunk == per_chunk / 2) live.push_back(ptrs[i]);
+		else g_xslab_free(slab, ptrs[i]);
+	}
+	int32_t usable = g_xslab_usable_amount(slab);
+	g_xslab_shrink(slab, 0.0);
+	ASSERT_EQ(10, g_xslab_chunk_count(slab));
+	ASSERT_EQ(usable, g_xslab_usable_amount(slab));
+	ASSERT_EQ(0, g_xslab_shrink_amount(slab));
+
+	std::vector<void*> work(620);
+	for (int round = 0; round < 10; round++) {
+		for (size_t i = 0; i < work.size(); i++) work[i] = g_xslab_alloc(slab);
+		for (size_t i = 0; i < work.size(); i++) g_xslab_free(slab, work[i]);
+	}
+	ASSERT_EQ(10, g_xslab_chunk_count(slab));
+	ASSERT_EQ(usable, g_xslab_usable_amount(slab));
+
+	// released by the next shrink once the last blocks come back
+	for (size_t i = 0; i < live.size(); i++) g_xslab_free(slab, live[i]);
+	ASSERT_EQ(10, g_xslab_chunk_count(slab));
+	g_xslab_shrink(slab, 0.0);
+	ASSERT_EQ(1, g_xslab_chunk_count(slab));
+	g_xslab_destroy(slab);
+}
+
+// a fragmented slab: a shrink that can't release enough is not left
+// pending, the later frees keep the blocks and no chunk is added
+TEST(xslab, shrink_fragmented)
+{
+	const int BLOCKS = 100000;
+	g_xslab_t* slab = g_xslab_init(64);
+	std::vector<void*> ptrs(BLOCKS);
+	for (int i = 0; i < BLOCKS; i++) ptrs[i] = g_xslab_alloc(slab);
+	for (int i = 0; i < BLOCKS; i++) {
+		if (i % 50 != 0) g_xslab_free(slab, ptrs[i]);
+	}
+	// a block in use in every chunk
+	int32_t chunks = g_xslab_chunk_count(slab);
+
+	g_xslab_shrink(slab, 0.5);
+	ASSERT_EQ(0, g_xslab_shrink_amount(slab));
+	ASSERT_EQ(BLOCKS - BLOCKS / 50, g_xslab_usable_amount(slab));
+
+	for (int i = 0; i < 1000000; i++) g_xslab_free(slab, g_xslab_alloc(slab));
+	ASSERT_EQ(0, g_xslab_shrink_amount(slab));
+	ASSERT_EQ(BLOCKS - BLOCKS / 50, g_xslab_usable_amount(slab));
+	ASSERT_EQ(chunks, g_xslab_chunk_count(slab));
+
+	for (int i = 0; i < BLOCKS; i += 50) g_xslab_free(slab, ptrs[i]);
+	g_xslab_shrink(slab, 0.5);
+	ASSERT_LT(g_xslab_chunk_count(slab), chunks * 6 / 10);
+	ASSERT_GT(g_xslab_chunk_count(slab), chunks * 4 / 10);
+	g_xslab_destroy(slab);
+}
+
+TEST(xslab, alloc_batch)
+{
+	g_xslab_t* slab = g_xslab_init(64);
+
+	// carved at once, over the chunks
+	void* head;
+	ASSERT_EQ(100, g_xslab_alloc_batch(slab, 100, &head));
+	ASSERT_EQ(2, g_xslab_chunk_count(slab));
+	void* tail = head;
+	int n = 1;
+	for (; ((void**) tail)[0] != NULL; n++) tail = ((void**) tail)[0];
+	ASSERT_EQ(100, n);
+
+	// the free blocks go first
+	g_xslab_free_batch(slab, head, tail, 100);
+	ASSERT_EQ(100, g_xslab_usable_amount(slab));
+	ASSERT_EQ(10, g_xslab_alloc_batch(slab, 10, &head));
+	ASSERT_EQ(90, g_xslab_usable_amount(slab));
+	ASSERT_EQ(2, g_xslab_chunk_count(slab));
+	g_xslab_destroy(slab);
+
+	// a growing slab_t refills its magazine a batch at a time
+	slab_t grow(64, "grow_test");
+	std::vector<void*> ptrs;
+	for (int i = 0; i < 10000; i++) ptrs.push_back(grow.alloc());
+	std::vector<slab_snapshot> snaps;
+	slab_mgr::get_instance()->snapshot(snaps);
+	ASSERT_LE(find_snapshot(snaps, "grow_test")->refills, 10000u / slab_t::MAGAZINE_BATCH + 1);
+	for (int i = 0; i < 10000; i++) grow.free(ptrs[i]);
+}
+
+TEST(xslab, align_and_color)
+{
+	ASSERT_TRUE(NULL == g_xslab_init_ex(24, 48, 0));
+
+	// 31 blocks of 128 bytes in a chunk, 64 bytes left for the color
+	g_xslab_t* slab = g_xslab_init_ex(100, 64, 1);
+	ASSERT_EQ(128, g_xslab_alloc_size(slab));
+
+	std::vector<uintptr_t> firsts;
+	for (int i = 0; i < 1000; i++) {
+		int32_t chunks = g_xslab_chunk_count(slab);
+		uintptr_t ptr = (uintptr_t) g_xslab_alloc(slab);
+		ASSERT_EQ(0u, ptr % 64);
+		if (g_xslab_chunk_count(slab) > chunks) {
+			firsts.push_back(ptr % g_xslab_chunk_size(slab));
+		}
+	}
+
+	// the first blocks of the chunks take turns at the cache lines
+	ASSERT_GT(firsts.size(), 2u);
+	ASSERT_NE(firsts[0], firsts[1]);
+	ASSERT_EQ(firsts[0], firsts[2]);
+	g_xslab_destroy(slab);
+}
+
+static void* magazine_proc(void* param)
+{
+	slab_t* slab = (slab_t*) param;
+	void* ptrs[100];
+	for (int round = 0; round < 1000; round++) {
+		for (int i = 0; i < 100; i++) {
+			ptrs[i] = slab->alloc();
+			memset(ptrs[i], i, 16);
+		}
+		for (int i = 0; i < 100; i++) {
+			slab->free(ptrs[i]);
+		}
+	}
+	return 0;
+}
+
+// the magazines go back to the shared slab at the thread exit
+TEST(slab, thread_magazines)
+{
+	slab_t slab(16);
+
+	g_thread_t tids[4];
+	for (int i = 0; i < 4; i++) {
+		tids[i] = g_thread_start(magazine_proc, &slab);
+	}
+	for (int i = 0; i < 4; i++) {
+		g_thread_join(tids[i], NULL);
 	}
+
+	int32_t usable = slab.get_usable_amount();
+	ASSERT_GE(usable, 100);
+	ASSERT_LE(usable, 4 * (100 + slab_t::MAGAZINE_BATCH));
+
+	// the calling thread keeps at most MAGAZINE_SIZE blocks
+	void* ptrs[100];
+	for (int i = 0; i < 100; i++) ptrs[i] = slab.alloc();
+	for (int i = 0; i < 100; i++) slab.free(ptrs[i]);
+	ASSERT_EQ(usable, slab.get_usable_amount());
+
+	// released by whole chunks, at least half of the free blocks
+	slab.shrink(0.5);
+	ASSERT_EQ(0, slab.get_shrink_amount());
+	ASSERT_LE(slab.get_usable_amount(), usable / 2);
+}
+
+// a shrink doesn't turn off the magazines for good
+TEST(slab, magazines_after_shrink)
+{
+	slab_t slab(16, "magazines_after_shrink");
+	slab.free(slab.alloc());
+	slab.shrink(0.5);
+
+	std::vector<slab_snapshot> snaps;
+	slab_mgr::get_instance()->snapshot(snaps);
+	const slab_snapshot* s = find_snapshot(snaps, "magazines_after_shrink");
+	ASSERT_TRUE(s != NULL);
+	uint64_t refills = s->refills;
+
+	for (int i = 0; i < 10000; i++) slab.free(slab.alloc());
+
+	slab_mgr::get_instance()->snapshot(snaps);
+	s = find_snapshot(snaps, "magazines_after_shrink");
+	ASSERT_TRUE(s != NULL);
+	ASSERT_LE(s->refills, refills + 1);
+	ASSERT_GE(s->hit_rate, 0.99);
 }
 
 TEST(slab, SLAB_NEW)
 {
 	int* int1 = SLAB_NEW(int);
+	int32_t usable = slab_of<int>().get_usable_amount();
 	SLAB_DELETE(int, int1);
-	ASSERT_EQ(1, slab_holder<sizeof(int)>::get_slab().get_usable_amount());
+	ASSERT_EQ(usable + 1, slab_of<int>().get_usable_amount());
+}
+
+namespace slab_test {
+struct order { int64_t id; int64_t price; };
+struct quote { int64_t bid; int64_t ask; };
+}
+
+// the types of the same size share a slab, unless SLAB_NEW_BY_TYPE gives
+// each type its own slab named after it
+TEST(slab, slab_new_names)
+{
+	slab_test::order* o = SLAB_NEW(slab_test::order);
+	slab_test::quote* q = SLAB_NEW(slab_test::quote);
+	ASSERT_EQ(&slab_of<slab_test::order>(), &slab_of<slab_test::quote>());
+	ASSERT_STREQ("slab_new<16>", slab_of<slab_test::order>().name());
+
+	std::vector<slab_snapshot> snaps;
+	slab_mgr::get_instance()->snapshot(snaps);
+	ASSERT_EQ(2u, find_snapshot(snaps, "slab_new<16>")->in_use);
+	SLAB_DELETE(slab_test::order, o);
+	SLAB_DELETE(slab_test::quote, q);
+
+	slab_t& by_type = slab_holder<sizeof(slab_test::order), slab_test::order>::get_slab();
+	ASSERT_NE(&slab_of<slab_test::order>(), &by_type);
+	ASSERT_STREQ("slab_test::order", by_type.name());
+
+	// the names are escaped in json
+	slab_t slab(8, "a \"quoted\"\\name\n");
+	std::string out;
+	slab_mgr::get_instance()->dump_stats(out, true);
+	ASSERT_NE(std::string::npos, out.find("{\"name\":\"a \\\"quoted\\\"\\\\name\\u000a\","));
+}
+
+// the slabs beyond slab_mgr::MAX_CACHED_SLABS work without thread caches
+TEST(slab_mgr, uncached_slabs)
+{
+	std::vector<slab_t*> slabs;
+	slab_t* last = NULL;
+	while (slabs.size() <= slab_mgr::MAX_CACHED_SLABS) {
+		last = new slab_t(8, "uncached_slabs");
+		slabs.push_back(last);
+	}
+	void* ptr = last->alloc();
+	last->free(ptr);
+
+	std::vector<slab_snapshot> snaps;
+	slab_mgr::get_instance()->snapshot(snaps);
+	int cached = 0, uncached = 0;
+	for (size_t i = 0; i < snaps.size(); i++) {
+		if (strcmp(snaps[i].name, "uncached_slabs") != 0) continue;
+		if (snaps[i].cached) cached++;
+		else uncached++;
+	}
+	ASSERT_GE(uncached, 1);
+	ASSERT_EQ((int) slabs.size(), cached + uncached);
+
+	std::string out;
+	slab_mgr::get_instance()->dump_stats(out, true);
+	ASSERT_NE(std::string::npos, out.find("\"cached\":false}"));
+
+	for (size_t i = 0; i < slabs.size(); i++) delete slabs[i];
 }
 
 #include <list>
@@ -254,6 +724,74 @@ TEST(slab_stl_allocator, map)
 //	free(ptrs);
 //}
 
+// constructed before the size classes, destroyed after them at exit
+static std::vector<char*, slab_allocator<char*> > blocks_freed_at_exit;
+
+TEST(size_classes, static_destruction)
+{
+	for (int i = 0; i < 100; i++) blocks_freed_at_exit.push_back(NULL);
+	ASSERT_EQ(100u, blocks_freed_at_exit.size());
+}
+
+TEST(size_classes, classes)
+{
+	size_classes* sc = size_classes::get_instance();
+	ASSERT_EQ(8u, sc->class_size(0));
+	ASSERT_EQ(8u, sc->class_size(1));
+	ASSERT_EQ(24u, sc->class_size(17));
+	ASSERT_EQ(64u, sc->class_size(64));
+	ASSERT_EQ(80u, sc->class_size(65));
+	ASSERT_EQ(160u, sc->class_size(129));
+	ASSERT_EQ(4096u, sc->class_size(3585));
+	ASSERT_EQ(0u, sc->class_size(4097));
+
+	// never more than 25% wasted above 64 bytes
+	for (size_t size = 65; size <= size_classes::MAX_SIZE; size++) {
+		ASSERT_GE(sc->class_size(size), size);
+		ASSERT_LE(sc->class_size(size), size + size / 4);
+	}
+
+	for (size_t size = 1; size < 3 * size_classes::MAX_SIZE; size += 61) {
+		char* ptr = (char*) slab_alloc(size);
+		ASSERT_TRUE(ptr != NULL);
+		memset(ptr, 1, size);
+		slab_free(ptr, size);
+	}
+}
+
+#include <string>
+#include "sax/c++/lru_map.h"
+#include "sax/c++/expire.h"
+
+TEST(slab_allocator, containers)
+{
+	typedef std::basic_string<char, std::char_traits<char>, slab_allocator<char> > slab_string;
+
+	std::vector<slab_string, slab_allocator<slab_string> > v;
+	for (int i = 0; i < 10000; i++) {
+		v.push_back(slab_string(i % 100 + 20, 'a' + i % 26));
+	}
+	ASSERT_EQ(10000u, v.size());
+	ASSERT_EQ(slab_string(45, 'a' + 25 % 26), v[25]);
+
+	std::map<int, slab_string, std::less<int>,
+			slab_allocator<std::pair<const int, slab_string> > > m;
+	for (int i = 0; i < 1000; i++) m[i] = v[i];
+	ASSERT_EQ(v[999], m[999]);
+
+	LRU_map<int, int, slab_allocator<std::pair<int, int> > > lru(16);
+	for (int i = 0; i < 100; i++) lru.insert(i, i * 2);
+	ASSERT_EQ(16u, lru.size());
+	ASSERT_EQ(198, *lru.find(99));
+	ASSERT_TRUE(lru.find(0) == NULL);
+
+	expire<int, slab_allocator<int> > exp(60, 16);
+	for (int i = 0; i < 100; i++) ASSERT_TRUE(exp.add(i));
+	ASSERT_TRUE(exp.sub(50));
+	ASSERT_FALSE(exp.get(50));
+	ASSERT_EQ(99u, exp.size());
+}
+
 int main(int argc, char *argv[])
 {
     testing::InitGoogleTest(&argc, argv);
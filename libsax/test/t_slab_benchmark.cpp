@@ -138,14 +138,86 @@ clock_t test_slab_stl_allocator(int count)
 	return end - start;
 }
 
+/*********************************************************************/
+// multi-threaded: every thread allocates and frees "count" blocks of 24
+// bytes in rounds of 32
+
+enum mt_mode {MT_MALLOC, MT_LOCKED_XSLAB, MT_SLAB};
+
+struct mt_param
+{
+	mt_mode mode;
+	int count;
+	g_xslab_t* xslab;
+	g_spin_t* lock;
+};
+
+void* mt_proc(void* p)
+{
+	mt_param* param = (mt_param*) p;
+	void* ptrs[32];
+	sax::slab_t& slab = sax::slab_holder<24>::get_slab();
+
+	for (int round = 0; round < param->count / 32; round++) {
+		for (int i = 0; i < 32; i++) {
+			switch (param->mode) {
+			case MT_MALLOC: ptrs[i] = malloc_wrap(24); break;
+			case MT_LOCKED_XSLAB:
+				g_spin_enter(param->lock, 128);
+				ptrs[i] = g_xslab_alloc(param->xslab);
+				g_spin_leave(param->lock);
+				break;
+			case MT_SLAB: ptrs[i] = slab.alloc(); break;
+			}
+		}
+		for (int i = 0; i < 32; i++) {
+			switch (param->mode) {
+			case MT_MALLOC: free_wrap(ptrs[i]); break;
+			case MT_LOCKED_XSLAB:
+				g_spin_enter(param->lock, 128);
+				g_xslab_free(param->xslab, ptrs[i]);
+				g_spin_leave(param->lock);
+				break;
+			case MT_SLAB: slab.free(ptrs[i]); break;
+			}
+		}
+	}
+	return 0;
+}
+
+// returns usec of the wall time for "threads" threads
+int64_t test_threads(mt_mode mode, int count, int threads)
+{
+	mt_param param;
+	param.mode = mode;
+	param.count = count;
+	param.xslab = g_xslab_init(24);
+	param.lock = g_spin_init();
+
+	std::vector<g_thread_t> tids(threads);
+	int64_t start = g_now_us();
+	for (int i = 0; i < threads; i++) {
+		tids[i] = g_thread_start(mt_proc, &param);
+	}
+	for (int i = 0; i < threads; i++) {
+		g_thread_join(tids[i], NULL);
+	}
+	int64_t end = g_now_us();
+
+	g_spin_free(param.lock);
+	g_xslab_destroy(param.xslab);
+	return end - start;
+}
+
 int main(int argc, char* argv[])
 {
 	if(argc < 2) {
-		printf("usage: %s count\n", argv[0]);
+		printf("usage: %s count [max_threads]\n", argv[0]);
 		return 1;
 	}
 
 	int count = std::atoi(argv[1]);
+	int max_threads = argc > 2 ? std::atoi(argv[2]) : 0;
 
 	printf("test_malloc: %lu\n", test_malloc(count));
 	printf("test_slab: %lu\n", test_slab(count));
@@ -153,5 +225,13 @@ int main(int argc, char* argv[])
 	printf("test_std_allocator: %lu\n", test_std_allocator(count));
 	printf("test_slab_stl_allocator: %lu\n", test_slab_stl_allocator(count));
 
+	// alloc+free of "count" blocks per thread, in nsec per pair
+	for (int threads = 1; threads <= max_threads; threads *= 2) {
+		printf("%d threads: malloc %.1f ns, locked xslab %.1f ns, slab %.1f ns\n", threads,
+				test_threads(MT_MALLOC, count, threads) * 1000.0 / count,
+				test_threads(MT_LOCKED_XSLAB, count, threads) * 1000.0 / count,
+				test_threads(MT_SLAB, count, threads) * 1000.0 / count);
+	}
+
 	return 0;
 }
@@ -0,0 +1,145 @@
+/*
+ * t_stage_placement.cpp
+ *
+ *  Created on: 2012-9-17
+ *      Author: x
+ */
+
+#include <sched.h>
+
+#include "sax/stage/stage.h"
+#include "sax/stage/stimer.h"
+#include "gtest/gtest.h"
+
+TEST(os_api, parse_cpu_list)
+{
+	int cpus[16];
+	ASSERT_EQ(0, g_parse_cpu_list("", cpus, 16));
+	ASSERT_EQ(1, g_parse_cpu_list("3", cpus, 16));
+	ASSERT_EQ(3, cpus[0]);
+
+	ASSERT_EQ(7, g_parse_cpu_list("0-3,8,10-11\n", cpus, 16));
+	int expected[] = {0, 1, 2, 3, 8, 10, 11};
+	for (int i = 0; i < 7; i++) ASSERT_EQ(expected[i], cpus[i]);
+
+	ASSERT_EQ(2, g_parse_cpu_list("0-15", cpus, 2));	// truncated
+	ASSERT_EQ(-1, g_parse_cpu_list("3-1", cpus, 16));
+	ASSERT_EQ(-1, g_parse_cpu_list("a", cpus, 16));
+	ASSERT_EQ(-1, g_parse_cpu_list("1;2", cpus, 16));
+}
+
+TEST(os_api, numa_nodes)
+{
+	int nodes = g_numa_node_count();
+	ASSERT_GE(nodes, 1);
+
+	int cpus[1024];
+	int total = 0;
+	for (int node = 0; node < nodes; node++) {
+		int n = g_numa_node_cpus(node, cpus, 1024);
+		ASSERT_GE(n, 0);
+		for (int i = 0; i < n; i++) {
+			ASSERT_EQ(node, g_numa_node_of_cpu(cpus[i]));
+		}
+		total += n;
+	}
+	ASSERT_GT(total, 0);
+
+	char* p = (char*) g_numa_alloc_pages(4, 0);
+	ASSERT_TRUE(p != NULL);
+	memset(p, 1, g_shm_unit() * 4);
+	g_numa_free_pages(p, 4);
+}
+
+TEST(stage_placement, thread_cpus)
+{
+	sax::stage_placement placement;
+	int32_t cpus[sax::stage_placement::MAX_CPUS];
+	ASSERT_EQ(0, placement.thread_cpus(0, cpus, sax::stage_placement::MAX_CPUS));
+	ASSERT_EQ(-1, placement.thread_node(0));
+
+	ASSERT_TRUE(placement.set_cpus("2,4-5"));
+	ASSERT_EQ(3, placement.thread_cpus(1, cpus, sax::stage_placement::MAX_CPUS));
+
+	placement.isolate = true;
+	ASSERT_EQ(1, placement.thread_cpus(0, cpus, sax::stage_placement::MAX_CPUS));
+	ASSERT_EQ(2, cpus[0]);
+	ASSERT_EQ(1, placement.thread_cpus(2, cpus, sax::stage_placement::MAX_CPUS));
+	ASSERT_EQ(5, cpus[0]);
+	ASSERT_EQ(1, placement.thread_cpus(3, cpus, sax::stage_placement::MAX_CPUS));
+	ASSERT_EQ(2, cpus[0]);
+
+	ASSERT_FALSE(placement.set_cpus("x"));
+
+	sax::stage_placement node;
+	node.numa_node = 0;
+	ASSERT_EQ(0, node.thread_node(7));
+	ASSERT_GT(node.thread_cpus(0, cpus, sax::stage_placement::MAX_CPUS), 0);
+}
+
+static volatile int bound_cpus[2] = {-1, -1};
+static volatile long handled_events = 0;
+
+struct placed_event : public sax::user_event_base<1, placed_event> {};
+
+class placed_handler : public sax::handler_base
+{
+public:
+	virtual bool init(void* param) { return true; }
+	virtual void on_start(int32_t thread_id)
+	{
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		sched_getaffinity(0, sizeof(set), &set);
+		bound_cpus[thread_id] = CPU_COUNT(&set) == 1 ? sched_getcpu() : -2;
+	}
+	virtual void on_event(const sax::event_type* ev)
+	{
+		__sync_fetch_and_add(&handled_events, 1);
+	}
+};
+
+TEST(stage_placement, bind_threads)
+{
+	sax::stage_options options;
+	options.placement.set_cpus("0");
+	options.placement.isolate = true;
+	options.placement.numa_node = 0;	// the queues are allocated on node 0
+
+	sax::stage* st = sax::stage_creator<placed_handler>::create_stage(
+			"placed", 2, NULL, 64 * 1024, new sax::default_dispatcher(), options);
+	ASSERT_TRUE(st != NULL);
+
+	for (int i = 0; i < 1000; i++) {
+		st->push_event(st->allocate_event<placed_event>());
+	}
+	while (handled_events < 1000) g_thread_sleep(0.001);
+
+	ASSERT_EQ(0, bound_cpus[0]);
+	ASSERT_EQ(0, bound_cpus[1]);
+
+	st->signal_stop();
+	st->wait_for_stop();
+	sax::stage_mgr::get_instance()->unregister_stage(st);
+	delete st;
+}
+
+TEST(stage_placement, timer_stage)
+{
+	sax::stage_options options;
+	options.placement.set_cpus("0");
+
+	sax::stage* timer = sax::create_stimer(64 * 1024, options);
+	ASSERT_TRUE(timer != NULL);
+
+	timer->signal_stop();
+	timer->wait_for_stop();
+	sax::stage_mgr::get_instance()->unregister_stage(timer);
+	delete timer;
+}
+
+int main(int argc, char* argv[])
+{
+	testing::InitGoogleTest(&argc, argv);
+	return RUN_ALL_TESTS();
+}
@@ -0,0 +1,168 @@
+/*
+ * t_stage_stats.cpp
+ *
+ *  Created on: 2012-9-12
+ *      Author: x
+ */
+
+#include <string>
+#include <vector>
+
+#include "sax/stage/stage.h"
+#include "gtest/gtest.h"
+
+struct stats_event : public sax::user_event_base<1, stats_event>
+{
+	int32_t cost_us;
+};
+
+static volatile long handled_events = 0;
+
+class stats_handler : public sax::handler_base
+{
+public:
+	virtual bool init(void* param) { return true; }
+	virtual void on_event(const sax::event_type* ev)
+	{
+		const stats_event* e = (const stats_event*) ev;
+		int64_t end = g_now_us() + e->cost_us;
+		while (g_now_us() < end) g_thread_pause();
+		__sync_fetch_and_add(&handled_events, 1);
+	}
+};
+
+static sax::stage_snapshot* find_snapshot(std::vector<sax::stage_snapshot>& snaps,
+		const char* name)
+{
+	for (size_t i = 0; i < snaps.size(); i++) {
+		if (strcmp(snaps[i].name, name) == 0) return &snaps[i];
+	}
+	return NULL;
+}
+
+static void stop_stage(sax::stage* st)
+{
+	st->signal_stop();
+	st->wait_for_stop();
+	sax::stage_mgr::get_instance()->unregister_stage(st);
+	delete st;
+}
+
+TEST(latency_histogram, percentile)
+{
+	sax::latency_histogram h;
+	ASSERT_EQ(0u, h.percentile(0.5));
+
+	for (int i = 0; i < 99; i++) h.record(10);
+	h.record(5000);
+
+	ASSERT_EQ(100u, h.count);
+	ASSERT_EQ(5000u, h.max);
+	ASSERT_EQ(15u, h.percentile(0.5));		// 10 is in [8, 16)
+	ASSERT_EQ(5000u, h.percentile(0.999));
+	ASSERT_EQ((99u * 10 + 5000) / 100, h.average());
+
+	sax::latency_histogram other;
+	other.record(-1);	// clock skew counts as zero
+	h.merge(other);
+	ASSERT_EQ(101u, h.count);
+	ASSERT_EQ(1u, h.buckets[0]);
+}
+
+TEST(stage_stats, snapshot)
+{
+	const int32_t EVENTS = 1000;
+	handled_events = 0;
+
+	sax::stage* st = sax::stage_creator<stats_handler>::create_stage(
+			"stats_test", 2, NULL, 256 * 1024, new sax::default_dispatcher());
+	ASSERT_TRUE(st != NULL);
+
+	std::vector<sax::stage_snapshot> snaps;
+	sax::stage_mgr::get_instance()->snapshot(snaps);
+	sax::stage_snapshot* snap = find_snapshot(snaps, "stats_test");
+	ASSERT_TRUE(snap != NULL);
+	ASSERT_EQ(2u, snap->threads);
+	ASSERT_EQ(0u, snap->events);
+
+	for (int32_t i = 0; i < EVENTS; i++) {
+		stats_event* ev = st->allocate_event<stats_event>(0);
+		ev->cost_us = i % 100 == 0 ? 100 : 0;
+		st->push_event(ev);
+	}
+	while (handled_events < EVENTS) g_thread_sleep(0.001);
+	g_thread_sleep(0.01);
+
+	snaps.clear();
+	sax::stage_mgr::get_instance()->snapshot(snaps);
+	snap = find_snapshot(snaps, "stats_test");
+	ASSERT_TRUE(snap != NULL);
+	ASSERT_EQ((uint64_t) EVENTS, snap->events);
+	ASSERT_EQ((uint64_t) EVENTS, snap->queue_delay.count);
+	ASSERT_EQ((uint64_t) EVENTS, snap->handle_time.count);
+	ASSERT_GE(snap->handle_time.max, 100u);
+	ASSERT_EQ(0u, snap->depth);
+	ASSERT_GT(snap->events_per_sec, 0.0);
+
+	std::string text;
+	sax::stage_mgr::get_instance()->dump_stats(text);
+	printf("%s", text.c_str());
+	ASSERT_NE(std::string::npos, text.find("stats_test: threads=2"));
+
+	std::string json;
+	sax::stage_mgr::get_instance()->dump_stats(json, true);
+	printf("%s\n", json.c_str());
+	ASSERT_EQ('[', json[0]);
+	ASSERT_EQ(']', json[json.size() - 1]);
+	ASSERT_NE(std::string::npos, json.find("\"name\":\"stats_test\""));
+
+	stop_stage(st);
+}
+
+TEST(stage_stats, disabled)
+{
+	const int32_t EVENTS = 100;
+	handled_events = 0;
+
+	sax::stage_options options;
+	options.telemetry = false;
+	sax::stage* st = sax::stage_creator<stats_handler>::create_stage(
+			"stats_off", 1, NULL, 64 * 1024, new sax::single_dispatcher(), options);
+	ASSERT_TRUE(st != NULL);
+
+	for (int32_t i = 0; i < EVENTS; i++) {
+		stats_event* ev = st->allocate_event<stats_event>(0);
+		ev->cost_us = 0;
+		st->push_event(ev);
+	}
+	while (handled_events < EVENTS) g_thread_sleep(0.001);
+
+	std::vector<sax::stage_snapshot> snaps;
+	sax::stage_mgr::get_instance()->snapshot(snaps);
+	sax::stage_snapshot* snap = find_snapshot(snaps, "stats_off");
+	ASSERT_TRUE(snap != NULL);
+	ASSERT_EQ(0u, snap->events);
+	ASSERT_EQ(0u, snap->queue_delay.count);
+
+	stop_stage(st);
+}
+
+// the names are escaped in json
+TEST(stage_stats, json_names)
+{
+	sax::stage* st = sax::stage_creator<stats_handler>::create_stage(
+			"a \"quoted\"\\stage\t", 1, NULL, 64 * 1024, new sax::single_dispatcher());
+	ASSERT_TRUE(st != NULL);
+
+	std::string json;
+	sax::stage_mgr::get_instance()->dump_stats(json, true);
+	ASSERT_NE(std::string::npos, json.find("{\"name\":\"a \\\"quoted\\\"\\\\stage\\u0009\","));
+
+	stop_stage(st);
+}
+
+int main(int argc, char* argv[])
+{
+	testing::InitGoogleTest(&argc, argv);
+	return RUN_ALL_TESTS();
+}
@@ -196,6 +196,103 @@ TEST(timer, cancel_when_firing)
 	g_timer_destroy(timer, NULL);
 }
 
+struct periodic_state
+{
+	g_timer_t* timer;
+	g_timer_handle_t handle;
+	int fired;
+	int stop_at;		// cancel itself at this firing
+	int restart_at;		// restart itself at this firing, one-shot
+	bool same_handle;
+};
+
+static void periodic_proc(g_timer_handle_t handle, void* param)
+{
+	periodic_state* st = (periodic_state*) param;
+	if (handle != st->handle) st->same_handle = false;
+
+	if (++st->fired == st->stop_at) {
+		EXPECT_EQ(0, g_timer_cancel(st->timer, handle, NULL));
+		EXPECT_EQ(1, g_timer_cancel(st->timer, handle, NULL));
+	}
+	if (st->fired < st->restart_at) {
+		EXPECT_EQ(0, g_timer_restart(st->timer, handle, 10));
+	}
+}
+
+TEST(timer, periodic)
+{
+	g_timer_t* timer = g_timer_create();
+	periodic_state st = {timer, NULL, 0, 0, 0, true};
+
+	st.handle = g_timer_start_periodic(timer, 5, 300, periodic_proc, &st);
+	ASSERT_TRUE(st.handle != NULL);
+
+	g_timer_poll(timer, 4);
+	ASSERT_EQ(0, st.fired);
+	g_timer_poll(timer, 1);
+	ASSERT_EQ(1, st.fired);
+	ASSERT_EQ(1u, g_timer_count(timer));
+
+	g_timer_poll(timer, 300 * 9);
+	ASSERT_EQ(10, st.fired);
+	ASSERT_TRUE(st.same_handle);
+
+	// moved in place, the period stays
+	ASSERT_EQ(0, g_timer_restart(timer, st.handle, 50));
+	g_timer_poll(timer, 50);
+	ASSERT_EQ(11, st.fired);
+	g_timer_poll(timer, 300);
+	ASSERT_EQ(12, st.fired);
+
+	ASSERT_EQ(0, g_timer_cancel(timer, st.handle, NULL));
+	ASSERT_EQ(0u, g_timer_count(timer));
+	g_timer_poll(timer, 1000);
+	ASSERT_EQ(12, st.fired);
+
+	// cancelled in its own proc
+	periodic_state st2 = {timer, NULL, 0, 3, 0, true};
+	st2.handle = g_timer_start_periodic(timer, 1, 1, periodic_proc, &st2);
+	g_timer_poll(timer, 10);
+	ASSERT_EQ(3, st2.fired);
+	ASSERT_EQ(0u, g_timer_count(timer));
+
+	g_timer_destroy(timer, NULL);
+}
+
+TEST(timer, restart)
+{
+	g_timer_t* timer = g_timer_create();
+	volatile int a = 0;
+
+	g_timer_handle_t h = g_timer_start(timer, 10, inc_one, (void*) &a);
+	g_timer_poll(timer, 8);
+	ASSERT_EQ(0, g_timer_restart(timer, h, 10));
+	g_timer_poll(timer, 9);
+	ASSERT_EQ(0, a);
+	g_timer_poll(timer, 1);
+	ASSERT_EQ(1, a);
+	ASSERT_EQ(1, g_timer_restart(timer, h, 10));	// fired
+
+	// a one-shot timer keeps its node by restarting itself
+	periodic_state st = {timer, NULL, 0, 0, 5, true};
+	st.handle = g_timer_start(timer, 1, periodic_proc, &st);
+	g_timer_poll(timer, 1000);
+	ASSERT_EQ(5, st.fired);
+	ASSERT_TRUE(st.same_handle);
+	ASSERT_EQ(0u, g_timer_count(timer));
+
+	// restart a timer of level 2 into level 1
+	h = g_timer_start(timer, 70000, inc_one, (void*) &a);
+	ASSERT_EQ(0, g_timer_restart(timer, h, 3));
+	ASSERT_EQ(3u, g_timer_next_expire(timer));
+	g_timer_poll(timer, 3);
+	ASSERT_EQ(2, a);
+	ASSERT_EQ(G_TIMER_NEVER, g_timer_next_expire(timer));
+
+	g_timer_destroy(timer, NULL);
+}
+
 TEST(timer, uint32_overflow)
 {
 	uint32_t umax = ~0u;
@@ -225,6 +322,71 @@ TEST(timer, uint32_overflow)
 	ASSERT_EQ(103, a);
 }
 
+TEST(timer, next_expire)
+{
+	g_timer_t* timer = g_timer_create2(100);
+	volatile int a = 0;
+
+	ASSERT_EQ(G_TIMER_NEVER, g_timer_next_expire(timer));
+
+	g_timer_handle_t h = g_timer_start(timer, 10, inc_one, (void*) &a);
+	ASSERT_EQ(10u, g_timer_next_expire(timer));
+	ASSERT_TRUE(NULL != g_timer_start(timer, 3, inc_one, (void*) &a));
+	ASSERT_EQ(3u, g_timer_next_expire(timer));
+
+	g_timer_poll(timer, 2);
+	ASSERT_EQ(1u, g_timer_next_expire(timer));
+	g_timer_poll(timer, 1);
+	ASSERT_EQ(1, a);
+	ASSERT_EQ(7u, g_timer_next_expire(timer));
+
+	ASSERT_EQ(0, g_timer_cancel(timer, h, NULL));
+	ASSERT_EQ(G_TIMER_NEVER, g_timer_next_expire(timer));
+
+	// level 2: the next expiry is the cascade of its slot, at 1103 & ~0xFF
+	ASSERT_TRUE(NULL != g_timer_start(timer, 1000, inc_one, (void*) &a));
+	uint32_t next = g_timer_next_expire(timer);
+	ASSERT_EQ(1024u - 103, next);
+	g_timer_poll(timer, next);
+	ASSERT_EQ(1000u - next, g_timer_next_expire(timer));
+	g_timer_poll(timer, 1000 - next - 1);
+	ASSERT_EQ(1, a);
+	g_timer_poll(timer, 1);
+	ASSERT_EQ(2, a);
+
+	g_timer_destroy(timer, NULL);
+}
+
+// polling a long gap skips the empty slots, and fires everything due
+TEST(timer, long_gap)
+{
+	g_timer_t* timer = g_timer_create2(12345);
+	volatile int a = 0;
+
+	const uint32_t delays[] = {1, 255, 256, 70000, 20000000, 300000000};
+	const int32_t n = sizeof(delays) / sizeof(delays[0]);
+	for (int32_t i = 0; i < n; i++) {
+		ASSERT_TRUE(NULL != g_timer_start(timer, delays[i], inc_one, (void*) &a));
+	}
+
+	int64_t start = g_now_us();
+	for (int32_t i = 0; i < n; i++) {
+		uint32_t lapsed = delays[i] - (i > 0 ? delays[i - 1] : 0);
+		g_timer_poll(timer, lapsed - 1);
+		ASSERT_EQ(i, a);
+		g_timer_poll(timer, 1);
+		ASSERT_EQ(i + 1, a);
+	}
+
+	g_timer_poll(timer, 4000000000u);
+	ASSERT_EQ(n, a);
+	ASSERT_EQ(0u, g_timer_count(timer));
+	printf("polled %llu ticks in %lld us\n", 300000000ull + 4000000000ull,
+			(long long) (g_now_us() - start));
+
+	g_timer_destroy(timer, NULL);
+}
+
 class test_handler : public sax::handler_base
 {
 public:
@@ -251,6 +413,163 @@ public:
 	}
 };
 
+static void cancel_timer(sax::stage* timer, uint64_t trans_id)
+{
+	sax::cancel_timer_event* ev = timer->allocate_event<sax::cancel_timer_event>(0);
+	ev->trans_id = trans_id;
+	timer->push_event(ev);
+}
+
+TEST(stimer, batch_and_cancel)
+{
+	sax::stage* test_stage = sax::stage_creator<test_handler>::create_stage(
+			"cancel_stage", 1, NULL, 64 * 1024, new sax::default_dispatcher());
+	sax::stage* timer = sax::create_stimer(64 * 1024);
+
+	volatile int a = 0;
+	const int32_t TIMERS = 100;
+
+	sax::add_timers_event* ev = timer->allocate_event_with_payload<sax::add_timers_event>(
+			sax::add_timers_event::bytes(TIMERS));
+	ev->biz_stage = test_stage;
+	ev->count = TIMERS;
+	for (int32_t i = 0; i < TIMERS; i++) {
+		ev->timers()[i].trans_id = i + 1;
+		ev->timers()[i].invoke_param = (void*) &a;
+		ev->timers()[i].delay_ms = 30 + i % 10;
+	}
+	timer->push_event(ev);
+
+	// cancel the even ones, and one never added
+	for (int32_t i = 2; i <= TIMERS; i += 2) cancel_timer(timer, i);
+	cancel_timer(timer, TIMERS + 1);
+
+	g_thread_sleep(0.150);
+	ASSERT_EQ(TIMERS / 2, a);
+
+	// the fired ones can't be cancelled any more
+	cancel_timer(timer, 1);
+
+	// of two timers of the same trans_id, the latest one is cancelled
+	for (int32_t i = 0; i < 2; i++) {
+		sax::add_timer_event* add = timer->allocate_event<sax::add_timer_event>(0);
+		add->biz_stage = test_stage;
+		add->delay_ms = 20;
+		add->invoke_param = (void*) &a;
+		add->trans_id = 7;
+		timer->push_event(add);
+	}
+	cancel_timer(timer, 7);
+
+	g_thread_sleep(0.100);
+	ASSERT_EQ(TIMERS / 2 + 1, a);
+
+	timer->signal_stop();
+	timer->wait_for_stop();
+	test_stage->signal_stop();
+	test_stage->wait_for_stop();
+	sax::stage_mgr::get_instance()->unregister_stage(timer);
+	sax::stage_mgr::get_instance()->unregister_stage(test_stage);
+	delete timer;
+	delete test_stage;
+}
+
+// the timer thread drains its high lane too
+TEST(stimer, high_lane)
+{
+	sax::stage* test_stage = sax::stage_creator<test_handler>::create_stage(
+			"high_lane_stage", 1, NULL, 64 * 1024, new sax::default_dispatcher());
+	sax::stage_options options;
+	options.high_lane_bytes = 16 * 1024;
+	sax::stage* timer = sax::create_stimer(64 * 1024, options);
+	ASSERT_TRUE(timer != NULL);
+
+	volatile int a = 0;
+	for (int32_t i = 0; i < 10; i++) {
+		sax::add_timer_event* add = timer->allocate_event<sax::add_timer_event>(
+				0, true, sax::PRIORITY_HIGH);
+		add->biz_stage = test_stage;
+		add->delay_ms = 10;
+		add->invoke_param = (void*) &a;
+		add->trans_id = i + 1;
+		timer->push_event(add);
+	}
+
+	g_thread_sleep(0.100);
+	ASSERT_EQ(10, a);
+
+	timer->signal_stop();
+	timer->wait_for_stop();
+	test_stage->signal_stop();
+	test_stage->wait_for_stop();
+	sax::stage_mgr::get_instance()->unregister_stage(timer);
+	sax::stage_mgr::get_instance()->unregister_stage(test_stage);
+	delete timer;
+	delete test_stage;
+}
+
+struct arm_event : public sax::user_event_base<1, arm_event>
+{
+	uint32_t delay_ms;
+};
+
+static volatile long local_fired = 0;
+static volatile long local_wrong_thread = 0;
+
+class local_timer_handler : public sax::handler_base
+{
+public:
+	virtual bool init(void* param) { return true; }
+
+	virtual void on_event(const sax::event_type* ev)
+	{
+		sax::thread_obj* self = sax::thread_obj::current();
+		g_timer_start(self->local_timer(), ((const arm_event*) ev)->delay_ms,
+				_fire, self);
+	}
+
+	static void _fire(g_timer_handle_t handle, void* param)
+	{
+		if (sax::thread_obj::current() != param) {
+			__sync_fetch_and_add(&local_wrong_thread, 1);
+		}
+		__sync_fetch_and_add(&local_fired, 1);
+	}
+};
+
+// the timers fire in the thread which armed them, even when it's idle
+TEST(stage, local_timer)
+{
+	ASSERT_TRUE(sax::thread_obj::current() == NULL);
+
+	sax::stage_options options;
+	options.wait.park_timeout = 10;		// woken up by the timers only
+	options.local_timers = true;
+	sax::stage* st = sax::stage_creator<local_timer_handler>::create_stage(
+			"local_timer", 2, NULL, 64 * 1024, new sax::default_dispatcher(), options);
+	ASSERT_TRUE(st != NULL);
+
+	for (uint32_t i = 0; i < 20; i++) {
+		arm_event* ev = st->allocate_event<arm_event>();
+		ev->delay_ms = 20 + i * 5;
+		st->push_event(ev);
+	}
+
+	g_thread_sleep(0.050);
+	ASSERT_GT(local_fired, 0);
+	ASSERT_LT(local_fired, 20);
+
+	int64_t start = g_now_ms();
+	while (local_fired < 20 && g_now_ms() - start < 2000) g_thread_sleep(0.001);
+	ASSERT_EQ(20, local_fired);
+	ASSERT_EQ(0, local_wrong_thread);
+
+	st->signal_stop();
+	st->wait_for_stop();
+	sax::stage_mgr::get_instance()->unregister_stage(st);
+	delete st;
+}
+
 TEST(stimer, basic_test)
 {
 	sax::stage* test_stage = sax::stage_creator<test_handler>::create_stage(
@@ -0,0 +1,371 @@
+/*
+ * t_timer_benchmark.cpp
+ *
+ *  Created on: 2012-9-25
+ *      Author: x
+ */
+
+#include <cstdlib>
+#include <cstdio>
+#include <vector>
+#include <algorithm>
+#include <malloc.h>
+
+#include "sax/timer.h"
+#include "sax/os_api.h"
+#include "sax/mempool.h"
+
+// bytes allocated from the heap by now
+static int64_t heap_bytes()
+{
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+	return (int64_t) mallinfo2().uordblks;
+#else
+	return (int64_t) mallinfo().uordblks;
+#endif
+}
+
+static uint64_t fired = 0;
+
+static void count_proc(g_timer_handle_t handle, void* param)
+{
+	fired++;
+}
+
+/*********************************************************************/
+// the baseline: a binary min-heap, the index of each node is kept in
+// the node for cancelling
+
+struct heap_node
+{
+	uint64_t expire;
+	uint32_t index;
+	g_timer_proc func;
+	void* user_data;
+};
+
+class heap_timer
+{
+public:
+	heap_timer() : _now(0), _pool(g_xslab_init(sizeof(heap_node))) {}
+	~heap_timer()
+	{
+		for (size_t i = 0; i < _heap.size(); i++) g_xslab_free(_pool, _heap[i]);
+		g_xslab_destroy(_pool);
+	}
+
+	heap_node* start(uint32_t delay, g_timer_proc func, void* user_data)
+	{
+		heap_node* node = (heap_node*) g_xslab_alloc(_pool);
+		node->expire = _now + delay;
+		node->func = func;
+		node->user_data = user_data;
+		node->index = _heap.size();
+		_heap.push_back(node);
+		up(node->index);
+		return node;
+	}
+
+	void cancel(heap_node* node)
+	{
+		uint32_t i = node->index;
+		heap_node* last = _heap.back();
+		_heap.pop_back();
+		if (last != node) {
+			place(last, i);
+			up(i);
+			down(last->index);
+		}
+		g_xslab_free(_pool, node);
+	}
+
+	void poll(uint32_t lapsed)
+	{
+		_now += lapsed;
+		while (!_heap.empty() && _heap[0]->expire <= _now) {
+			heap_node* node = _heap[0];
+			cancel_top();
+			node->func((g_timer_handle_t) node, node->user_data);
+			g_xslab_free(_pool, node);
+		}
+	}
+
+	size_t count() const { return _heap.size(); }
+
+private:
+	void cancel_top()
+	{
+		heap_node* last = _heap.back();
+		_heap.pop_back();
+		if (!_heap.empty()) {
+			place(last, 0);
+			down(0);
+		}
+	}
+
+	inline void place(heap_node* node, uint32_t i)
+	{
+		_heap[i] = node;
+		node->index = i;
+	}
+
+	void up(uint32_t i)
+	{
+		heap_node* node = _heap[i];
+		while (i > 0) {
+			uint32_t parent = (i - 1) / 2;
+			if (_heap[parent]->expire <= node->expire) break;
+			place(_heap[parent], i);
+			i = parent;
+		}
+		place(node, i);
+	}
+
+	void down(uint32_t i)
+	{
+		heap_node* node = _heap[i];
+		uint32_t n = _heap.size();
+		while (1) {
+			uint32_t child = i * 2 + 1;
+			if (child >= n) break;
+			if (child + 1 < n && _heap[child + 1]->expire < _heap[child]->expire) child++;
+			if (node->expire <= _heap[child]->expire) break;
+			place(_heap[child], i);
+			i = child;
+		}
+		place(node, i);
+	}
+
+	uint64_t _now;
+	g_xslab_t* _pool;
+	std::vector<heap_node*> _heap;
+};
+
+/*********************************************************************/
+
+enum distribution {UNIFORM, BIMODAL, SAME};
+static const char* distribution_names[] = {"uniform", "bimodal", "same"};
+
+// in ticks (e.g. milliseconds of the timer stage)
+static void make_delays(distribution dist, uint32_t n, std::vector<uint32_t>& delays)
+{
+	delays.resize(n);
+	for (uint32_t i = 0; i < n; i++) {
+		switch (dist) {
+		case UNIFORM:
+			delays[i] = 1 + rand() % 100000;			// up to 100s
+			break;
+		case BIMODAL:
+			// mostly RPC timeouts, a few long session timeouts
+			delays[i] = rand() % 10 < 9 ? 50 + rand() % 200 : 60000 + rand() % 240000;
+			break;
+		case SAME:
+			delays[i] = 3000;
+			break;
+		}
+	}
+}
+
+static inline double ns_per_op(int64_t us, uint64_t ops)
+{
+	return ops == 0 ? 0.0 : us * 1000.0 / ops;
+}
+
+static uint32_t max_delay(const std::vector<uint32_t>& delays)
+{
+	return *std::max_element(delays.begin(), delays.end());
+}
+
+// start all, cancel half of them and start them again, then poll until
+// all fired. the polling goes in steps of 1 tick, like the timer stage
+static void bench_wheel(distribution dist, const std::vector<uint32_t>& delays)
+{
+	uint32_t n = delays.size();
+	std::vector<g_timer_handle_t> handles(n);
+
+	int64_t mem = heap_bytes();
+	g_timer_t* timer = g_timer_create();
+
+	int64_t start = g_now_us();
+	for (uint32_t i = 0; i < n; i++) {
+		handles[i] = g_timer_start(timer, delays[i], count_proc, NULL);
+	}
+	int64_t start_us = g_now_us() - start;
+	int64_t bytes = heap_bytes() - mem;
+
+	start = g_now_us();
+	for (uint32_t i = 0; i < n; i += 2) {
+		g_timer_cancel(timer, handles[i], NULL);
+	}
+	int64_t cancel_us = g_now_us() - start;
+
+	for (uint32_t i = 0; i < n; i += 2) {
+		handles[i] = g_timer_start(timer, delays[i], count_proc, NULL);
+	}
+
+	fired = 0;
+	uint32_t ticks = max_delay(delays);
+	start = g_now_us();
+	for (uint32_t i = 0; i < ticks; i++) {
+		g_timer_poll(timer, 1);
+	}
+	int64_t poll_us = g_now_us() - start;
+
+	printf("  wheel  %-8s n=%-9u start %6.1f ns  cancel %6.1f ns  poll %6.1f ns/fire"
+			" (%u ticks, %6.1f ns/tick)  %5.1f bytes/timer\n",
+			distribution_names[dist], n, ns_per_op(start_us, n), ns_per_op(cancel_us, n / 2),
+			ns_per_op(poll_us, fired), ticks, ns_per_op(poll_us, ticks),
+			(double) bytes / n);
+
+	if (fired != n) printf("  ERROR: %llu of %u timers fired\n", (unsigned long long) fired, n);
+	g_timer_destroy(timer, NULL);
+}
+
+static void bench_heap(distribution dist, const std::vector<uint32_t>& delays)
+{
+	uint32_t n = delays.size();
+	std::vector<heap_node*> handles(n);
+
+	int64_t mem = heap_bytes();
+	heap_timer* timer = new heap_timer();
+
+	int64_t start = g_now_us();
+	for (uint32_t i = 0; i < n; i++) {
+		handles[i] = timer->start(delays[i], count_proc, NULL);
+	}
+	int64_t start_us = g_now_us() - start;
+	int64_t bytes = heap_bytes() - mem;
+
+	start = g_now_us();
+	for (uint32_t i = 0; i < n; i += 2) {
+		timer->cancel(handles[i]);
+	}
+	int64_t cancel_us = g_now_us() - start;
+
+	for (uint32_t i = 0; i < n; i += 2) {
+		handles[i] = timer->start(delays[i], count_proc, NULL);
+	}
+
+	fired = 0;
+	uint32_t ticks = max_delay(delays);
+	start = g_now_us();
+	for (uint32_t i = 0; i < ticks; i++) {
+		timer->poll(1);
+	}
+	int64_t poll_us = g_now_us() - start;
+
+	printf("  heap   %-8s n=%-9u start %6.1f ns  cancel %6.1f ns  poll %6.1f ns/fire"
+			" (%u ticks, %6.1f ns/tick)  %5.1f bytes/timer\n",
+			distribution_names[dist], n, ns_per_op(start_us, n), ns_per_op(cancel_us, n / 2),
+			ns_per_op(poll_us, fired), ticks, ns_per_op(poll_us, ticks),
+			(double) bytes / n);
+
+	if (fired != n) printf("  ERROR: %llu of %u timers fired\n", (unsigned long long) fired, n);
+	delete timer;
+}
+
+// the cost of the tick which cascades "n" timers of a higher level
+// into the lower ones, against a tick with nothing to do
+static void bench_cascade(uint32_t n)
+{
+	const uint32_t boundaries[] = {0x100, 0x10000, 0x1000000};
+	const char* names[] = {"level 2 -> 1", "level 3 -> 2", "level 4 -> 3"};
+
+	for (int32_t b = 0; b < 3; b++) {
+		g_timer_t* timer = g_timer_create();
+		uint32_t boundary = boundaries[b];
+
+		// all of them are in the slot cascaded at "boundary * 2"
+		for (uint32_t i = 0; i < n; i++) {
+			g_timer_start(timer, boundary * 2 + 1 + i % (boundary - 1), count_proc, NULL);
+		}
+		g_timer_poll(timer, boundary * 2 - 2);
+
+		int64_t start = g_now_hr();
+		g_timer_poll(timer, 1);
+		int64_t idle = g_now_hr() - start;
+
+		start = g_now_hr();
+		g_timer_poll(timer, 1);
+		int64_t cascade = g_now_hr() - start;
+
+		printf("  cascade %-13s n=%-9u %8lld us (%5.1f ns/timer), an idle tick %lld us\n",
+				names[b], n, (long long) cascade, ns_per_op(cascade, n), (long long) idle);
+
+		g_timer_destroy(timer, NULL);
+	}
+}
+
+struct jitter_param
+{
+	int64_t due_us;
+	std::vector<int64_t>* lates;
+
+	static void proc(g_timer_handle_t handle, void* param)
+	{
+		jitter_param* p = (jitter_param*) param;
+		p->lates->push_back(g_now_us() - p->due_us);
+	}
+};
+
+// real time: poll the wheel of 1ms ticks like the timer stage does,
+// sleeping until the next expiry, and see how late the timers fire
+static void bench_jitter(uint32_t n)
+{
+	g_timer_t* timer = g_timer_create();
+	std::vector<int64_t> lates;
+	lates.reserve(n);
+
+	std::vector<jitter_param> params(n);
+	int64_t base = g_now_ms();
+	uint64_t last_ms = base;
+	for (uint32_t i = 0; i < n; i++) {
+		uint32_t delay = 1 + rand() % 200;
+		params[i].due_us = (base + delay) * 1000;
+		params[i].lates = &lates;
+		g_timer_start(timer, delay, jitter_param::proc, &params[i]);
+	}
+
+	while (g_timer_count(timer) > 0) {
+		uint32_t next = g_timer_next_expire(timer);
+		g_thread_sleep(next * 0.001);
+
+		uint64_t now_ms = g_now_ms();
+		if (now_ms > last_ms) g_timer_poll(timer, now_ms - last_ms);
+		last_ms = now_ms;
+	}
+
+	std::sort(lates.begin(), lates.end());
+	printf("  jitter n=%u: late p50 %lld us, p99 %lld us, max %lld us (1ms ticks)\n",
+			n, (long long) lates[n / 2], (long long) lates[n * 99 / 100],
+			(long long) lates.back());
+
+	g_timer_destroy(timer, NULL);
+}
+
+int main(int argc, char* argv[])
+{
+	uint32_t max = argc > 1 ? (uint32_t) std::atoi(argv[1]) : 1000000;
+	if (max < 10000) {
+		printf("usage: %s [max_timers >= 10000, default 1000000]\n", argv[0]);
+		return 1;
+	}
+
+	srand(1);
+	g_now_hr();		// calibrated at the first call
+
+	std::vector<uint32_t> delays;
+	for (uint32_t n = 10000; n <= max; n *= 10) {
+		printf("%u timers:\n", n);
+		for (int32_t d = UNIFORM; d <= SAME; d++) {
+			make_delays((distribution) d, n, delays);
+			bench_wheel((distribution) d, delays);
+			bench_heap((distribution) d, delays);
+		}
+		bench_cascade(n);
+	}
+
+	bench_jitter(10000);
+
+	return 0;
+}